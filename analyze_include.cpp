@@ -2,15 +2,21 @@
 #include "compile_commands_processor.h"
 
 #include <cctype>
-#include <fstream>
-#include <ios>
+#include <cstdint>
 #include <string_view>
 #include <algorithm>
 #include <set>
-#include <thread>
 #include <mutex>
 
+#include "depfile.h"
+#include "include_cache.h"
+#include "include_resolver.h"
 #include "log.h"
+#include "readahead.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "vfs.h"
 
 auto spaceFinder(std::string_view &sv)
 {
@@ -56,7 +62,7 @@ std::optional<std::string_view> matchIfndefDirective(std::string_view sv)
   return {};
 }
 
-std::optional<std::string_view> matchIncludeDirective(std::string_view sv)
+std::optional<std::string_view> matchIncludeDirective(std::string_view sv, bool &angle)
 {
   auto space = spaceFinder(sv);
   auto not_space = nonSpaceFinder(sv);
@@ -82,13 +88,14 @@ std::optional<std::string_view> matchIncludeDirective(std::string_view sv)
     auto inc_beg = not_space(macro_end);
     if (inc_beg == sv.end())
       return {};
-    if (*inc_beg != '"')
+    if (*inc_beg != '"' && *inc_beg != '<')
       return {};
+    angle = *inc_beg == '<';
 
     ++inc_beg;
     auto inc_end = space(inc_beg);
     --inc_end;
-    if (*inc_end != '"')
+    if (*inc_end != (angle ? '>' : '"'))
       return {};
 
     return std::string_view(&*inc_beg, std::distance(inc_beg, inc_end));
@@ -96,37 +103,118 @@ std::optional<std::string_view> matchIncludeDirective(std::string_view sv)
   return {};
 }
 
-std::optional<std::string> getHeaderGuard(fs::path h)
+std::string_view skipBOM(std::string_view line)
+{
+  if (line.size() >= 3 && (uint8_t)line[0] == 0xef && (uint8_t)line[1] == 0xbb && (uint8_t)line[2] == 0xbf)
+    line.remove_prefix(3);
+  return line;
+}
+
+ScannedFile scanIncludes(std::string_view content)
 {
-    std::optional<std::string> res;
-    std::ifstream f(h, std::ios_base::in);
-    char line[2048];
+    ScannedFile res;
+    size_t pos = 0;
+    size_t lines = 0;
+    bool physicalFirst = true;
+    auto nextLine = [&](std::string_view &line)
+    {
+        if (pos >= content.size())
+          return false;
+        ++lines;
+        size_t nl = content.find('\n', pos);
+        if (nl == std::string_view::npos)
+          nl = content.size();
+        line = content.substr(pos, nl - pos);
+        pos = nl + 1;
+        if (auto z = line.find('\0'); z != std::string_view::npos)
+          line = line.substr(0, z);
+        if (physicalFirst)
+        {
+          physicalFirst = false;
+          line = skipBOM(line);
+        }
+
+        //header guard is the first #ifndef no matter where
+        if (!res.guard.has_value())
+        {
+            auto not_space = nonSpaceFinder(line);
+            if (not_space(line.begin()) != line.end())
+            {
+                auto guard = matchIfndefDirective(line);
+                if (guard.has_value())
+                    res.guard = *guard;
+            }
+        }
+        return true;
+    };
+    auto startsWith = [](std::string_view sv, std::string_view::iterator first, char c1, char c2)
+    {
+        return *first == c1 && (first + 1) != sv.end() && *(first + 1) == c2;
+    };
+
+    std::string_view line;
+    int lineNumber = 0;
     bool first = true;
-    while(f.getline(line, sizeof(line)))
+    while(nextLine(line))
     {
-        const char *pLine = line;
+        bool wasFirst = first;
         if (first)
         {
           first = false;
-          if ((uint8_t)pLine[0] == 0xef && (uint8_t)pLine[1] == 0xbb && (uint8_t)pLine[2] == 0xbf)
-            pLine += 3;
+          //skip leading comments
+          bool multilineComment = false;
+          bool finished = false;
+          while(true)
+          {
+              auto not_space = nonSpaceFinder(line);
+              auto first = not_space(line.begin());
+              if (first != line.end())
+              {
+                  if (multilineComment)
+                  {
+                      if (line.find("*/") != std::string::npos)
+                          multilineComment = false;
+                  }
+                  else if (startsWith(line, first, '/', '*'))
+                  {
+                      multilineComment = true;
+                      if (line.find("*/") != std::string::npos)
+                          break;
+                  }
+                  else if (!startsWith(line, first, '/', '/'))
+                      break;
+              }
+              if (!nextLine(line))
+              {
+                  finished = true;
+                  break;
+              }
+          }
+          if (finished)
+            break;
         }
-        std::string_view sv(pLine);
-        auto not_space = nonSpaceFinder(sv);
-        auto first = not_space(sv.begin());
-        if (first != sv.end())
+
+        bool angle = false;
+        auto inc = matchIncludeDirective(line, angle);
+        if (inc.has_value())
+            res.includes.push_back(ScannedFile::Inc{lineNumber, std::string(*inc), angle});
+        if (wasFirst)
         {
-            auto guard = matchIfndefDirective(sv);
-            if (guard.has_value())
-            {
-                res = *guard;
-                break;
-            }
+          auto guard = matchIfndefDirective(line);
+          if (guard.has_value())
+              res.leadingGuard = *guard;
         }
+        ++lineNumber;
     }
+    countStat(Counter::LinesScanned, lines);
     return res;
 }
 
+std::optional<std::string> getHeaderGuard(fs::path h)
+{
+    return getIncludeCache().get(h)->guard;
+}
+
 bool is_in_any_dir(std::vector<fs::path> const& boundary, fs::path const& target)
 {
     for (auto const& p : boundary)
@@ -135,9 +223,35 @@ bool is_in_any_dir(std::vector<fs::path> const& boundary, fs::path const& target
     return false;
 }
 
+//the includes of one file are loaded together where the file system can have them in flight at once
+//otherwise the kernel is asked to start reading them while the first ones are parsed
+static void prefetchFrontier(IncludeList const& frontier)
+{
+  bool batching = getFileSystem().batching();
+  if (!batching && !readaheadEnabled())
+    return;
+  std::vector<fs::path> paths;
+  paths.reserve(frontier.size());
+  for(Include const& i : frontier)
+    paths.push_back(i.file);
+  if (batching)
+    getIncludeCache().prefetch(paths);
+  else
+    readaheadFiles(paths);
+}
+
 using isVisitedT = std::function<bool(fs::path const&)>;
+//includes [begin, end) were found going inside target, its own entry is the last one if it has any
+struct VisitSpan
+{
+  fs::path target;
+  size_t begin;
+  size_t end;
+};
+using VisitSpans = std::vector<VisitSpan>;
+
 //returns guard for the target if exists
-std::optional<std::string> getAllRelativeIncludesRecursive(std::vector<fs::path> const& boundary, fs::path const &target, IncludeList &includes, int l, isVisitedT &visited)
+std::optional<std::string> getAllRelativeIncludesRecursive(std::vector<fs::path> const& boundary, fs::path const &target, IncludeList &includes, VisitSpans &spans, int l, isVisitedT &visited)
 {
     if (visited(target))
     {
@@ -145,10 +259,16 @@ std::optional<std::string> getAllRelativeIncludesRecursive(std::vector<fs::path>
       return {};
     }
     IncludeIterator ii(target, false);
-    for (Include i : ii) {
+    IncludeList frontier;
+    for (Include const& i : ii)
+      frontier.push_back(i);
+    prefetchFrontier(frontier);
+    for (Include &i : frontier) {
       std::optional<std::string> g;
-      if (is_in_any_dir(boundary, i.file))
-        g = getAllRelativeIncludesRecursive(boundary, i.file, includes, l + 1, visited);
+      size_t begin = includes.size();
+      bool inside = is_in_any_dir(boundary, i.file);
+      if (inside)
+        g = getAllRelativeIncludesRecursive(boundary, i.file, includes, spans, l + 1, visited);
       else
       {
         g = getHeaderGuard(i.file);
@@ -167,6 +287,8 @@ std::optional<std::string> getAllRelativeIncludesRecursive(std::vector<fs::path>
 		  else
 			lWarn() << "inc (no guard): " << i.file << "\n";
       }
+      if (inside && g.has_value())
+        spans.push_back(VisitSpan{i.file, begin, includes.size()});
     }
 
     return ii.getTargetGuard();
@@ -194,36 +316,45 @@ IncludeList getAllRelativeIncludes(fs::path h, bool recursive, CCOptions const&
         for (Include i : ii) {
           temps.emplace_back(i);
         }
+        prefetchFrontier(temps);
         size_t total = temps.size();
-        size_t threads_count = std::thread::hardware_concurrency();
+        ThreadPool &pool = getThreadPool();
+        size_t threads_count = pool.size();
         size_t per_thread = total / threads_count;
         std::vector<IncludeList> par_results(threads_count);
-        std::vector<std::thread> threads;
-        threads.reserve(threads_count);
-        std::set<fs::path> visited;
-        std::mutex visited_mtx;
-        isVisitedT checkVisited = [&](fs::path const&p)
-        {
-          std::unique_lock<std::mutex> lck(visited_mtx);
-          if (visited.find(p) != visited.end())
-            return true;
-          visited.insert(p);
-          return false;
-        };
+        std::vector<VisitSpans> par_spans(threads_count);
 
+        //files looked at by the helpers belong to the caller
+        DependencySink *deps = DependencyScope::current();
+        const IncludeClosures::Closure *closure = ClosureScope::current();
+        bool closure_fresh = ClosureScope::fresh();
+        const SearchPaths *search = SearchPathScope::current();
         auto work_item = [&](size_t idx)
         {
+          DependencyScope scope(deps);
+          ClosureScope closure_scope(closure, closure_fresh);
+          SearchPathScope search_scope(search);
+          TraceSpan span("include traversal", h);
           size_t from = idx * per_thread;
           size_t to = from + per_thread;
           if ((idx + 1) == threads_count)
             to = total;
           IncludeList &res = par_results[idx];
+          VisitSpans &spans = par_spans[idx];
+          //not shared, so what a part finds doesn't depend on which thread got to a header first
+          std::set<fs::path> visited;
+          isVisitedT checkVisited = [&](fs::path const&p)
+          {
+            return !visited.insert(p).second;
+          };
           for(size_t ii = from; ii < to; ++ii)
           {
             Include &i = temps[ii];
             std::optional<std::string> g;
-            if (is_in_any_dir(allowed_dirs, i.file))
-              g = getAllRelativeIncludesRecursive(allowed_dirs, i.file, res, 1, checkVisited);
+            size_t begin = res.size();
+            bool inside = is_in_any_dir(allowed_dirs, i.file);
+            if (inside)
+              g = getAllRelativeIncludesRecursive(allowed_dirs, i.file, res, spans, 1, checkVisited);
             else
             {
               g = getHeaderGuard(i.file);
@@ -242,22 +373,39 @@ IncludeList getAllRelativeIncludes(fs::path h, bool recursive, CCOptions const&
 				else
 				  lWarn() << "inc (no guard): " << i.file << "\n";
             }
+            if (inside && g.has_value())
+              spans.push_back(VisitSpan{i.file, begin, res.size()});
           }
         };
+        TaskGroup tasks(pool, ThreadPool::kNestedPriority);
         for(size_t i = 0; i < threads_count; ++i)
-          threads.emplace_back(work_item, i);
+          tasks.run([&work_item, i]{ work_item(i); });
+        tasks.wait();
 
         size_t total_res_cnt = 0;
-        size_t idx = 0;
-        for(auto &t : threads)
-        {
-          t.join();
-          total_res_cnt += par_results[idx++].size();
-        }
+        for(auto &r : par_results)
+          total_res_cnt += r.size();
 
+        //leaving out what earlier parts already went inside gives the result of a single pass
         res.reserve(total_res_cnt);
-        for(auto &r : par_results)
-          res.insert(res.end(), r.begin(), r.end());
+        std::set<fs::path> visited;
+        for(size_t idx = 0; idx < threads_count; ++idx)
+        {
+          IncludeList &r = par_results[idx];
+          std::vector<bool> drop(r.size());
+          for(auto const& s : par_spans[idx])
+          {
+            if (visited.count(s.target))
+              std::fill(drop.begin() + s.begin, drop.begin() + s.end, true);
+          }
+          for(size_t i = 0; i < r.size(); ++i)
+          {
+            if (!drop[i])
+              res.emplace_back(std::move(r[i]));
+          }
+          for(auto const& s : par_spans[idx])
+            visited.insert(s.target);
+        }
       //getAllRelativeIncludesRecursive(d, h, res, 0, visited);
     }else
     {
@@ -285,6 +433,17 @@ std::optional<Include> getNthRelativeInclude(fs::path h, int n)
   return {};
 }
 
+fs::path getFirstQuotedInclude(fs::path const& tu)
+{
+  IncludeIterator ii(tu, false);
+  for(const Include& i : ii)
+  {
+    if (!i.angle)
+      return i.file;
+  }
+  return {};
+}
+
 std::optional<Include> findClosestRelativeInclude(fs::path h, fs::path const& close_to, int skip)
 {
   int minDist = 0;
@@ -315,88 +474,77 @@ std::optional<Include> findClosestRelativeInclude(fs::path h, fs::path const& cl
   IncludeIterator::IncludeIterator(fs::path t, bool headerGuardOnIteration/* = true*/):
     m_Target(t),
     m_TargetDir(t),
-    m_File(t, std::ios_base::in),
+    m_Scan(getIncludeCache().get(t)),
     m_HeaderGuardOnIteration(headerGuardOnIteration)
   {
     m_TargetDir.remove_filename();
+    if (!m_HeaderGuardOnIteration)
+      m_TargetGuard = m_Scan->leadingGuard;
   }
 
   bool IncludeIterator::next()
   {
-    if(m_File.getline(m_Buffer, sizeof(m_Buffer)))
+    while (m_Next < m_Scan->includes.size())
     {
-        const char *pLine = m_Buffer;
-        bool wasFirst = m_First;
-        if (m_First)
-        {
-          m_First = false;
-          if ((uint8_t)pLine[0] == 0xef && (uint8_t)pLine[1] == 0xbb && (uint8_t)pLine[2] == 0xbf)
-            pLine += 3;
-
-          bool multilineComment = false;
-          while(true)
-          {
-			  std::string_view sv(pLine);
-			  auto not_space = nonSpaceFinder(sv);
-			  auto first = not_space(sv.begin());
-              if (first != sv.end())
-              {
-                  if (multilineComment)
-                  {
-                      if (sv.find("*/") != std::string::npos)
-                          multilineComment = false;
-                  }
-                  else if (*first == '/' && *(first + 1) == '*')
-                  {
-                      multilineComment = true;
-                      if (sv.find("*/") != std::string::npos)
-                          break;
-                  }
-                  else if (*first != '/' || *(first + 1) != '/')
-					  break;
-              }
-              if (!m_File.getline(m_Buffer, sizeof(m_Buffer)))
-              {
-                  m_Finished = true;
-                  return false;
-              }
-              pLine = m_Buffer;
+        auto const& inc = m_Scan->includes[m_Next++];
+        auto inc_str = inc.spelling;
+        fs::path inc_path = inc_str;
+        const IncludeClosures::Closure *closure = ClosureScope::current();
+        const SearchPaths *search = SearchPathScope::current();
+        //what the compiler didn't open was under a false #if, nothing to probe for
+        if (closure && ClosureScope::fresh()) {
+          if (!inc.angle && inc_path.is_relative()) {
+            inc_path = m_TargetDir;
+            inc_path += inc_str;
+            inc_path = inc_path.lexically_normal();
+          }
+          if (inc.angle || !getIncludeClosures().contains(*closure, inc_path)) {
+            auto resolved = getIncludeClosures().resolve(*closure, inc_str);
+            if (!resolved)
+              continue;
+            inc_path = std::move(*resolved);
           }
         }
-
-        bool res = false;
-        std::string_view sv(pLine);
-        auto inc = matchIncludeDirective(sv);
-        if (inc.has_value())
-        {
-            auto inc_str = *inc;
-            fs::path inc_path = inc_str;
-            if (inc_path.is_relative()) {
-              inc_path = m_TargetDir;
-              inc_path += inc_str;
-              inc_path = inc_path.lexically_normal();
-            }
-            auto guard = m_HeaderGuardOnIteration ? getHeaderGuard(inc_path) : std::optional<std::string>();
-            std::string _g;
-            if (guard.has_value())
-                _g = std::move(*guard);
-
-            m_Include = Include(m_Line, std::move(_g), std::move(inc_path));
-            res = true;
+        else if (inc.angle) {
+          //system headers aren't in the search paths, those are left out
+          if (!search)
+            continue;
+          inc_path = search->find(inc_str, true);
+          if (inc_path.empty())
+            continue;
         }
-        if (!m_HeaderGuardOnIteration && m_TargetGuard.empty() && wasFirst)
-        {
-          auto guard = matchIfndefDirective(sv);
-          if (guard.has_value())
+        else if (inc_path.is_relative()) {
+          inc_path = m_TargetDir;
+          inc_path += inc_str;
+          inc_path = inc_path.lexically_normal();
+          //not next to the includer, found via -iquote or -I then
+          bool found = false;
+          if (search && !getIncludeResolver().exists(inc_path))
+          {
+            if (DependencySink *deps = DependencyScope::current())
+              deps->add(inc_path.string());
+            if (fs::path p = search->find(inc_str, false); !p.empty())
+            {
+              inc_path = std::move(p);
+              found = true;
+            }
+          }
+          if (!found && closure && !getIncludeClosures().contains(*closure, inc_path))
           {
-              m_TargetGuard = *guard;
+            if (auto resolved = getIncludeClosures().resolve(*closure, inc_str))
+              inc_path = std::move(*resolved);
           }
         }
-        ++m_Line;
-        return res;
-    }else
-      m_Finished = true;
-
+        auto guard = m_HeaderGuardOnIteration ? getHeaderGuard(inc_path) : std::optional<std::string>();
+        std::string _g;
+        if (guard.has_value())
+            _g = std::move(*guard);
+
+        m_Include = Include(inc.lineNumber, std::move(_g), std::move(inc_path));
+        m_Include.angle = inc.angle;
+        return true;
+    }
+    m_Finished = true;
     return false;
   }
 
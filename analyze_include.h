@@ -1,10 +1,11 @@
 #ifndef ANALYZER_INCLUDE_H_
 #define ANALYZER_INCLUDE_H_
 
-#include <fstream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include "compile_commands_processor.h"
 
@@ -16,6 +17,7 @@ struct Include
     std::string guard;
     fs::path file;
     int level = 0;
+    bool angle = false;//<...>, found through the search paths
 
     Include() = default;
     Include(int l, std::string g, fs::path f): lineNumber(l), guard(std::move(g)), file(std::move(f)) {}
@@ -29,10 +31,32 @@ struct IncludeConstSpan
     IncludeConstIter to;//past the last of the 'after' includes that needs to be silenced out with guards
 };
 
+//what a single pass over a file yields, include paths are resolved by the user
+struct ScannedFile
+{
+    struct Inc
+    {
+        int lineNumber;
+        std::string spelling;//as written between the quotes
+        bool angle = false;//<...>, found only through the search paths
+    };
+    std::optional<std::string> guard;//first #ifndef anywhere in the file
+    std::string leadingGuard;//#ifndef only if it's the first line after the leading comments
+    std::vector<Inc> includes;
+};
+using ScannedFilePtr = std::shared_ptr<const ScannedFile>;
+
+ScannedFile scanIncludes(std::string_view content);
+//single line matchers, the results point into sv
+std::optional<std::string_view> matchIfndefDirective(std::string_view sv);
+std::optional<std::string_view> matchIncludeDirective(std::string_view sv, bool &angle);
+
 std::optional<std::string> getHeaderGuard(fs::path h);
 IncludeList getAllRelativeIncludes(fs::path h, bool recursive, CCOptions const& opts);
 std::optional<Include> getNthRelativeInclude(fs::path h, int n = 1);
 std::optional<Include> findClosestRelativeInclude(fs::path h, fs::path const& close_to, int skip = 0);
+//what a pch of the TU is made from, <...> includes are library headers and never count
+fs::path getFirstQuotedInclude(fs::path const& tu);
 
 class IncludeIterator
 {
@@ -62,10 +86,8 @@ private:
   fs::path m_TargetDir;
   bool m_Finished = false;
   Include m_Include;
-  char m_Buffer[2048];
-  std::ifstream m_File;
-  int m_Line = 0;
-  bool m_First = true;
+  ScannedFilePtr m_Scan;
+  size_t m_Next = 0;
   bool m_HeaderGuardOnIteration = true;
   std::string m_TargetGuard;
 };
@@ -0,0 +1,424 @@
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "analyze_include.h"
+#include "compile_commands_processor.h"
+#include "include_cache.h"
+#include "indexer_preparator.h"
+#include "json.hpp"
+#include "vfs.h"
+
+//microbenchmarks of the primitives on the hot paths
+//each one runs over an input of a given size, results are per call and per item of the input
+
+template<class T>
+static void keep(T const& v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  asm volatile("" : : "g"(&v) : "memory");
+#else
+  static const volatile void *g_Sink;
+  g_Sink = &v;
+#endif
+}
+
+struct BenchOptions
+{
+  std::vector<size_t> sizes{4, 32, 256};
+  std::string filter;
+  double min_time_ms = 200;
+  size_t repetitions = 5;
+  fs::path json;
+  fs::path dir;//fixtures on disk
+  bool memory = false;//read through a MemoryFileSystem loaded from dir instead
+};
+
+struct BenchResult
+{
+  std::string name;
+  size_t size;
+  size_t items;
+  uint64_t iterations;
+  double ns_per_op;//median of the repetitions
+  double ns_per_op_min;
+};
+
+//returns the number of items one call processed
+using BenchOp = std::function<size_t()>;
+
+struct Bench
+{
+  const char *name;
+  const char *size_means;
+  std::function<BenchOp(size_t size)> setup;
+};
+
+static double runFor(BenchOp const& op, uint64_t iterations)
+{
+  auto start = std::chrono::steady_clock::now();
+  for(uint64_t i = 0; i < iterations; ++i)
+    keep(op());
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static BenchResult runBench(Bench const& b, size_t size, BenchOptions const& opts)
+{
+  BenchResult r{b.name, size, 0, 1, 0, 0};
+  BenchOp op = b.setup(size);
+  //reloaded after every setup, so the fixture it just wrote is in
+  if (opts.memory && !memoryFromTree(opts.dir))
+    throw std::runtime_error("Could not load the fixtures into memory");
+  r.items = op();//warms caches up as well
+
+  //enough iterations for a repetition to take its share of the minimal time
+  double target = opts.min_time_ms * 1e6 / opts.repetitions;
+  double ns = runFor(op, r.iterations);
+  while(ns < target && r.iterations < (1ull << 40))
+  {
+    double factor = ns > 0 ? std::min(10.0, std::max(2.0, 1.2 * target / ns)) : 10.0;
+    r.iterations = (uint64_t)(r.iterations * factor);
+    ns = runFor(op, r.iterations);
+  }
+
+  std::vector<double> per_op;
+  per_op.push_back(ns / r.iterations);
+  for(size_t i = 1; i < opts.repetitions; ++i)
+    per_op.push_back(runFor(op, r.iterations) / r.iterations);
+  std::sort(per_op.begin(), per_op.end());
+  r.ns_per_op = per_op[per_op.size() / 2];
+  r.ns_per_op_min = per_op.front();
+  return r;
+}
+
+/*************************************************************************/
+/*inputs                                                                 */
+/*************************************************************************/
+//what lines of real headers look like, directives are a minority
+static std::vector<std::string> sourceLines(size_t n)
+{
+  static const char *g_Lines[] = {
+    "#include \"core/containers/small_vector.h\"",
+    "  return m_Impl->process(std::move(request), options);",
+    "#include <unordered_map>",
+    "// Copyright (c) the authors. All rights reserved.",
+    "#ifndef CORE_CONTAINERS_SMALL_VECTOR_H_",
+    "template<class T, size_t N> class SmallVector : public SmallVectorBase<T>",
+    "#  include \"detail/platform_win32.h\"",
+    "#define CORE_API __attribute__((visibility(\"default\")))",
+    "",
+    "    for (auto const& item : items) { if (!item.valid()) continue; total += item.size(); }",
+    "#if defined(_WIN32) && !defined(CORE_NO_WINDOWS_H)",
+    "//#ifndef commented out guard",
+    "#endif // CORE_CONTAINERS_SMALL_VECTOR_H_",
+    "\t#include \"generated/messages.pb.h\"",
+  };
+  std::vector<std::string> res;
+  for(size_t i = 0; i < n; ++i)
+    res.push_back(g_Lines[i % std::size(g_Lines)]);
+  return res;
+}
+
+static std::string compileCommand(size_t args)
+{
+  static const char *g_Args[] = {
+    "-DNDEBUG", "-I/work/src/core/include", "-isystem", "/work/third_party/boost", "-Wall", "-Wextra",
+    "-DX=1", "-std=c++17", "-fPIC", "-O2", "-I/work/build/generated", "-DCORE_EXPORTS", "-Werror",
+  };
+  std::string cmd = "/usr/bin/c++";
+  for(size_t i = 0; i < args; ++i)
+  {
+    cmd += ' ';
+    cmd += g_Args[i % std::size(g_Args)];
+  }
+  return cmd + " -o CMakeFiles/core.dir/src/core/containers/small_vector.cpp.o -c /work/src/core/containers/small_vector.cpp";
+}
+
+static void writeFixture(fs::path const& p, std::string const& content)
+{
+  fs::create_directories(p.parent_path());
+  std::ofstream(p, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc) << content;
+}
+
+//<dir>/p/d0/d1/.../d<depth-1>
+static fs::path nestedDir(fs::path const& dir, size_t depth)
+{
+  fs::path p = dir / "p";
+  for(size_t i = 0; i < depth; ++i)
+    p /= "d" + std::to_string(i);
+  fs::create_directories(p);
+  //a directory of the memory file system exists only with a file in it
+  writeFixture(p / "f", "");
+  return p;
+}
+
+//<dir>/inc<n>/h<i>.h with guards, includes.h including all of them
+static fs::path headerFixture(fs::path const& dir, size_t n)
+{
+  fs::path base = dir / ("inc" + std::to_string(n));
+  std::string all = "#ifndef INCLUDES_H_\n#define INCLUDES_H_\n";
+  for(size_t i = 0; i < n; ++i)
+  {
+    std::string name = "h" + std::to_string(i) + ".h";
+    std::string guard = "BENCH_H" + std::to_string(i) + "_H_";
+    writeFixture(base / name, "// leading comment\n#ifndef " + guard + "\n#define " + guard + "\nint f" + std::to_string(i) + "();\n#endif\n");
+    all += "#include \"" + name + "\"\n";
+  }
+  writeFixture(base / "includes.h", all + "#endif\n");
+  return base;
+}
+
+static std::vector<Bench> benches(BenchOptions const& opts)
+{
+  std::vector<Bench> res;
+  res.push_back({"matchIncludeDirective", "lines", [](size_t n) -> BenchOp {
+    return [lines = sourceLines(n)]() {
+      size_t found = 0;
+      bool angle = false;
+      for(auto const& l : lines)
+        found += matchIncludeDirective(l, angle).has_value();
+      keep(found);
+      return lines.size();
+    };
+  }});
+  res.push_back({"matchIfndefDirective", "lines", [](size_t n) -> BenchOp {
+    return [lines = sourceLines(n)]() {
+      size_t found = 0;
+      for(auto const& l : lines)
+        found += matchIfndefDirective(l).has_value();
+      keep(found);
+      return lines.size();
+    };
+  }});
+  res.push_back({"IncludeIterator", "includes", [dir = opts.dir](size_t n) -> BenchOp {
+    fs::path base = headerFixture(dir, n);
+    std::vector<std::string> scanned{(base / "includes.h").string()};
+    for(size_t i = 0; i < n; ++i)
+      scanned.push_back((base / ("h" + std::to_string(i) + ".h")).string());
+    return [f = base / "includes.h", scanned]() {
+      //read and scanned every time, not taken from the cache
+      for(auto const& p : scanned)
+        getIncludeCache().invalidate(p);
+      size_t count = 0;
+      IncludeIterator it(f);
+      for(Include const& i : it)
+      {
+        keep(i);
+        ++count;
+      }
+      return count;
+    };
+  }});
+  res.push_back({"getHeaderGuard", "headers", [dir = opts.dir](size_t n) -> BenchOp {
+    fs::path base = headerFixture(dir, n);
+    std::vector<fs::path> headers;
+    for(size_t i = 0; i < n; ++i)
+      headers.push_back(base / ("h" + std::to_string(i) + ".h"));
+    return [headers]() {
+      for(auto const& h : headers)
+      {
+        getIncludeCache().invalidate(h.string());
+        keep(getHeaderGuard(h));
+      }
+      return headers.size();
+    };
+  }});
+  res.push_back({"is_in_dir", "path components", [dir = opts.dir](size_t n) -> BenchOp {
+    fs::path child = nestedDir(dir, n);
+    fs::path parent = dir / "p";
+    for(size_t i = 0; i < n / 2; ++i)
+      parent /= "d" + std::to_string(i);
+    return [parent, child]() {
+      keep(is_in_dir(parent, child));
+      return (size_t)1;
+    };
+  }});
+  res.push_back({"to_real_path", "path components", [dir = opts.dir](size_t n) -> BenchOp {
+    return [p = nestedDir(dir, n)]() {
+      keep(to_real_path(p, false));
+      return (size_t)1;
+    };
+  }});
+  res.push_back({"remove_search_and_next", "arguments", [](size_t n) -> BenchOp {
+    return [cmd = compileCommand(n)]() {
+      std::string c = cmd;
+      remove_search_and_next(c, "-c");
+      remove_search_and_next(c, "-o");
+      keep(c);
+      return (size_t)1;
+    };
+  }});
+  res.push_back({"escape_spaces", "characters", [](size_t n) -> BenchOp {
+    std::string s = "/work/My Documents/";
+    while(s.size() < n)
+      s += (s.size() % 11) ? "src" : " dir/";
+    return [s]() {
+      keep(escape_spaces(s));
+      return (size_t)1;
+    };
+  }});
+  res.push_back({"add_pch_include", "arguments", [](size_t n) -> BenchOp {
+    struct State
+    {
+      CCOptions opts;
+      std::unique_ptr<IndexerPreparator> prep;
+      std::string cmd;
+      fs::path pch = "/work/src/core/stdafx.h";
+    };
+    auto s = std::make_shared<State>();
+    s->prep = createIndexerPreparator(s->opts);
+    s->cmd = compileCommand(n);
+    return [s]() {
+      keep(s->prep->add_pch_include(s->cmd, s->pch));
+      return (size_t)1;
+    };
+  }});
+  res.push_back({"CCOptions::modify_command", "arguments", [](size_t n) -> BenchOp {
+    auto opts = std::make_shared<CCOptions>();
+    opts->command_modifiers.push_back({std::regex("-DX=1"), "-DX=2"});
+    opts->command_modifiers.push_back({std::regex("-Werror"), ""});
+    opts->command_modifiers.push_back({std::regex("-isystem\\s+\\S+"), ""});
+    return [opts, cmd = compileCommand(n)]() {
+      keep(opts->modify_command(cmd));
+      return (size_t)1;
+    };
+  }});
+  return res;
+}
+
+static std::vector<size_t> parseSizes(std::string_view s)
+{
+  std::vector<size_t> res;
+  while(!s.empty())
+  {
+    size_t comma = s.find(',');
+    res.push_back(std::stoul(std::string(s.substr(0, comma))));
+    s.remove_prefix(comma == std::string_view::npos ? s.size() : comma + 1);
+  }
+  return res;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions opts;
+    bool print_help = false;
+    bool list = false;
+
+    try
+    {
+      for (int i = 1; i < argc; ++i) {
+        std::string_view arg(argv[i]);
+        bool has_value = i + 1 < argc;
+        if (arg == "--help")
+            print_help = true;
+        else if (arg == "--list")
+            list = true;
+        else if (arg == "--filter" && has_value)
+            opts.filter = argv[++i];
+        else if (arg == "--sizes" && has_value)
+            opts.sizes = parseSizes(argv[++i]);
+        else if (arg == "--min-time" && has_value)
+            opts.min_time_ms = std::stod(argv[++i]);
+        else if (arg == "--repetitions" && has_value)
+            opts.repetitions = std::max<size_t>(1, std::stoul(argv[++i]));
+        else if (arg == "--json" && has_value)
+            opts.json = argv[++i];
+        else if (arg == "--dir" && has_value)
+            opts.dir = argv[++i];
+        else if (arg == "--memory")
+            opts.memory = true;
+        else {
+            std::cout << "Unknown argument " << arg << "\n";
+            print_help = true;
+        }
+      }
+    }
+    catch(const std::exception &e)
+    {
+        std::cout << "Encountered an error:\n" << e.what() << "\n";
+        print_help = true;
+    }
+
+    if (print_help)
+    {
+      std::cout << "Usage: prepare_cc_bench [--list] [--filter <substring>] [--sizes <n,n,...>] "
+                   "[--min-time <ms>] [--repetitions <n>] [--json <path-to-results>] "
+                   "[--dir <dir-for-fixtures>] [--memory] [--help]\n";
+      return 0;
+    }
+
+    bool own_dir = opts.dir.empty();
+    if (own_dir)
+      opts.dir = fs::temp_directory_path() / ("prepare_cc_bench_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    opts.dir = fs::absolute(opts.dir).lexically_normal();
+    std::error_code ec;
+    fs::create_directories(opts.dir, ec);
+
+    auto all = benches(opts);
+    if (list)
+    {
+      for(auto const& b : all)
+        std::cout << b.name << " (size: " << b.size_means << ")\n";
+      return 0;
+    }
+
+    std::vector<BenchResult> results;
+    std::cout << std::left << std::setw(28) << "Benchmark" << std::right << std::setw(8) << "size"
+              << std::setw(14) << "ns/op" << std::setw(14) << "ns/item" << std::setw(14) << "iterations" << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+    for(auto const& b : all)
+    {
+      if (std::string_view(b.name).find(opts.filter) == std::string_view::npos)
+        continue;
+      for(size_t size : opts.sizes)
+      {
+        BenchResult r;
+        try
+        {
+          r = runBench(b, size, opts);
+        }
+        catch(const std::exception &e)
+        {
+          std::cout << b.name << ": " << e.what() << "\n";
+          return 1;
+        }
+        std::cout << std::left << std::setw(28) << r.name << std::right << std::setw(8) << r.size
+                  << std::setw(14) << r.ns_per_op << std::setw(14) << r.ns_per_op / std::max<size_t>(1, r.items)
+                  << std::setw(14) << r.iterations << std::endl;
+        results.push_back(std::move(r));
+      }
+    }
+
+    if (own_dir)
+      fs::remove_all(opts.dir, ec);
+
+    if (!opts.json.empty())
+    {
+      nlohmann::json res = nlohmann::json::array();
+      for(auto const& r : results)
+        res.push_back({
+          {"name", r.name},
+          {"size", r.size},
+          {"items", r.items},
+          {"iterations", r.iterations},
+          {"ns_per_op", r.ns_per_op},
+          {"ns_per_op_min", r.ns_per_op_min},
+          {"ns_per_item", r.ns_per_op / std::max<size_t>(1, r.items)}
+        });
+      std::ofstream out(opts.json, std::ios_base::out | std::ios_base::trunc);
+      out << nlohmann::json{{"filesystem", opts.memory ? "memory" : "disk"}, {"benchmarks", res}}.dump(2) << "\n";
+      if (!out.flush())
+      {
+        std::cout << "Could not write " << opts.json << "\n";
+        return 1;
+      }
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef BOUNDED_QUEUE_H_
+#define BOUNDED_QUEUE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+//blocking queue with a capacity limit, producer waits while it's full
+//keeps occupancy numbers to see which side of the queue is the bottleneck
+template<class T>
+class BoundedQueue
+{
+public:
+  struct Stats
+  {
+    size_t capacity = 0;
+    size_t pushed = 0;
+    size_t max_size = 0;
+    size_t size_sum = 0;//sampled on every push, for average occupancy
+    size_t push_waits = 0;//producer found the queue full
+    size_t pop_waits = 0;//consumer found the queue empty
+
+    double avg_size() const { return pushed ? double(size_sum) / pushed : 0.0; }
+  };
+
+  explicit BoundedQueue(size_t capacity): m_Capacity(capacity ? capacity : 1) { m_Stats.capacity = m_Capacity; }
+
+  //false if the queue was closed, v is left untouched then
+  bool push(T &&v)
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    if (m_Items.size() >= m_Capacity && !m_Closed)
+    {
+      ++m_Stats.push_waits;
+      m_NotFull.wait(lck, [&]{ return m_Items.size() < m_Capacity || m_Closed; });
+    }
+    if (m_Closed)
+      return false;
+    m_Items.push_back(std::move(v));
+    ++m_Stats.pushed;
+    m_Stats.size_sum += m_Items.size();
+    if (m_Items.size() > m_Stats.max_size)
+      m_Stats.max_size = m_Items.size();
+    lck.unlock();
+    m_NotEmpty.notify_one();
+    return true;
+  }
+
+  //never waits, false if the queue is full or closed
+  bool try_push(T &&v)
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    if (m_Items.size() >= m_Capacity || m_Closed)
+      return false;
+    m_Items.push_back(std::move(v));
+    ++m_Stats.pushed;
+    m_Stats.size_sum += m_Items.size();
+    if (m_Items.size() > m_Stats.max_size)
+      m_Stats.max_size = m_Items.size();
+    lck.unlock();
+    m_NotEmpty.notify_one();
+    return true;
+  }
+
+  //false if the queue was closed and everything was consumed
+  bool pop(T &v)
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    if (m_Items.empty() && !m_Closed)
+    {
+      ++m_Stats.pop_waits;
+      m_NotEmpty.wait(lck, [&]{ return !m_Items.empty() || m_Closed; });
+    }
+    if (m_Items.empty())
+      return false;
+    v = std::move(m_Items.front());
+    m_Items.pop_front();
+    lck.unlock();
+    m_NotFull.notify_one();
+    return true;
+  }
+
+  //no more pushes, pending items can still be popped
+  void close()
+  {
+    {
+      std::unique_lock<std::mutex> lck(m_Mtx);
+      m_Closed = true;
+    }
+    m_NotFull.notify_all();
+    m_NotEmpty.notify_all();
+  }
+
+  Stats stats() const
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    return m_Stats;
+  }
+
+private:
+  size_t m_Capacity;
+  std::deque<T> m_Items;
+  bool m_Closed = false;
+  Stats m_Stats;
+  mutable std::mutex m_Mtx;
+  std::condition_variable m_NotFull;
+  std::condition_variable m_NotEmpty;
+};
+
+#endif
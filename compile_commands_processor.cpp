@@ -1,136 +1,762 @@
 #include "compile_commands_processor.h"
 
 #include <algorithm>
+#include <chrono>
 #include <exception>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <stdexcept>
 #include <string>
 #include <system_error>
+#include <thread>
 
 #include "analyze_include.h"
+#include "bounded_queue.h"
+#include "cost_model.h"
+#include "depfile.h"
+#include "include_resolver.h"
+#include "file_io.h"
+#include "include_cache.h"
+#include "incremental.h"
 #include "generate_header_blocks.h"
 #include "indexer_preparator.h"
+#include "stamp.h"
+#include "stats.h"
+#include "vfs.h"
+#include "thread_pool.h"
 
 #include "log.h"
 
-using json_filter_func = std::function<bool(nlohmann::json &entry, fs::path file, json_list &to_add)>;
+using json_element_func = std::function<void(nlohmann::json &&element)>;
 
-nlohmann::json internProcessCompileCommands(fs::path compile_commands_json, json_filter_func filter)
+//parses top level array element by element, so the whole document is never kept in memory
+void streamCompileCommands(fs::path compile_commands_json, json_element_func on_element)
 {
-    nlohmann::json res;
-    nlohmann::json cbd;
-    std::ifstream _f(compile_commands_json);
+    PhaseTimer timer(Phase::JsonLoad);
+    std::unique_ptr<std::istream> pf = getFileSystem().open(compile_commands_json);
+    if (!pf)
+    {
+        lErr() << "Could not open " << compile_commands_json << "\n";
+        return;
+    }
+    std::istream &_f = *pf;
+    bool top_array = false;
+    nlohmann::json::parser_callback_t cb = [&](int depth, nlohmann::json::parse_event_t event, nlohmann::json &parsed)
+    {
+        if (depth == 0 && event == nlohmann::json::parse_event_t::array_start)
+            top_array = true;
+        else if (top_array && depth == 1 && event == nlohmann::json::parse_event_t::object_end)
+        {
+            countStat(Counter::EntriesIn);
+            on_element(std::move(parsed));
+            return false;
+        }
+        return true;
+    };
+    nlohmann::json rest = nlohmann::json::parse(_f, cb);
+    _f.clear();
+    if (auto read = _f.tellg(); read > 0)
+        countStat(Counter::BytesRead, (uint64_t)read);
+}
 
-    _f >> cbd;
-    if (cbd.is_array())
+void internProcessCompileCommand(nlohmann::json &obj, json_entry_func const& on_entry)
+{
+    if (obj.is_object() && obj.contains("file") && obj.contains("command") && obj.contains("directory"))
     {
-        json_list temp;
-        for(auto &el : cbd.items())
+        auto _jfile = obj["file"];
+        if (_jfile.is_string() && on_entry)
         {
-            auto obj =  el.value();
-            if (obj.is_object() && obj.contains("file") && obj.contains("command") && obj.contains("directory"))
-            {
-                auto _jfile = obj["file"];
-                if (_jfile.is_string() && filter)
-                {
-                    //ok to process
-                    fs::path target_file(_jfile.get<std::string>());
-                    filter(obj, std::move(target_file), temp);
-                    for(auto &obj : temp)
-                      res.push_back(std::move(obj));
-                    temp.clear();
-                }
-            }
+            //ok to process
+            fs::path target_file(_jfile.get<std::string>());
+            on_entry(obj, std::move(target_file));
         }
     }
-    return res;
 }
 
-bool processCompileCommandsTo(CCOptions const& options)
+fs::path entryOutput(nlohmann::json const& entry)
+{
+    auto o = entry.find("output");
+    if (o == entry.end() || !o->is_string())
+        return fs::path();
+    fs::path res(o->get<std::string>());
+    auto d = entry.find("directory");
+    if (res.is_relative() && d != entry.end() && d->is_string())
+        res = fs::path(d->get<std::string>()) / res;
+    return res.lexically_normal();
+}
+
+void loadIncludeClosures(CCOptions const& options)
+{
+    PhaseTimer timer(Phase::ClosuresLoad);
+    getIncludeClosures().clear();
+    if (!options.depfiles.empty())
+        getIncludeClosures().load(options.depfiles);
+    if (!options.ninja_deps.empty())
+        getIncludeClosures().loadNinjaDeps(options.ninja_deps);
+}
+
+void internProcessCompileCommands(fs::path compile_commands_json, json_entry_func on_entry)
+{
+    streamCompileCommands(compile_commands_json, [&](nlohmann::json &&obj){
+        internProcessCompileCommand(obj, on_entry);
+    });
+}
+
+//writes the same text as std::setw(4) << json_array but one element at a time
+class JsonArrayWriter
 {
-    if (!fs::exists(options.compile_commands_json))
+public:
+    explicit JsonArrayWriter(std::ostream &out): m_Out(out) {}
+
+    //element as it appears inside the array
+    static std::string serialize(nlohmann::json const& obj)
     {
-      lWarn() << "Compile commands json file doesn't exit:\n"
-              << options.compile_commands_json << "\n";
-      return false;
+        PhaseTimer timer(Phase::Serialize);
+        std::string s = obj.dump(4);
+        std::string res;
+        res.reserve(s.size() + s.size() / 8);
+        size_t from = 0;
+        for(size_t nl = s.find('\n'); nl != std::string::npos; nl = s.find('\n', from))
+        {
+            res.append(s, from, nl + 1 - from);
+            res += "    ";
+            from = nl + 1;
+        }
+        res.append(s, from, std::string::npos);
+        return res;
     }
 
-    lWarn() << "Processing compile commands from:\n"
-            << options.compile_commands_json << "\n";
+    void add(nlohmann::json const& obj)
+    {
+        add_serialized(serialize(obj));
+    }
+
+    void add_serialized(std::string_view s)
+    {
+        countStat(Counter::EntriesOut);
+        m_Out << (m_Count++ ? ",\n" : "[\n") << "    ";
+        m_Out.write(s.data(), s.size());
+    }
+
+    void finish()
+    {
+        //nothing was ever added to the resulting json, so it stayed null
+        m_Out << (m_Count ? "\n]" : "null") << std::endl;
+    }
+
+private:
+    std::ostream &m_Out;
+    size_t m_Count = 0;
+};
+
+struct CCEntry
+{
+    enum class Action
+    {
+        AsIs,
+        Quick,
+        Prepare
+    };
+
+    nlohmann::json obj;
+    fs::path file;
+    fs::path stdafx;//first include
+    const SearchPaths *search = nullptr;//of the command as it came
+    Action action = Action::AsIs;
+    json_list out;
+    std::promise<void> prepared;
+    //taken once, a second get_future() throws
+    std::future<void> prepared_done = prepared.get_future();
+    PrepareCostModel::Cost cost = 0;
+    std::optional<size_t> includes;
+
+    //incremental mode
+    uint64_t key = 0;
+    const IncrementalState::Entry *reuse = nullptr;
+    std::unique_ptr<DependencySink> deps;
+};
+
+//state of a single processCompileCommandsTo call shared by all stages
+struct ProcessRun
+{
+    ProcessRun(CCOptions const& o, IndexerPreparator &i, PrepareCostModel &c): options(o), indexer(i), costs(c) {}
+
+    CCOptions const& options;
+    IndexerPreparator &indexer;
+    PrepareCostModel &costs;
+    IncrementalState *prev = nullptr;//results of the previous run
+    IncrementalStateWriter *next = nullptr;//results of this run
+    std::set<fs::path> seen_stdafx;
+};
+
+static IncrementalState::Kind toKind(CCEntry::Action a)
+{
+    switch(a)
+    {
+      case CCEntry::Action::Quick: return IncrementalState::Kind::Quick;
+      case CCEntry::Action::Prepare: return IncrementalState::Kind::Prepare;
+      default: return IncrementalState::Kind::AsIs;
+    }
+}
+
+//identifies an input entry together with how it's going to be handled
+static uint64_t entryKey(CCEntry const& e)
+{
+    uint64_t h = hashBytes(e.obj.dump());
+    uint8_t action = (uint8_t)toKind(e.action);
+    h = hashBytes(std::string_view((const char*)&action, 1), h);
+    return hashBytes(e.stdafx.string(), h);
+}
+
+void modifyEntry(CCOptions const& options, CCEntry &e)
+{
+    nlohmann::json &entry = e.obj;
+    if (!options.command_modifiers.empty() && entry["command"].is_string())
+    {
+      std::string before = entry["command"].get<std::string>();
+      entry["command"] = options.modify_command(entry["command"].get<std::string>());
+      std::string after = entry["command"].get<std::string>();
+      if (before != after)
+      {
+        lInfo() << "Applied cmd modifiers to " << e.file << "\n";
+        lDbg() << "before: " << before << "\n"
+               << "after: " << after << "\n";
+      }
+    }
+}
+
+//filters and modifies an entry and decides how it has to be prepared, must be called in input order
+bool classifyEntry(ProcessRun &run, nlohmann::json &entry, fs::path file, CCEntry &e)
+{
+    PhaseTimer timer(Phase::Classify, file);
+    CCOptions const& options = run.options;
+        file = file.lexically_normal();
+     if (options.is_filtered_out(file))
+     {
+        lInfo() << "Filtered out: " << file << "\n";
+        return false;
+     }
 
-    std::unique_ptr<IndexerPreparator> indexer;
-    if (!options.no_dependencies)
+    e.obj = std::move(entry);
+    e.file = file;
+
+     if (!options.is_filtered_in(file))
+     {
+        lInfo() << "Not filtered in, adding as-is:" << file << "\n";
+        e.action = CCEntry::Action::AsIs;
+    }
+    else
+    {
+        e.search = getIncludeResolver().paths(e.obj, options.clang_cl);
+        SearchPathScope search(e.search);
+        ClosureScope closure(file, entryOutput(e.obj));
+        e.stdafx = getFirstQuotedInclude(file);
+
+        //only once per first include, nothing to prepare without one
+        if (e.stdafx.empty() || run.seen_stdafx.find(e.stdafx) != run.seen_stdafx.end())
+        {
+            lInfo() << "First include was already processed, taking quick path for :" << file << "\n";
+            e.action = CCEntry::Action::Quick;
+        }
+        else
+        {
+            run.seen_stdafx.insert(e.stdafx);
+
+            lInfo() << "Preparation: "
+                    << file << "\n";
+
+            e.action = CCEntry::Action::Prepare;
+        }
+    }
+
+    if (run.next)
+        e.key = entryKey(e);
+    if (run.prev && (e.reuse = run.prev->find(e.key)))
     {
-      lInfo() << "Preparing compile_commands with dependencies\n";
-      indexer.reset(new IndexerPreparatorWithDependencies(options));
+        lDbg() << "Unchanged since the previous run: " << file << "\n";
+        //quick path of other entries relies on it
+        if (e.action == CCEntry::Action::Prepare && e.reuse->stdafx)
+            run.indexer.SetStdafxInfo(e.stdafx, *e.reuse->stdafx);
+        return true;
     }
+
+    modifyEntry(options, e);
+    if (run.next && e.action == CCEntry::Action::Prepare)
+        e.deps = std::make_unique<DependencySink>();
+    return true;
+}
+
+void estimateCost(PrepareCostModel const& costs, CCEntry &e, bool count_includes)
+{
+    PhaseTimer timer(Phase::CostEstimate);
+    if (auto c = costs.recorded(e.stdafx); c.has_value())
+        e.cost = *c;
+    else if (count_includes && (e.includes = PrepareCostModel::count_includes(e.stdafx)).has_value())
+        e.cost = costs.from_includes(*e.includes);
     else
+        e.cost = costs.average();
+}
+
+bool needsPrepare(CCEntry const& e)
+{
+    return e.action == CCEntry::Action::Prepare && !e.reuse;
+}
+
+void runPrepare(ProcessRun &run, CCEntry &e)
+{
+    PhaseTimer timer(Phase::Prepare, e.file.parent_path());
+    DependencyScope scope(e.deps.get());
+    SearchPathScope search_scope(e.search);
+    ClosureScope closure_scope(e.file, entryOutput(e.obj));
+    const IncludeClosures::Closure *closure = ClosureScope::current();
+    //the ninja log changes on every build, it is part of the stamp only
+    if (closure && closure->depfile && e.deps)
+        e.deps->add(getIncludeClosures().path(*closure->depfile));
+    auto start = std::chrono::steady_clock::now();
+    run.indexer.Prepare(e.obj, e.file, e.out);
+    auto t = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+    run.costs.record(e.stdafx, t, e.includes);
+}
+
+//must be called in input order, so the preparation for the same first include is already done
+void finishEntry(ProcessRun &run, CCEntry &e, JsonArrayWriter &out)
+{
+    PhaseTimer timer(Phase::Finish);
+    //quick path result depends on how the first include was prepared this time
+    if (e.reuse && e.action == CCEntry::Action::Quick && !(run.indexer.GetStdafxInfo(e.stdafx) == e.reuse->stdafx))
     {
-      lInfo() << "Preparing compile_commands without dependencies\n";
-      indexer.reset(new IndexerPreparatorCanonical(options));
+        e.reuse = nullptr;
+        modifyEntry(run.options, e);
     }
 
-    std::set<fs::path> seen_paths;
-    nlohmann::json res = internProcessCompileCommands(options.compile_commands_json,
-     [&](nlohmann::json &entry, fs::path file, json_list &to_add)->bool{
-            file = file.lexically_normal();
-         if (options.is_filtered_out(file))
-         {
-            lInfo() << "Filtered out: " << file << "\n";
-            return false;
-         }
-        
-        if (!options.command_modifiers.empty() && entry["command"].is_string())
+    if (e.reuse)
+    {
+        for(auto const& s : e.reuse->elements)
+            out.add_serialized(s);
+        run.next->add_reused(e.key, *e.reuse, *run.prev);
+        return;
+    }
+
+    if (e.action == CCEntry::Action::AsIs)
+        e.out.emplace_back(std::move(e.obj));
+    else if (e.action == CCEntry::Action::Quick)
+        run.indexer.QuickPrepare(e.obj, e.file, e.stdafx, e.out);
+
+    if (!run.next)
+    {
+        for(auto const& obj : e.out)
+            out.add(obj);
+        e.out.clear();
+        return;
+    }
+
+    std::vector<std::string> elements;
+    elements.reserve(e.out.size());
+    for(auto const& obj : e.out)
+    {
+        elements.push_back(JsonArrayWriter::serialize(obj));
+        out.add_serialized(elements.back());
+    }
+    e.out.clear();
+
+    std::optional<IndexerPreparator::StdafxInfo> stdafx;
+    if (e.action != CCEntry::Action::AsIs)
+        stdafx = run.indexer.GetStdafxInfo(e.stdafx);
+    run.next->add(e.key, toKind(e.action), e.file, e.stdafx, stdafx, e.deps ? e.deps->files() : std::vector<std::string>{},
+                  std::move(elements));
+}
+
+//the output is only touched if its content changed, so indexers watching it don't reload needlessly
+bool commitOutput(ReplaceIfChangedFile &out, fs::path const& p)
+{
+    PhaseTimer timer(Phase::OutputCommit);
+    if (!out.commit())
+    {
+        lErr() << "Could not write " << p << "\n";
+        return false;
+    }
+    if (!out.changed())
+        lInfo() << "Output unchanged, keeping " << p << "\n";
+    return true;
+}
+
+template<class T>
+void reportQueueStats(const char *name, BoundedQueue<T> const& q)
+{
+    auto s = q.stats();
+    std::string prefix = std::string("queue ") + name + " ";
+    RunStats &stats = getStats();
+    stats.set_value(prefix + "max", (double)s.max_size);
+    stats.set_value(prefix + "avg", s.avg_size());
+    stats.set_value(prefix + "push waits", (double)s.push_waits);
+    stats.set_value(prefix + "pop waits", (double)s.pop_waits);
+}
+
+bool processCompileCommandsBatch(ProcessRun &run)
+{
+    std::vector<CCEntry> entries;
+    internProcessCompileCommands(run.options.compile_commands_json,
+     [&](nlohmann::json &entry, fs::path file){
+        CCEntry e;
+        if (classifyEntry(run, entry, std::move(file), e))
+            entries.push_back(std::move(e));
+    });
+
+    ThreadPool &pool = getThreadPool();
+    //order only matters when there is more than one worker
+    if (pool.size() > 1)
+    {
+        TaskGroup estimates(pool);
+        for(auto &e : entries)
         {
-          std::string before = entry["command"].get<std::string>();
-          entry["command"] = options.modify_command(entry["command"].get<std::string>());
-          std::string after = entry["command"].get<std::string>();
-          if (before != after)
-          {
-            lInfo() << "Applied cmd modifiers to " << file << "\n";
-            lDbg() << "before: " << before << "\n"
-                   << "after: " << after << "\n";
-          }
+            if (needsPrepare(e))
+                estimates.run([&]{ estimateCost(run.costs, e, true); });
         }
+        estimates.wait();
+    }
+
+    //directories are prepared concurrently, the most expensive first
+    TaskGroup tasks(pool);
+    for(auto &e : entries)
+    {
+        if (needsPrepare(e))
+            tasks.run([&]{ runPrepare(run, e); }, e.cost);
+    }
+    tasks.wait();
 
-         if (!options.is_filtered_in(file))
-         {
-            to_add.emplace_back(std::move(entry));
-            lInfo() << "Not filtered in, adding as-is:" << file << "\n";
-            return true;
-         }
-
-        fs::path d = file;
-        d.remove_filename();
-        //only once per directory
-        if (seen_paths.find(d) != seen_paths.end())
+    //merge in input order, quick path depends on the preparation of the same first include
+    ReplaceIfChangedFile _out_json(run.options.save_to);
+    JsonArrayWriter writer(_out_json);
+    for(auto &e : entries)
+        finishEntry(run, e, writer);
+    writer.finish();
+
+    return commitOutput(_out_json, run.options.save_to);
+}
+
+//parse -> filter/modify -> prepare -> serialize, stages are connected with bounded queues
+bool processCompileCommandsPipelined(ProcessRun &run)
+{
+    const size_t kQueueSize = 256;
+    using entry_ptr = std::unique_ptr<CCEntry>;
+    BoundedQueue<nlohmann::json> parsed(kQueueSize);
+    BoundedQueue<entry_ptr> filtered(kQueueSize);
+    BoundedQueue<entry_ptr> prepared(kQueueSize);
+
+    std::mutex err_mtx;
+    std::exception_ptr err;
+    auto stage = [&](auto body, auto &out_queue){
+        return std::thread([&, body]{
+            try
+            {
+              body();
+            }catch(...)
+            {
+              std::unique_lock<std::mutex> lck(err_mtx);
+              if (!err)
+                err = std::current_exception();
+              parsed.close();
+              filtered.close();
+              prepared.close();
+            }
+            out_queue.close();
+        });
+    };
+
+    std::thread parse_stage = stage([&]{
+        setTraceThreadName("parse stage");
+        streamCompileCommands(run.options.compile_commands_json, [&](nlohmann::json &&obj){
+            parsed.push(std::move(obj));
+        });
+    }, parsed);
+
+    std::thread filter_stage = stage([&]{
+        setTraceThreadName("filter stage");
+        nlohmann::json obj;
+        while(parsed.pop(obj))
+        {
+            internProcessCompileCommand(obj, [&](nlohmann::json &entry, fs::path file){
+                auto e = std::make_unique<CCEntry>();
+                if (classifyEntry(run, entry, std::move(file), *e))
+                    filtered.push(std::move(e));
+            });
+        }
+    }, filtered);
+
+    std::thread prepare_stage = stage([&]{
+        setTraceThreadName("prepare stage");
+        entry_ptr e;
+        while(filtered.pop(e))
         {
-            lInfo() << "This path was already processed, taking quick path for :" << file << "\n";
-            indexer->QuickPrepare(entry, file, to_add);
-            return true;
+            if (needsPrepare(*e))
+            {
+                //no time for a pre-pass here, only previous timings can be used
+                estimateCost(run.costs, *e, false);
+                getThreadPool().submit([&run, pE = e.get()]{
+                    try
+                    {
+                      runPrepare(run, *pE);
+                      pE->prepared.set_value();
+                    }catch(...)
+                    {
+                      pE->prepared.set_exception(std::current_exception());
+                    }
+                }, e->cost);
+            }
+            if (!prepared.push(std::move(e)))
+            {
+                //submitted preparation still references the entry
+                if (needsPrepare(*e))
+                    e->prepared_done.wait();
+                break;
+            }
         }
+    }, prepared);
 
-        seen_paths.insert(d);
+    std::exception_ptr serialize_err;
+    bool written = false;
+    {
+        ReplaceIfChangedFile _out_json(run.options.save_to);
+        JsonArrayWriter writer(_out_json);
+        entry_ptr e;
+        try
+        {
+          while(prepared.pop(e))
+          {
+              if (needsPrepare(*e))
+                  e->prepared_done.get();
+              finishEntry(run, *e, writer);
+          }
+          //a failed stage closed the queues, what was written is incomplete then
+          bool failed = false;
+          {
+            std::unique_lock<std::mutex> lck(err_mtx);
+            failed = err != nullptr;
+          }
+          if (!failed)
+          {
+            writer.finish();
+            written = commitOutput(_out_json, run.options.save_to);
+          }
+        }catch(...)
+        {
+          serialize_err = std::current_exception();
+          parsed.close();
+          filtered.close();
+          prepared.close();
+          //already submitted preparations still reference their entries
+          //wait() doesn't throw, the one whose get() threw has no state left
+          while(e || prepared.pop(e))
+          {
+              if (needsPrepare(*e) && e->prepared_done.valid())
+                  e->prepared_done.wait();
+              e.reset();
+          }
+        }
+    }
 
-        lInfo() << "Preparation: "
-                << file << "\n";
+    parse_stage.join();
+    filter_stage.join();
+    prepare_stage.join();
 
-        indexer->Prepare(entry, file, to_add);
+    reportQueueStats("parse->filter", parsed);
+    reportQueueStats("filter->prepare", filtered);
+    reportQueueStats("prepare->serialize", prepared);
 
-         return true;
-    });
+    if (err)
+        std::rethrow_exception(err);
+    if (serialize_err)
+        std::rethrow_exception(serialize_err);
+    return written;
+}
 
-    std::ofstream _out_json(options.save_to);
-    _out_json << std::setw(4) << res << std::endl;
+fs::path stampFile(CCOptions const& options)
+{
+    return fs::path(options.save_to) += ".stamp";
+}
+
+//everything the output was generated from, and the output itself
+stamp_files collectInputs(CCOptions const& options, IncrementalStateWriter const* state)
+{
+    std::map<std::string, FileStat> files;
+    auto add = [&](fs::path const& p){
+        if (!p.empty())
+            files.emplace(p.string(), statFile(p));
+    };
+    add(options.compile_commands_json);
+    add(options.save_to);
+    for(auto const& c : options.config_files)
+        add(c);
+    for(auto const& pch : options.PCHs)
+    {
+        add(pch.file);
+        add(pch.dep);
+    }
+    //a new .d file changes the mtime of its directory
+    add(options.depfiles);
+    for(auto const& d : getIncludeClosures().inputs())
+        add(d);
+    //a header showing up earlier in the search paths changes the mtime of its directory
+    for(auto const& d : getIncludeResolver().directories())
+        add(d);
+    IncludeCache &cache = getIncludeCache();
+    for(auto const& f : cache.files())
+        files.emplace(f, cache.stat(f));
+    //reused entries didn't scan their dependencies this time
+    if (state)
+        files.insert(state->files().begin(), state->files().end());
+    return stamp_files(files.begin(), files.end());
+}
+
+//make syntax, understood by ninja as well
+std::string escapeDepfilePath(std::string const& p)
+{
+    std::string res;
+    res.reserve(p.size());
+    for(char c : p)
+    {
+        if (c == ' ' || c == '#')
+            res += '\\';
+        else if (c == '$')
+            res += '$';
+        res += c;
+    }
+    return res;
+}
 
+bool writeDepfile(CCOptions const& options, stamp_files const& inputs)
+{
+    std::string out = escapeDepfilePath(options.save_to.string()) + ":";
+    size_t count = 0;
+    for(auto const& [path, st] : inputs)
+    {
+        //files looked for but not found would make the output always out of date
+        if (!st.exists || path == options.save_to.string())
+            continue;
+        out += " \\\n  " + escapeDepfilePath(path);
+        ++count;
+    }
+    out += "\n";
+    if (!writeFileAtomically(options.depfile, out))
+    {
+        lErr() << "Could not write depfile " << options.depfile << "\n";
+        return false;
+    }
+    lInfo() << "Wrote " << count << " dependencies to depfile " << options.depfile << "\n";
     return true;
 }
 
+bool checkCompileCommands(CCOptions const& options)
+{
+    bool res = checkStamp(stampFile(options), options.fingerprint());
+    lWarn() << (res ? "Up to date: " : "Needs regeneration: ") << options.save_to << "\n";
+    return res;
+}
+
+bool processCompileCommandsTo(CCOptions const& options, WatchState *watch)
+{
+    if (!getFileSystem().exists(options.compile_commands_json))
+    {
+      lWarn() << "Compile commands json file doesn't exit:\n"
+              << options.compile_commands_json << "\n";
+      return false;
+    }
+
+    lWarn() << "Processing compile commands from:\n"
+            << options.compile_commands_json << "\n";
+
+    std::unique_ptr<IndexerPreparator> indexer = createIndexerPreparator(options);
+
+    PrepareCostModel costs;
+    if (!options.timings.empty())
+      costs.load(options.timings);
+
+    //watch mode keeps the cache in memory, changed files are invalidated by the watcher
+    if (!options.include_cache.empty() && (!watch || !watch->runs))
+    {
+      PhaseTimer timer(Phase::IncludeCacheLoad);
+      getIncludeCache().set_hashing(options.include_cache_hash);
+      getIncludeCache().load(options.include_cache);
+    }
+
+    //a build since the last run rewrote them
+    if ((!options.depfiles.empty() || !options.ninja_deps.empty()) && (!watch || !watch->runs || getIncludeClosures().changed()))
+      loadIncludeClosures(options);
+    getIncludeClosures().new_run();
+
+    ProcessRun run(options, *indexer, costs);
+    IncrementalState prev;
+    IncrementalStateWriter next;
+    fs::path state_file;
+    uint64_t fingerprint = options.fingerprint();
+    if (options.incremental || watch)
+      run.next = &next;
+    if (options.incremental)
+    {
+      state_file = options.incremental_state;
+      if (state_file.empty())
+        state_file = fs::path(options.save_to) += ".incremental";
+    }
+    if (watch && watch->runs)
+    {
+      if (prev.load(std::move(watch->incremental), fingerprint))
+      {
+        if (watch->changed)
+          prev.set_changed_files(*watch->changed);
+        run.prev = &prev;
+      }
+    }
+    else if (options.incremental)
+    {
+      PhaseTimer timer(Phase::IncrementalState);
+      if (prev.load(state_file, fingerprint) && (options.changed_files.empty() || prev.set_changed_files(options.changed_files)))
+        run.prev = &prev;
+    }
+    bool res;
+    if (options.pipeline)
+    {
+      lInfo() << "Running as pipeline\n";
+      res = processCompileCommandsPipelined(run);
+    }
+    else
+      res = processCompileCommandsBatch(run);
+
+    if (res && !options.timings.empty())
+      costs.save(options.timings);
+    if (res && !options.include_cache.empty())
+    {
+      PhaseTimer timer(Phase::IncludeCacheSave);
+      getIncludeCache().save(options.include_cache);
+    }
+    if (res && options.incremental)
+    {
+      PhaseTimer timer(Phase::IncrementalState);
+      next.save(state_file, fingerprint);
+    }
+    if (res)
+    {
+      PhaseTimer timer(Phase::Stamp);
+      stamp_files inputs = collectInputs(options, run.next);
+      saveStamp(stampFile(options), fingerprint, inputs);
+      if (!options.depfile.empty())
+        writeDepfile(options, inputs);
+    }
+    if (watch)
+    {
+      ++watch->runs;
+      watch->incremental = res ? next.encode(fingerprint) : std::string();
+      watch->changed.reset();
+    }
+    return res;
+}
+
 bool CCOptions::is_filtered_in(fs::path const &f) const {
   if (filter_in.empty())
     return true;
@@ -152,17 +778,45 @@ bool CCOptions::is_filtered_out(fs::path const &f) const {
 bool CCOptions::is_skipped(fs::path const &f) const
 {
   for (const auto &re : skip_dep)
+  {
+    countStat(Counter::RegexEvals);
     if (std::regex_search(f.string(), re))
       return true;
+  }
   return false;
 }
 
 std::string CCOptions::modify_command(std::string cmd) const {
+  PhaseTimer timer(Phase::ModifyCommand);
+  countStat(Counter::RegexEvals, command_modifiers.size());
   for (Replace const &r : command_modifiers)
     cmd = std::regex_replace(cmd, r.replace, r.with);
   return std::move(cmd);
 }
 
+uint64_t CCOptions::fingerprint() const
+{
+  //config files are hashed as a whole, regular expressions can't be compared otherwise
+  std::string data;
+  for (fs::path const &c : config_files)
+  {
+    std::string content;
+    readFile(c, content);
+    data += c.string() + '\n' + content + '\n';
+  }
+  data += compile_commands_json.string() + '\n';
+  data += save_to.string() + '\n';
+  for (fs::path const &d : filter_in)
+    data += "in:" + d.string() + '\n';
+  for (fs::path const &d : filter_out)
+    data += "out:" + d.string() + '\n';
+  data += include_dir + '\n';
+  data += depfiles.string() + '\n';
+  data += ninja_deps.string() + '\n';
+  data += std::to_string(clang_cl) + std::to_string(no_dependencies) + std::to_string(dynamic_pch);
+  return hashBytes(data);
+}
+
 void CCOptions::read_pch_config(std::string key, nlohmann::json &obj, const fs::path &base)
 {
   if (!obj.is_array())
@@ -171,6 +825,7 @@ void CCOptions::read_pch_config(std::string key, nlohmann::json &obj, const fs::
     return;
   }
   lInfo() << "Adding '"<<key<<"':\n";
+  std::vector<PCH> found;
   for (auto const &fout : obj) {
     if (fout.is_object())
     {
@@ -209,19 +864,7 @@ void CCOptions::read_pch_config(std::string key, nlohmann::json &obj, const fs::
             read_path_list("allow-includes-from", allow_includes, base, pch.allow_includes_from);
         }
 
-        if (!fs::exists(pch.file))
-        {
-          lErr() << "PCH target: " << pch.file << " doesn't exist. Skipping\n";
-          throw std::runtime_error("PCH file must exist!");
-        }
-
-        if (!pch.dep.empty() && !fs::exists(pch.dep))
-        {
-          lErr() << "PCH dependency: " << pch.dep << " doesn't exist. Skipping\n";
-          throw std::runtime_error("PCH dependency if specified must exist!");
-        }
-
-        PCHs.push_back(pch);
+        found.push_back(std::move(pch));
       }else
       {
         lWarn() << "No 'file' key for PCH found. Skipping\n";
@@ -231,6 +874,34 @@ void CCOptions::read_pch_config(std::string key, nlohmann::json &obj, const fs::
       lWarn() << "Expected 'object'.\nGot " << fout.type_name() << " instead. Skipping.\n";
     }
   }
+
+  //checked together, so a batching file system has them all in flight at once
+  std::vector<fs::path> paths;
+  for (PCH const &pch : found)
+  {
+    paths.push_back(pch.file);
+    if (!pch.dep.empty())
+      paths.push_back(pch.dep);
+  }
+  std::vector<FileStat> sts;
+  getFileSystem().stat(paths, sts);
+  size_t st = 0;
+  for (PCH &pch : found)
+  {
+    if (!sts[st++].exists)
+    {
+      lErr() << "PCH target: " << pch.file << " doesn't exist. Skipping\n";
+      throw std::runtime_error("PCH file must exist!");
+    }
+
+    if (!pch.dep.empty() && !sts[st++].exists)
+    {
+      lErr() << "PCH dependency: " << pch.dep << " doesn't exist. Skipping\n";
+      throw std::runtime_error("PCH dependency if specified must exist!");
+    }
+
+    PCHs.push_back(std::move(pch));
+  }
 }
 
 void CCOptions::read_replace_list(std::string key, nlohmann::json &obj, const fs::path &base)
@@ -334,10 +1005,19 @@ void CCOptions::read_path_list(std::string key, nlohmann::json &obj, const fs::p
 const std::map<std::string, CCOptions::Reader> CCOptions::g_OptionReaders({
   {"from", &CCOptions::read_tpl<&CCOptions::compile_commands_json>},
   {"to", &CCOptions::read_tpl<&CCOptions::save_to>},
+  {"timings", &CCOptions::read_tpl<&CCOptions::timings>},
+  {"depfile", &CCOptions::read_tpl<&CCOptions::depfile>},
+  {"depfiles", &CCOptions::read_tpl<&CCOptions::depfiles>},
+  {"ninja-deps", &CCOptions::read_tpl<&CCOptions::ninja_deps>},
+  {"include-cache", &CCOptions::read_tpl<&CCOptions::include_cache>},
+  {"include-cache-hash", &CCOptions::read_tpl<&CCOptions::include_cache_hash>},
+  {"incremental", &CCOptions::read_tpl<&CCOptions::incremental>},
+  {"incremental-state", &CCOptions::read_tpl<&CCOptions::incremental_state>},
   {"clang-cl", &CCOptions::read_tpl<&CCOptions::clang_cl>},
   {"include-dir", &CCOptions::read_tpl<&CCOptions::include_dir>},
   {"no-dependencies", &CCOptions::read_tpl<&CCOptions::no_dependencies>},
   {"dynamic-pch", &CCOptions::read_tpl<&CCOptions::dynamic_pch>},
+  {"pipeline", &CCOptions::read_tpl<&CCOptions::pipeline>},
   {"filter-in", &CCOptions::read_tpl<&CCOptions::filter_in>},
   {"filter-out", &CCOptions::read_tpl<&CCOptions::filter_out>},
   {"cmd-modifiers", &CCOptions::read_replace_list},
@@ -357,6 +1037,7 @@ bool CCOptions::from_json_file(fs::path config_json, const fs::path &base)
     std::ifstream _f(config_json);
     if (_f)
     {
+      config_files.push_back(fs::absolute(config_json));
       _f >> cfg;
       if (cfg.is_object())
       {
@@ -393,9 +1074,7 @@ bool is_in_dir(fs::path const& parent, fs::path const& child, fs::path::iterator
     ++cIt;
   }
   childIt = cIt;
-  std::error_code err;
-
-  return fs::equivalent(parent, builtChild, err);
+  return getFileSystem().equivalent(parent, builtChild);
 }
 
 bool is_in_dir(fs::path const& parent, fs::path const& child)
@@ -426,28 +1105,27 @@ std::string to_upper(std::string s)
 
 std::string find_real_name(fs::path p, std::string search)
 {
-    std::error_code err;
+    FileSystem &vfs = getFileSystem();
     fs::path cmp_against = p / search;
-    for (auto& x : fs::directory_iterator(p, fs::directory_options::skip_permission_denied))
+    std::vector<FileSystem::DirEntry> entries, sub;
+    vfs.list(p, entries);
+    //a directory that can't be listed isn't the one
+    auto usable = [&](FileSystem::DirEntry const& x){ return !x.directory || vfs.list(p / x.name, sub); };
+    //the exact spelling needs no comparison by identity
+    for (auto const& x : entries)
     {
-        fs::path xp = p / x;
-        if (fs::equivalent(xp, cmp_against, err))
+        if (x.name == search)
         {
-            //try if a directory iterator can be created
-            try
-            {
-              if (x.is_directory())
-              {
-                  auto iter = fs::directory_iterator(xp);
-                  (void)iter->exists();
-              }
-            }catch(...)
-            {
-              continue;
-            }
-            return x.path().filename().string();
+            if (usable(x))
+              return x.name;
+            break;
         }
     }
+    for (auto const& x : entries)
+    {
+        if (x.name != search && vfs.equivalent(p / x.name, cmp_against) && usable(x))
+            return x.name;
+    }
     return search;
 }
 
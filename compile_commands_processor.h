@@ -3,6 +3,9 @@
 
 #include <vector>
 #include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
 #include <regex>
 #include "json.hpp"
 
@@ -28,6 +31,15 @@ struct CCOptions
   };
   fs::path compile_commands_json;
   fs::path save_to;
+  fs::path timings;//per first include Prepare timings of the previous run
+  fs::path depfile;//make/ninja dependencies of save_to
+  fs::path depfiles;//directory with compiler generated .d files
+  fs::path ninja_deps;//.ninja_deps log of the build
+  fs::path include_cache;
+  bool include_cache_hash = false;
+  bool incremental = false;
+  fs::path incremental_state;//<to>.incremental if not set
+  fs::path changed_files;//instead of checking every dependency, '-' for stdin
   std::vector<fs::path> filter_in;
   std::vector<fs::path> filter_out;
   std::vector<Replace> command_modifiers;
@@ -36,13 +48,17 @@ struct CCOptions
   std::string include_dir;
   bool no_dependencies = false;
   bool dynamic_pch = false;
+  bool pipeline = false;
   std::vector<PCH> PCHs;
+  std::vector<fs::path> config_files;
 
   bool is_filtered_in(fs::path const& f) const;
   bool is_filtered_out(fs::path const& f) const;
   bool is_skipped(fs::path const& f) const;
   std::string modify_command(std::string cmd) const;
   bool from_json_file(fs::path config_json, const fs::path &base);
+  //changes whenever the options could produce a different output
+  uint64_t fingerprint() const;
 
   using StrMemPtr = std::string CCOptions::*;
   using PathMemPtr = fs::path CCOptions::*;
@@ -75,7 +91,25 @@ struct CCOptions
   static const std::map<std::string, Reader> g_OptionReaders;
 };
 
-bool processCompileCommandsTo(CCOptions const& options);
+//watch mode keeps the incremental state in memory between runs
+struct WatchState
+{
+  size_t runs = 0;
+  std::string incremental;//state encoded by the previous run
+  std::optional<std::vector<std::string>> changed;//every dependency is checked if unknown
+};
+
+bool processCompileCommandsTo(CCOptions const& options, WatchState *watch = nullptr);
+//whether the output of processCompileCommandsTo is up to date, judging by the stamp it left
+bool checkCompileCommands(CCOptions const& options);
+
+//calls on_entry for every valid entry, in input order
+using json_entry_func = std::function<void(nlohmann::json &entry, fs::path file)>;
+void internProcessCompileCommands(fs::path compile_commands_json, json_entry_func on_entry);
+//absolute path of the object the entry produces, empty if it doesn't say
+fs::path entryOutput(nlohmann::json const& entry);
+//include closures from the depfiles and the ninja deps log of the options
+void loadIncludeClosures(CCOptions const& options);
 
 bool is_in_dir(fs::path const& parent, fs::path const& child);
 bool is_in_dir(fs::path const& parent, fs::path const& child, fs::path::iterator &childIt);
@@ -0,0 +1,241 @@
+#include "corpus_gen.h"
+
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "json.hpp"
+#include "log.h"
+
+//splitmix64, the std distributions differ between standard libraries
+class GenRandom
+{
+public:
+  GenRandom(uint64_t seed, uint64_t stream): m_State(seed * 0x9e3779b97f4a7c15ull + stream)
+  {
+    next();
+  }
+
+  uint64_t next()
+  {
+    uint64_t z = (m_State += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+  size_t below(size_t n) { return n ? (size_t)(next() % n) : 0; }
+  bool chance(double p) { return (double)(next() >> 11) * (1.0 / 9007199254740992.0) < p; }
+
+private:
+  uint64_t m_State;
+};
+
+bool parsePchLayout(std::string const& s, GenOptions::PchLayout &l)
+{
+  if (s == "none")
+    l = GenOptions::PchLayout::None;
+  else if (s == "per-dir")
+    l = GenOptions::PchLayout::PerDir;
+  else if (s == "shared")
+    l = GenOptions::PchLayout::Shared;
+  else if (s == "dynamic")
+    l = GenOptions::PchLayout::Dynamic;
+  else
+    return false;
+  return true;
+}
+
+static bool writeGenFile(fs::path const& p, std::string const& content, GenResult &res)
+{
+  std::ofstream f(p, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!f.write(content.data(), content.size()))
+  {
+    lErr() << "Could not write " << p << "\n";
+    return false;
+  }
+  ++res.files;
+  res.bytes += content.size();
+  return true;
+}
+
+static void addLongLine(std::string &out, GenOptions const& opts, std::string const& id)
+{
+  if (!opts.long_line)
+    return;
+  std::string line = "inline const char *gen_long_" + id + " = \"";
+  static constexpr std::string_view fill = "abcdefghijklmnopqrstuvwxyz0123456789";
+  while(line.size() + 3 < opts.long_line)
+    line += fill[line.size() % fill.size()];
+  out += line;
+  out += "\";\n";
+}
+
+//include of a header from the given level, the common ones are found through -I
+//a header already included by out is picked again only when there aren't enough of them
+static void addInclude(std::string &out, GenOptions const& opts, GenRandom &rnd, size_t level, bool shared_only)
+{
+  //nothing to pick from, the headers of a directory can't be reached from the common ones
+  if (!opts.shared_per_level && (shared_only || !opts.headers_per_level))
+    return;
+  std::string line;
+  for(int attempt = 0; attempt < 4; ++attempt)
+  {
+    bool shared = opts.shared_per_level && (shared_only || !opts.headers_per_level || rnd.chance(opts.shared_ratio));
+    if (shared)
+      line = "#include \"c" + std::to_string(level) + "_" + std::to_string(rnd.below(opts.shared_per_level)) + ".h\"\n";
+    else if (opts.headers_per_level)
+      line = "#include \"h" + std::to_string(level) + "_" + std::to_string(rnd.below(opts.headers_per_level)) + ".h\"\n";
+    if (out.find(line) == std::string::npos)
+      break;
+  }
+  out += line;
+}
+
+static std::string genHeader(GenOptions const& opts, GenRandom &rnd, std::string const& id, size_t level, bool shared_only)
+{
+  std::string out = "#ifndef GEN_" + id + "_H_\n#define GEN_" + id + "_H_\n";
+  if (level + 1 < opts.depth)
+  {
+    for(size_t i = 0; i < opts.fanout; ++i)
+      addInclude(out, opts, rnd, level + 1, shared_only);
+  }
+  addLongLine(out, opts, id);
+  out += "int gen_" + id + "(int v);\n#endif\n";
+  return out;
+}
+
+static fs::path dirPath(GenOptions const& opts, fs::path const& src, size_t d)
+{
+  fs::path p = src;
+  for(size_t k = 1; k < opts.path_depth; ++k)
+  {
+    size_t shift = 4 * (k - 1);
+    p /= "g" + std::to_string(k) + "_" + std::to_string(shift < 64 ? (d >> shift) % 16 : 0);
+  }
+  return p / ("d" + std::to_string(d));
+}
+
+bool generateCorpus(GenOptions const& opts, fs::path out, GenResult &res)
+{
+  res = GenResult{};
+  std::error_code ec;
+  out = fs::absolute(out, ec).lexically_normal();
+  fs::path src = out / "src";
+  fs::path common = src / "common";
+  fs::path build = out / "build";
+  fs::create_directories(common, ec);
+  fs::create_directories(build, ec);
+  if (ec)
+  {
+    lErr() << "Could not create " << out << ": " << ec.message() << "\n";
+    return false;
+  }
+
+  GenRandom shared_rnd(opts.seed, 0);
+  for(size_t l = 0; l < opts.depth; ++l)
+  {
+    for(size_t j = 0; j < opts.shared_per_level; ++j)
+    {
+      std::string id = "c" + std::to_string(l) + "_" + std::to_string(j);
+      if (!writeGenFile(common / (id + ".h"), genHeader(opts, shared_rnd, id, l, true), res))
+        return false;
+    }
+  }
+  if (opts.pch == GenOptions::PchLayout::Shared)
+  {
+    std::string pch = "#ifndef GEN_PCH_H_\n#define GEN_PCH_H_\n";
+    for(size_t i = 0; i < opts.stdafx_block; ++i)
+      addInclude(pch, opts, shared_rnd, 0, true);
+    pch += "#endif\n";
+    if (!writeGenFile(common / "pch.h", pch, res))
+      return false;
+  }
+
+  res.compile_commands = build / "compile_commands.json";
+  std::ofstream cc(res.compile_commands, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!cc)
+  {
+    lErr() << "Could not write " << res.compile_commands << "\n";
+    return false;
+  }
+  cc << "[";
+
+  nlohmann::json pchs = nlohmann::json::array();
+  for(size_t d = 0; d < opts.dirs; ++d)
+  {
+    GenRandom rnd(opts.seed, d + 1);
+    fs::path dir = dirPath(opts, src, d);
+    fs::create_directories(dir, ec);
+    if (ec)
+    {
+      lErr() << "Could not create " << dir << ": " << ec.message() << "\n";
+      return false;
+    }
+    std::string dir_id = "d" + std::to_string(d);
+
+    for(size_t l = 0; l < opts.depth; ++l)
+    {
+      for(size_t j = 0; j < opts.headers_per_level; ++j)
+      {
+        std::string name = "h" + std::to_string(l) + "_" + std::to_string(j);
+        if (!writeGenFile(dir / (name + ".h"), genHeader(opts, rnd, dir_id + "_" + name, l, false), res))
+          return false;
+      }
+    }
+
+    std::string stdafx = "#ifndef GEN_" + dir_id + "_STDAFX_H_\n#define GEN_" + dir_id + "_STDAFX_H_\n";
+    if (opts.pch == GenOptions::PchLayout::Shared)
+      stdafx += "#include \"pch.h\"\n";
+    for(size_t i = 0; opts.depth && i < opts.stdafx_block; ++i)
+      addInclude(stdafx, opts, rnd, 0, false);
+    stdafx += "#endif\n";
+    if (!writeGenFile(dir / "stdafx.h", stdafx, res))
+      return false;
+    if (opts.pch == GenOptions::PchLayout::PerDir)
+      pchs.push_back({{"file", (dir / "stdafx.h").string()}, {"apply-for", {dir.string()}}});
+
+    std::string flags = "c++ -std=c++17 -DGEN_BUILD=1 -I" + common.string() + " -I" + dir.string() + " -O2 -c ";
+    for(size_t t = 0; t < opts.tus_per_dir; ++t)
+    {
+      std::string name = "tu" + std::to_string(t);
+      std::string tu = "#include \"stdafx.h\"\n";
+      for(size_t i = 0; opts.depth && i < opts.fanout; ++i)
+        addInclude(tu, opts, rnd, rnd.below(opts.depth), false);
+      addLongLine(tu, opts, dir_id + "_" + name);
+      tu += "int gen_" + dir_id + "_" + name + "() { return 0; }\n";
+      fs::path file = dir / (name + ".cpp");
+      if (!writeGenFile(file, tu, res))
+        return false;
+
+      std::string obj = "obj/" + dir_id + "/" + name + ".o";
+      nlohmann::json entry = {
+        {"directory", build.string()},
+        {"file", file.string()},
+        {"command", flags + file.string() + " -o " + obj},
+        {"output", obj}
+      };
+      cc << (res.entries++ ? ",\n" : "\n") << entry.dump();
+    }
+  }
+  cc << "\n]\n";
+  if (!cc.flush())
+  {
+    lErr() << "Could not write " << res.compile_commands << "\n";
+    return false;
+  }
+
+  nlohmann::json config = {
+    {"from", res.compile_commands.string()},
+    {"to", (build / "compile_commands.prepared.json").string()},
+    {"cmd-modifiers", {{{"what", "-DGEN_BUILD=1"}, {"with", "-DGEN_BUILD=2"}}}}
+  };
+  if (opts.pch == GenOptions::PchLayout::PerDir)
+    config["pch"] = std::move(pchs);
+  else if (opts.pch == GenOptions::PchLayout::Shared)
+    config["pch"] = {{{"file", (common / "pch.h").string()}, {"apply-for", {src.string()}}}};
+  else if (opts.pch == GenOptions::PchLayout::Dynamic)
+    config["dynamic-pch"] = true;
+  res.config = out / "prepare_cc.json";
+  return writeGenFile(res.config, config.dump(2) + "\n", res);
+}
@@ -0,0 +1,49 @@
+#ifndef CORPUS_GEN_H_
+#define CORPUS_GEN_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+//synthetic source tree with its compile_commands.json and prepare_cc config, for scale testing
+//the same options and seed always give the same files, whatever the platform
+struct GenOptions
+{
+  enum class PchLayout
+  {
+    None,
+    PerDir,//every directory stdafx.h is a pch for its directory
+    Shared,//one pch included by every stdafx.h
+    Dynamic//dynamic-pch, no pch list
+  };
+
+  uint64_t seed = 1;
+  size_t dirs = 16;
+  size_t tus_per_dir = 16;
+  size_t stdafx_block = 8;//includes in stdafx.h
+  size_t fanout = 3;//includes per header and per TU besides stdafx.h
+  size_t depth = 3;//levels of headers, a level includes only the next one
+  size_t headers_per_level = 4;//per directory
+  size_t shared_per_level = 16;//in the common directory
+  double shared_ratio = 0.3;//chance an include goes to the common directory
+  PchLayout pch = PchLayout::PerDir;
+  size_t long_line = 0;//length of a line put into every file, 0 for none
+  size_t path_depth = 1;//components of a directory path below src
+};
+
+struct GenResult
+{
+  fs::path compile_commands;
+  fs::path config;
+  size_t entries = 0;
+  size_t files = 0;
+  uint64_t bytes = 0;
+};
+
+bool parsePchLayout(std::string const& s, GenOptions::PchLayout &l);
+//out is created if needed, files already there are overwritten
+bool generateCorpus(GenOptions const& opts, fs::path out, GenResult &res);
+
+#endif
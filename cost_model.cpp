@@ -0,0 +1,107 @@
+#include "cost_model.h"
+
+#include <fstream>
+
+#include "analyze_include.h"
+#include "file_io.h"
+#include "json.hpp"
+#include "log.h"
+
+bool PrepareCostModel::load(fs::path const& timings_json)
+{
+  std::ifstream _f(timings_json);
+  if (!_f)
+  {
+    lInfo() << "No previous timings at " << timings_json << "\n";
+    return false;
+  }
+
+  nlohmann::json t = nlohmann::json::parse(_f, nullptr, false);
+  if (!t.is_object() || !t.contains("stdafx") || !t["stdafx"].is_object())
+  {
+    lWarn() << "Unexpected format of timings file " << timings_json << ". Ignoring.\n";
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  if (t.contains("us-per-include") && t["us-per-include"].is_number())
+    m_UsPerInclude = t["us-per-include"].get<double>();
+  for (auto const &e : t["stdafx"].items())
+  {
+    if (e.value().is_number_integer())
+      m_Timings[e.key()] = e.value().get<Cost>();
+  }
+  lInfo() << "Loaded timings for " << m_Timings.size() << " first includes from " << timings_json << "\n";
+  return true;
+}
+
+bool PrepareCostModel::save(fs::path const& timings_json) const
+{
+  nlohmann::json t;
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    //keep what wasn't prepared this time
+    nlohmann::json stdafx(m_Timings);
+    for (auto const &m : m_Measured)
+      stdafx[m.first] = m.second;
+    t["stdafx"] = std::move(stdafx);
+    t["us-per-include"] = m_MeasuredIncludes ? double(m_MeasuredIncludesUs) / m_MeasuredIncludes : m_UsPerInclude;
+  }
+
+  //a run killed meanwhile leaves the previous timings
+  if (!writeFileAtomically(timings_json, t.dump()))
+  {
+    lErr() << "Could not write timings to " << timings_json << "\n";
+    return false;
+  }
+  return true;
+}
+
+void PrepareCostModel::record(fs::path const& stdafx, std::chrono::microseconds t, std::optional<size_t> includes)
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  m_Measured[stdafx.string()] = t.count();
+  if (includes.has_value())
+  {
+    m_MeasuredIncludesUs += t.count();
+    m_MeasuredIncludes += *includes;
+  }
+}
+
+std::optional<PrepareCostModel::Cost> PrepareCostModel::recorded(fs::path const& stdafx) const
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  auto i = m_Timings.find(stdafx.string());
+  if (i == m_Timings.end())
+    return {};
+  return i->second;
+}
+
+PrepareCostModel::Cost PrepareCostModel::average() const
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  if (m_Timings.empty())
+    return 0;
+  Cost total = 0;
+  for (auto const &t : m_Timings)
+    total += t.second;
+  return total / (Cost)m_Timings.size();
+}
+
+PrepareCostModel::Cost PrepareCostModel::from_includes(size_t includes) const
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  return Cost(includes * m_UsPerInclude);
+}
+
+std::optional<size_t> PrepareCostModel::count_includes(fs::path const& stdafx)
+{
+  if (stdafx.empty())
+    return {};
+
+  size_t res = 0;
+  IncludeIterator ii(stdafx, false);
+  for (auto i = ii.begin(); i != ii.end(); ++i)
+    ++res;
+  return res;
+}
@@ -0,0 +1,45 @@
+#ifndef COST_MODEL_H_
+#define COST_MODEL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace fs = std::filesystem;
+
+//estimates how long Prepare takes for a first include (stdafx) so the most expensive ones can be started first
+//costs are in microseconds, either measured by the previous run or guessed from the include count
+class PrepareCostModel
+{
+public:
+  using Cost = int64_t;
+
+  bool load(fs::path const& timings_json);
+  bool save(fs::path const& timings_json) const;
+
+  void record(fs::path const& stdafx, std::chrono::microseconds t, std::optional<size_t> includes);
+
+  std::optional<Cost> recorded(fs::path const& stdafx) const;
+  //average of the recorded costs, for first includes nothing is known about
+  Cost average() const;
+  Cost from_includes(size_t includes) const;
+
+  //number of includes in the first include, quick to get
+  static std::optional<size_t> count_includes(fs::path const& stdafx);
+
+private:
+  //previous run
+  std::map<std::string, Cost> m_Timings;
+  double m_UsPerInclude = 1.0;
+  //this run
+  std::map<std::string, Cost> m_Measured;
+  Cost m_MeasuredIncludesUs = 0;
+  size_t m_MeasuredIncludes = 0;
+  mutable std::mutex m_Mtx;
+};
+
+#endif
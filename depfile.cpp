@@ -0,0 +1,431 @@
+#include "depfile.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "file_io.h"
+#include "include_cache.h"
+#include "log.h"
+#include "thread_pool.h"
+
+bool parseDepfile(std::string_view content, std::string &target, std::vector<std::string> &prereqs)
+{
+  target.clear();
+  prereqs.clear();
+  std::vector<std::string> targets;
+  std::string tok;
+  bool inTargets = true;
+  auto flush = [&]{
+    if (tok.empty())
+      return;
+    (inTargets ? targets : prereqs).push_back(std::move(tok));
+    tok.clear();
+  };
+
+  size_t n = content.size();
+  for(size_t i = 0; i < n;)
+  {
+    char c = content[i];
+    if (c == '\\' && i + 1 < n)
+    {
+      char d = content[i + 1];
+      if (d == '\n' || (d == '\r' && i + 2 < n && content[i + 2] == '\n'))
+      {
+        //line continuation
+        flush();
+        i += d == '\n' ? 2 : 3;
+        continue;
+      }
+      if (d == ' ' || d == '#')
+      {
+        tok += d;
+        i += 2;
+        continue;
+      }
+      tok += c;
+      ++i;
+    }
+    else if (c == '$' && i + 1 < n && content[i + 1] == '$')
+    {
+      tok += '$';
+      i += 2;
+    }
+    //not a drive letter, those aren't followed by a space
+    else if (c == ':' && inTargets && (i + 1 == n || isspace((unsigned char)content[i + 1])))
+    {
+      flush();
+      inTargets = false;
+      ++i;
+    }
+    else if (c == '\n' || c == '\r')
+    {
+      flush();
+      if (!inTargets && !prereqs.empty())
+        break;
+      //rule without prerequisites, e.g. phony ones from -MP
+      inTargets = true;
+      targets.clear();
+      ++i;
+    }
+    else if (isspace((unsigned char)c))
+    {
+      flush();
+      ++i;
+    }
+    else
+    {
+      tok += c;
+      ++i;
+    }
+  }
+  flush();
+  if (inTargets || prereqs.empty() || targets.empty())
+    return false;
+  target = std::move(targets.front());
+  return true;
+}
+
+/*************************************************************************/
+/*IncludeClosures                                                        */
+/*************************************************************************/
+static std::string absoluteNormal(fs::path p, fs::path const& root)
+{
+  if (p.is_relative())
+    p = root / p;
+  return p.lexically_normal().string();
+}
+
+IncludeClosures& getIncludeClosures()
+{
+  static IncludeClosures g_Closures;
+  return g_Closures;
+}
+
+uint32_t IncludeClosures::intern(std::string p)
+{
+  if (auto i = m_Ids.find(p); i != m_Ids.end())
+    return i->second;
+  uint32_t res = (uint32_t)m_Paths.size();
+  std::string const& stored = m_Paths.emplace_back(std::move(p));
+  m_Ids.emplace(stored, res);
+  size_t slash = stored.find_last_of('/');
+  m_ByName[std::string_view(stored).substr(slash == std::string::npos ? 0 : slash + 1)].push_back(res);
+  return res;
+}
+
+std::optional<uint32_t> IncludeClosures::id(fs::path const& p) const
+{
+  if (auto i = m_Ids.find(p.lexically_normal().string()); i != m_Ids.end())
+    return i->second;
+  return {};
+}
+
+bool IncludeClosures::load(fs::path const& root)
+{
+  std::vector<fs::path> depfiles;
+  //a new or removed .d file changes the mtime of its directory
+  std::vector<fs::path> dirs{root};
+  std::error_code ec;
+  for(auto it = fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied, ec);
+      !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+  {
+    if (it->is_directory(ec))
+      dirs.push_back(it->path());
+    else if (it->path().extension() == ".d" && it->is_regular_file(ec))
+      depfiles.push_back(it->path());
+  }
+  if (ec)
+  {
+    lErr() << "Could not list depfiles in " << root << ": " << ec.message() << "\n";
+    return false;
+  }
+
+  //reading and tokenizing in parallel, interning afterwards
+  struct Parsed
+  {
+    std::string target;
+    std::vector<std::string> prereqs;
+    int64_t mtime = 0;
+  };
+  std::vector<Parsed> parsed(depfiles.size());
+  ThreadPool &pool = getThreadPool();
+  size_t chunks = pool.size() * 4;
+  size_t per_chunk = std::max<size_t>(1, (depfiles.size() + chunks - 1) / chunks);
+  TaskGroup tasks(pool);
+  for(size_t from = 0; from < depfiles.size(); from += per_chunk)
+  {
+    size_t to = std::min(from + per_chunk, depfiles.size());
+    tasks.run([&, from, to]{
+      std::string content;
+      for(size_t i = from; i < to; ++i)
+      {
+        //before the read, a .d file rewritten meanwhile looks changed next time
+        parsed[i].mtime = statFile(depfiles[i]).mtime;
+        if (!readFile(depfiles[i], content) || !parseDepfile(content, parsed[i].target, parsed[i].prereqs))
+        {
+          lWarn() << "Could not parse depfile " << depfiles[i] << "\n";
+          parsed[i].prereqs.clear();
+        }
+      }
+    });
+  }
+  tasks.wait();
+
+  for(auto const& d : dirs)
+    m_Stamps.emplace_back(d.lexically_normal().string(), statFile(d).mtime);
+  for(size_t i = 0; i < depfiles.size(); ++i)
+  {
+    m_Stamps.emplace_back(depfiles[i].lexically_normal().string(), parsed[i].mtime);
+    auto &prereqs = parsed[i].prereqs;
+    if (prereqs.empty())
+      continue;
+    //the compiler lists the source first
+    uint32_t tu = intern(absoluteNormal(prereqs.front(), root));
+    Closure c;
+    c.depfile = intern(depfiles[i].lexically_normal().string());
+    c.mtime = parsed[i].mtime;
+    c.files.reserve(prereqs.size());
+    for(auto const& p : prereqs)
+      c.files.push_back(intern(absoluteNormal(p, root)));
+    std::sort(c.files.begin(), c.files.end());
+    c.files.erase(std::unique(c.files.begin(), c.files.end()), c.files.end());
+    m_Closures[tu] = std::move(c);
+  }
+  lInfo() << "Loaded include closures of " << m_Closures.size() << " TUs from " << depfiles.size()
+          << " depfiles, " << m_Paths.size() << " distinct files\n";
+  return true;
+}
+
+//see ninja's deps_log.cc for the format
+bool IncludeClosures::loadNinjaDeps(fs::path const& log)
+{
+  std::string content;
+  int64_t log_mtime = statFile(log).mtime;
+  if (!readFile(log, content))
+  {
+    lErr() << "Could not read ninja deps log " << log << "\n";
+    return false;
+  }
+  auto read32 = [&](size_t at){
+    uint32_t v;
+    memcpy(&v, content.data() + at, sizeof(v));
+    return v;
+  };
+  const std::string_view signature = "# ninjadeps\n";
+  if (content.size() < signature.size() + 4 || content.compare(0, signature.size(), signature) != 0)
+  {
+    lErr() << "Not a ninja deps log: " << log << "\n";
+    return false;
+  }
+  //3 has 32-bit mtimes
+  uint32_t version = read32(signature.size());
+  if (version != 3 && version != 4)
+  {
+    lErr() << "Unsupported ninja deps log version " << version << ": " << log << "\n";
+    return false;
+  }
+  size_t mtime_size = version == 4 ? 8 : 4;
+
+  fs::path root = fs::absolute(log).parent_path();
+  std::vector<uint32_t> nodes;//ninja's node ids to ours
+  struct Deps
+  {
+    int64_t mtime;
+    std::vector<uint32_t> inputs;
+  };
+  std::unordered_map<uint32_t, Deps> deps;//by ninja's output id, later records win
+  size_t at = signature.size() + 4;
+  while (at + 4 <= content.size())
+  {
+    uint32_t size = read32(at);
+    bool is_deps = size >> 31;
+    size &= 0x7FFFFFFF;
+    at += 4;
+    //the rest was cut off by an interrupted build
+    if (size > content.size() - at)
+      break;
+    if (is_deps)
+    {
+      if (size < 4 + mtime_size || (size - 4 - mtime_size) % 4)
+        break;
+      Deps &d = deps[read32(at)];
+      //nanoseconds since the epoch in 4, seconds in 3
+      if (version == 4)
+        memcpy(&d.mtime, content.data() + at + 4, sizeof(d.mtime));
+      else
+        d.mtime = (int64_t)read32(at + 4) * 1000000000;
+      std::vector<uint32_t> &inputs = d.inputs;
+      inputs.clear();
+      for(size_t i = at + 4 + mtime_size; i < at + size; i += 4)
+        inputs.push_back(read32(i));
+    }
+    else
+    {
+      //padded to 4 bytes, followed by the complement of the node id
+      if (size < 4 || read32(at + size - 4) != ~(uint32_t)nodes.size())
+        break;
+      std::string_view p(content.data() + at, size - 4);
+      while (!p.empty() && p.back() == '\0')
+        p.remove_suffix(1);
+      nodes.push_back(intern(absoluteNormal(p, root)));
+    }
+    at += size;
+  }
+
+  for(auto &[out, d] : deps)
+  {
+    auto const& inputs = d.inputs;
+    if (out >= nodes.size() || inputs.empty())
+      continue;
+    Closure c;
+    c.mtime = d.mtime;
+    c.files.reserve(inputs.size());
+    for(uint32_t i : inputs)
+      if (i < nodes.size())
+        c.files.push_back(nodes[i]);
+    std::sort(c.files.begin(), c.files.end());
+    c.files.erase(std::unique(c.files.begin(), c.files.end()), c.files.end());
+    m_ByOutput[nodes[out]] = std::move(c);
+  }
+  m_Logs.push_back(fs::absolute(log).lexically_normal().string());
+  m_Stamps.emplace_back(m_Logs.back(), log_mtime);
+  lInfo() << "Loaded include closures of " << deps.size() << " objects from " << log << ", "
+          << nodes.size() << " nodes\n";
+  return true;
+}
+
+const IncludeClosures::Closure* IncludeClosures::find(fs::path const& tu, fs::path const& output) const
+{
+  if (!output.empty() && !m_ByOutput.empty())
+  {
+    if (auto i = id(output))
+      if (auto c = m_ByOutput.find(*i); c != m_ByOutput.end())
+        return &c->second;
+  }
+  if (m_Closures.empty())
+    return nullptr;
+  auto i = id(tu);
+  if (!i)
+    return nullptr;
+  auto c = m_Closures.find(*i);
+  return c != m_Closures.end() ? &c->second : nullptr;
+}
+
+bool IncludeClosures::fresh(Closure const& c, fs::path const& tu) const
+{
+  {
+    std::unique_lock<std::mutex> lck(m_FreshMtx);
+    if (auto i = m_Fresh.find(&c); i != m_Fresh.end())
+      return i->second;
+  }
+  IncludeCache const& cache = getIncludeCache();
+  auto newer = [&](fs::path const& p)
+  {
+    FileStat st = cache.stat(p);
+    return !st.exists || st.mtime > c.mtime;
+  };
+  //ninja's records leave the source out
+  bool res = !newer(tu);
+  for(size_t i = 0; res && i < c.files.size(); ++i)
+    res = !newer(m_Paths[c.files[i]]);
+  if (!res)
+    lDbg() << "Include closure is older than the files in it, scanning: " << tu << "\n";
+  std::unique_lock<std::mutex> lck(m_FreshMtx);
+  m_Fresh[&c] = res;
+  return res;
+}
+
+void IncludeClosures::new_run()
+{
+  std::unique_lock<std::mutex> lck(m_FreshMtx);
+  m_Fresh.clear();
+}
+
+bool IncludeClosures::contains(Closure const& c, fs::path const& p) const
+{
+  auto i = id(p);
+  return i && std::binary_search(c.files.begin(), c.files.end(), *i);
+}
+
+std::optional<fs::path> IncludeClosures::resolve(Closure const& c, std::string_view spelling) const
+{
+  std::string suffix = "/" + fs::path(spelling).lexically_normal().string();
+  size_t slash = suffix.find_last_of('/');
+  auto byName = m_ByName.find(std::string_view(suffix).substr(slash + 1));
+  if (byName == m_ByName.end())
+    return {};
+  for(uint32_t i : byName->second)
+  {
+    std::string const& p = m_Paths[i];
+    if (p.size() >= suffix.size() && p.compare(p.size() - suffix.size(), suffix.size(), suffix) == 0
+        && std::binary_search(c.files.begin(), c.files.end(), i))
+      return fs::path(p);
+  }
+  return {};
+}
+
+std::vector<std::string> IncludeClosures::inputs() const
+{
+  std::vector<std::string> res = m_Logs;
+  for(auto const& [tu, c] : m_Closures)
+    res.push_back(m_Paths[*c.depfile]);
+  return res;
+}
+
+bool IncludeClosures::changed() const
+{
+  for(auto const& [p, mtime] : m_Stamps)
+  {
+    if (statFile(p).mtime != mtime)
+      return true;
+  }
+  return false;
+}
+
+void IncludeClosures::clear()
+{
+  m_Closures.clear();
+  m_ByOutput.clear();
+  m_ByName.clear();
+  m_Ids.clear();
+  m_Paths.clear();
+  m_Logs.clear();
+  m_Stamps.clear();
+  new_run();
+}
+
+/*************************************************************************/
+/*ClosureScope                                                           */
+/*************************************************************************/
+static thread_local const IncludeClosures::Closure *g_CurrentClosure = nullptr;
+static thread_local bool g_CurrentFresh = false;
+
+ClosureScope::ClosureScope(const IncludeClosures::Closure *c, bool fresh): m_Prev(g_CurrentClosure), m_PrevFresh(g_CurrentFresh)
+{
+  g_CurrentClosure = c;
+  g_CurrentFresh = c && fresh;
+}
+
+ClosureScope::ClosureScope(fs::path const& tu, fs::path const& output): m_Prev(g_CurrentClosure), m_PrevFresh(g_CurrentFresh)
+{
+  IncludeClosures const& closures = getIncludeClosures();
+  g_CurrentClosure = closures.find(tu, output);
+  g_CurrentFresh = g_CurrentClosure && closures.fresh(*g_CurrentClosure, tu);
+}
+
+ClosureScope::~ClosureScope()
+{
+  g_CurrentClosure = m_Prev;
+  g_CurrentFresh = m_PrevFresh;
+}
+
+const IncludeClosures::Closure* ClosureScope::current()
+{
+  return g_CurrentClosure;
+}
+
+bool ClosureScope::fresh()
+{
+  return g_CurrentFresh;
+}
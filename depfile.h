@@ -0,0 +1,91 @@
+#ifndef DEPFILE_H_
+#define DEPFILE_H_
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+//first rule having prerequisites, paths are unescaped
+bool parseDepfile(std::string_view content, std::string &target, std::vector<std::string> &prereqs);
+
+//include closures of TUs as written by the compiler with -MD or recorded by ninja
+//used to resolve includes the quoted-include scanner can't, e.g. ones found via -I or <...>
+class IncludeClosures
+{
+public:
+  struct Closure
+  {
+    std::optional<uint32_t> depfile;//.d file it was read from
+    std::vector<uint32_t> files;//sorted
+    int64_t mtime = 0;//of the .d file or of the object as ninja recorded it, nanoseconds
+  };
+
+  //every *.d file under root, relative paths in them are taken relative to root
+  bool load(fs::path const& root);
+  //.ninja_deps log, closures are keyed by the object, paths are relative to the log's directory
+  bool loadNinjaDeps(fs::path const& log);
+
+  //by the object first, ninja doesn't keep the source apart from the headers
+  const Closure* find(fs::path const& tu, fs::path const& output = fs::path()) const;
+  //neither the TU nor any file of it is newer, the rule make uses, so it lists exactly what the TU includes now
+  //files are seen as the include cache sees them, buffers of --overlay and changes --watch noticed count
+  bool fresh(Closure const& c, fs::path const& tu) const;
+  //files may have changed since the last run, freshness is decided again
+  void new_run();
+  bool contains(Closure const& c, fs::path const& p) const;
+  //file of the closure the include spelling refers to
+  std::optional<fs::path> resolve(Closure const& c, std::string_view spelling) const;
+
+  std::string const& path(uint32_t id) const { return m_Paths[id]; }
+  //the loaded .d files and deps logs
+  std::vector<std::string> inputs() const;
+  //a loaded input or a directory with .d files changed since it was read
+  bool changed() const;
+  void clear();
+
+private:
+  uint32_t intern(std::string p);
+  std::optional<uint32_t> id(fs::path const& p) const;
+
+  std::deque<std::string> m_Paths;//stable, the maps below refer into it
+  std::unordered_map<std::string_view, uint32_t> m_Ids;
+  std::unordered_map<std::string_view, std::vector<uint32_t>> m_ByName;
+  std::unordered_map<uint32_t, Closure> m_Closures;
+  std::unordered_map<uint32_t, Closure> m_ByOutput;
+  std::vector<std::string> m_Logs;
+  std::vector<std::pair<std::string, int64_t>> m_Stamps;//mtimes of what was read
+  //once per closure and run, a closure is looked up by every stage
+  mutable std::mutex m_FreshMtx;
+  mutable std::unordered_map<const Closure*, bool> m_Fresh;
+};
+
+IncludeClosures& getIncludeClosures();
+
+//closure of the TU being processed, installed per thread like DependencyScope
+//a fresh one decides which includes count and where they resolve, without probing the search paths
+class ClosureScope
+{
+public:
+  ClosureScope(const IncludeClosures::Closure *c, bool fresh);
+  //looked up for the TU and its object
+  ClosureScope(fs::path const& tu, fs::path const& output);
+  ~ClosureScope();
+
+  static const IncludeClosures::Closure* current();
+  static bool fresh();
+
+private:
+  const IncludeClosures::Closure *m_Prev;
+  bool m_PrevFresh;
+};
+
+#endif
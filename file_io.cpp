@@ -0,0 +1,333 @@
+#include "file_io.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <system_error>
+
+#include "stats.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PREPARE_CC_POSIX_IO
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+FileStat statFile(fs::path const& p)
+{
+  countStat(Counter::Stats);
+  FileStat res;
+#ifdef PREPARE_CC_POSIX_IO
+  struct stat st;
+  if (::stat(p.c_str(), &st) != 0)
+    return res;
+  res.exists = true;
+  res.directory = S_ISDIR(st.st_mode);
+  res.size = (uint64_t)st.st_size;
+#ifdef __APPLE__
+  res.mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+  res.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#else
+  std::error_code ec;
+  auto t = fs::last_write_time(p, ec);
+  if (ec)
+    return res;
+  res.exists = true;
+  res.directory = fs::is_directory(p, ec);
+  res.mtime = (int64_t)t.time_since_epoch().count();
+  res.size = fs::is_regular_file(p, ec) ? (uint64_t)fs::file_size(p, ec) : 0;
+#endif
+  return res;
+}
+
+bool readFile(fs::path const& p, std::string &content)
+{
+  content.clear();
+#ifdef PREPARE_CC_POSIX_IO
+  int fd = ::open(p.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (::fstat(fd, &st) == 0 && st.st_size > 0)
+    content.reserve((size_t)st.st_size);
+  char buf[16384];
+  ssize_t n;
+  while((n = ::read(fd, buf, sizeof(buf))) > 0)
+    content.append(buf, (size_t)n);
+  ::close(fd);
+  countStat(Counter::FilesOpened);
+  countStat(Counter::BytesRead, content.size());
+  return n == 0;
+#else
+  std::ifstream f(p, std::ios_base::in | std::ios_base::binary);
+  if (!f)
+    return false;
+  content.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  countStat(Counter::FilesOpened);
+  countStat(Counter::BytesRead, content.size());
+  return true;
+#endif
+}
+
+//next to p so the rename stays within the filesystem, unique so concurrent writers of p never share one
+static fs::path uniqueTempPath(fs::path const& p)
+{
+  static std::atomic<uint64_t> g_Counter{0};
+#ifdef PREPARE_CC_POSIX_IO
+  uint64_t process = (uint64_t)::getpid();
+#else
+  static const uint64_t process = std::random_device()();
+#endif
+  fs::path res = p;
+  res += ".tmp." + std::to_string(process) + "." + std::to_string(g_Counter++);
+  return res;
+}
+
+bool writeFileAtomically(fs::path const& p, std::string_view content)
+{
+  fs::path tmp = uniqueTempPath(p);
+  bool written;
+  {
+    std::ofstream f(tmp, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!f)
+      return false;
+    f.write(content.data(), content.size());
+    f.close();
+    written = !f.fail();
+  }
+  //a unique name is never reused, so nothing else would clean it up
+  std::error_code ec;
+  if (written)
+    fs::rename(tmp, p, ec);
+  if (!written || ec)
+  {
+    fs::remove(tmp, ec);
+    return false;
+  }
+  return true;
+}
+
+//FNV-1a
+uint64_t hashBytes(std::string_view data, uint64_t seed)
+{
+  uint64_t h = seed;
+  for(unsigned char c : data)
+  {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+/*************************************************************************/
+/*MappedFile                                                             */
+/*************************************************************************/
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+bool MappedFile::open(fs::path const& p)
+{
+  close();
+#ifdef PREPARE_CC_POSIX_IO
+  int fd = ::open(p.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (::fstat(fd, &st) != 0)
+  {
+    ::close(fd);
+    return false;
+  }
+  m_Size = (size_t)st.st_size;
+  if (m_Size)
+  {
+    void *pMem = ::mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (pMem == MAP_FAILED)
+    {
+      ::close(fd);
+      m_Size = 0;
+      return false;
+    }
+    m_Data = (const char*)pMem;
+    m_Mapped = true;
+  }
+  ::close(fd);
+  countStat(Counter::FilesOpened);
+  countStat(Counter::BytesRead, m_Size);
+  return true;
+#else
+  std::ifstream f(p, std::ios_base::in | std::ios_base::binary);
+  if (!f)
+    return false;
+  m_Fallback.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  m_Data = m_Fallback.data();
+  m_Size = m_Fallback.size();
+  countStat(Counter::FilesOpened);
+  countStat(Counter::BytesRead, m_Size);
+  return true;
+#endif
+}
+
+void MappedFile::close()
+{
+#ifdef PREPARE_CC_POSIX_IO
+  if (m_Mapped)
+    ::munmap((void*)m_Data, m_Size);
+#endif
+  m_Mapped = false;
+  m_Data = nullptr;
+  m_Size = 0;
+  m_Fallback.clear();
+}
+
+/*************************************************************************/
+/*ReplaceIfChangedBuf                                                    */
+/*************************************************************************/
+static const size_t kReplaceBufSize = 65536;
+
+ReplaceIfChangedBuf::ReplaceIfChangedBuf(fs::path p): m_Path(std::move(p)), m_Buf(kReplaceBufSize)
+{
+  m_Tmp = uniqueTempPath(m_Path);
+  setp(m_Buf.data(), m_Buf.data() + m_Buf.size());
+  m_Existing.open(m_Path, std::ios_base::in | std::ios_base::binary);
+  if (!m_Existing)
+    diverge();
+}
+
+ReplaceIfChangedBuf::~ReplaceIfChangedBuf()
+{
+  //not committed
+  if (m_Out.is_open())
+  {
+    m_Out.close();
+    std::error_code ec;
+    fs::remove(m_Tmp, ec);
+  }
+}
+
+bool ReplaceIfChangedBuf::diverge()
+{
+  m_Same = false;
+  m_Out.open(m_Tmp, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!m_Out)
+    return false;
+  //what matched so far is only in the existing file
+  if (m_Matched)
+  {
+    m_Existing.clear();
+    m_Existing.seekg(0);
+    m_Cmp.resize(kReplaceBufSize);
+    for(uint64_t left = m_Matched; left && m_Out;)
+    {
+      size_t n = (size_t)std::min<uint64_t>(left, m_Cmp.size());
+      if (!m_Existing.read(m_Cmp.data(), n))
+        return false;
+      m_Out.write(m_Cmp.data(), n);
+      left -= n;
+    }
+  }
+  m_Existing.close();
+  return (bool)m_Out;
+}
+
+bool ReplaceIfChangedBuf::consume(const char *p, size_t n)
+{
+  if (m_Same)
+  {
+    m_Cmp.resize(std::max(m_Cmp.size(), n));
+    m_Existing.read(m_Cmp.data(), n);
+    if ((size_t)m_Existing.gcount() == n && std::equal(p, p + n, m_Cmp.data()))
+    {
+      m_Matched += n;
+      return true;
+    }
+    if (!diverge())
+      return false;
+  }
+  m_Out.write(p, n);
+  return (bool)m_Out;
+}
+
+bool ReplaceIfChangedBuf::flush_buffer()
+{
+  size_t n = pptr() - pbase();
+  setp(m_Buf.data(), m_Buf.data() + m_Buf.size());
+  if (!n || m_Failed)
+    return !m_Failed;
+  m_Failed = !consume(m_Buf.data(), n);
+  return !m_Failed;
+}
+
+ReplaceIfChangedBuf::int_type ReplaceIfChangedBuf::overflow(int_type c)
+{
+  if (!flush_buffer())
+    return traits_type::eof();
+  if (!traits_type::eq_int_type(c, traits_type::eof()))
+  {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+std::streamsize ReplaceIfChangedBuf::xsputn(const char *s, std::streamsize n)
+{
+  std::streamsize done = 0;
+  while(done < n)
+  {
+    if (pptr() == epptr() && !flush_buffer())
+      return done;
+    std::streamsize chunk = std::min<std::streamsize>(n - done, epptr() - pptr());
+    std::copy(s + done, s + done + chunk, pptr());
+    pbump((int)chunk);
+    done += chunk;
+  }
+  return done;
+}
+
+int ReplaceIfChangedBuf::sync()
+{
+  //comparison is done in big chunks, std::endl shouldn't break them up
+  return m_Failed ? -1 : 0;
+}
+
+bool ReplaceIfChangedBuf::commit()
+{
+  if (!flush_buffer())
+    return false;
+  //existing file might be longer
+  if (m_Same && m_Existing.peek() != std::ifstream::traits_type::eof())
+  {
+    if (!diverge())
+      return false;
+  }
+  if (m_Same)
+  {
+    m_Existing.close();
+    return true;
+  }
+
+  m_Out.close();
+  std::error_code ec;
+  if (!m_Out)
+  {
+    fs::remove(m_Tmp, ec);
+    return false;
+  }
+  fs::rename(m_Tmp, m_Path, ec);
+  if (ec)
+  {
+    fs::remove(m_Tmp, ec);
+    return false;
+  }
+  return true;
+}
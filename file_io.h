@@ -0,0 +1,100 @@
+#ifndef FILE_IO_H_
+#define FILE_IO_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct FileStat
+{
+  bool exists = false;
+  bool directory = false;
+  uint64_t size = 0;
+  int64_t mtime = 0;//nanoseconds, only meant for comparison
+};
+
+FileStat statFile(fs::path const& p);
+bool readFile(fs::path const& p, std::string &content);
+//temp file + rename, so readers never see a partially written file
+bool writeFileAtomically(fs::path const& p, std::string_view content);
+
+uint64_t hashBytes(std::string_view data, uint64_t seed = 14695981039346656037ull);
+
+//read-only view of the whole file, mmap-ed where available
+class MappedFile
+{
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(MappedFile const&) = delete;
+  MappedFile& operator=(MappedFile const&) = delete;
+
+  bool open(fs::path const& p);
+  void close();
+
+  const char* data() const { return m_Data; }
+  size_t size() const { return m_Size; }
+  std::string_view view() const { return std::string_view(m_Data, m_Size); }
+
+private:
+  const char *m_Data = nullptr;
+  size_t m_Size = 0;
+  bool m_Mapped = false;
+  std::vector<char> m_Fallback;
+};
+
+//output compared against the existing file while being written
+//the file is replaced by rename only on commit() and only if the content differs,
+//so an identical result keeps the old mtime and nothing is held in memory twice
+class ReplaceIfChangedBuf: public std::streambuf
+{
+public:
+  explicit ReplaceIfChangedBuf(fs::path p);
+  ~ReplaceIfChangedBuf();
+
+  bool commit();
+  bool changed() const { return !m_Same; }
+
+protected:
+  int_type overflow(int_type c) override;
+  std::streamsize xsputn(const char *s, std::streamsize n) override;
+  int sync() override;
+
+private:
+  bool flush_buffer();
+  bool consume(const char *p, size_t n);
+  bool diverge();
+
+  fs::path m_Path;
+  fs::path m_Tmp;
+  std::ifstream m_Existing;
+  std::ofstream m_Out;
+  bool m_Same = true;
+  bool m_Failed = false;
+  uint64_t m_Matched = 0;
+  std::vector<char> m_Buf;
+  std::vector<char> m_Cmp;
+};
+
+class ReplaceIfChangedFile: public std::ostream
+{
+public:
+  explicit ReplaceIfChangedFile(fs::path p): std::ostream(nullptr), m_Buf(std::move(p)) { rdbuf(&m_Buf); }
+
+  //false if writing failed, the original file is left as it was then
+  bool commit() { return m_Buf.commit(); }
+  bool changed() const { return m_Buf.changed(); }
+
+private:
+  ReplaceIfChangedBuf m_Buf;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include <exception>
+#include <iostream>
+#include <string_view>
+#include "corpus_gen.h"
+#include "log.h"
+
+int main(int argc, char *argv[])
+{
+    GenOptions opts;
+    fs::path out;
+    bool print_help = false;
+
+    try
+    {
+      for (int i = 1; i < argc; ++i) {
+        std::string_view arg(argv[i]);
+        auto value = [&]() -> const char* {
+            if (++i < argc)
+                return argv[i];
+            print_help = true;
+            return nullptr;
+        };
+        const char *v = nullptr;
+        if (arg == "--help")
+            print_help = true;
+        else if (arg == "--out") {
+            if ((v = value()))
+                out = v;
+        }
+        else if (arg == "--seed") {
+            if ((v = value()))
+                opts.seed = std::stoull(v);
+        }
+        else if (arg == "--dirs") {
+            if ((v = value()))
+                opts.dirs = std::stoul(v);
+        }
+        else if (arg == "--tus") {
+            if ((v = value()))
+                opts.tus_per_dir = std::stoul(v);
+        }
+        else if (arg == "--stdafx-block") {
+            if ((v = value()))
+                opts.stdafx_block = std::stoul(v);
+        }
+        else if (arg == "--fanout") {
+            if ((v = value()))
+                opts.fanout = std::stoul(v);
+        }
+        else if (arg == "--depth") {
+            if ((v = value()))
+                opts.depth = std::stoul(v);
+        }
+        else if (arg == "--headers") {
+            if ((v = value()))
+                opts.headers_per_level = std::stoul(v);
+        }
+        else if (arg == "--shared-headers") {
+            if ((v = value()))
+                opts.shared_per_level = std::stoul(v);
+        }
+        else if (arg == "--shared-ratio") {
+            if ((v = value()))
+                opts.shared_ratio = std::stod(v);
+        }
+        else if (arg == "--pch") {
+            if ((v = value()) && !parsePchLayout(v, opts.pch))
+            {
+                std::cout << "Unknown pch layout " << v << "\n";
+                print_help = true;
+            }
+        }
+        else if (arg == "--long-lines") {
+            if ((v = value()))
+                opts.long_line = std::stoul(v);
+        }
+        else if (arg == "--path-depth") {
+            if ((v = value()))
+                opts.path_depth = std::stoul(v);
+        }
+        else {
+            std::cout << "Unknown argument " << arg << "\n";
+            print_help = true;
+        }
+      }
+    }
+    catch(const std::exception &e)
+    {
+        std::cout << "Encountered an error:\n" << e.what() << "\n";
+        print_help = true;
+    }
+
+    if (out.empty())
+        print_help = true;
+
+    if (print_help)
+    {
+      std::cout << "Usage: prepare_cc_gen --out <dir> [--seed <n>] [--dirs <n>] "
+                   "[--tus <per-dir>] [--stdafx-block <includes>] [--fanout <includes>] "
+                   "[--depth <levels>] [--headers <per-dir-and-level>] "
+                   "[--shared-headers <per-level>] [--shared-ratio <0..1>] "
+                   "[--pch <none|per-dir|shared|dynamic>] [--long-lines <length>] "
+                   "[--path-depth <components>] [--help]\n"
+                   "Writes <dir>/src, <dir>/build/compile_commands.json and <dir>/prepare_cc.json\n";
+      return out.empty() ? 1 : 0;
+    }
+
+    GenResult res;
+    if (!generateCorpus(opts, out, res))
+      return 1;
+    std::cout << "Generated " << res.entries << " entries, " << res.files << " files, "
+            << res.bytes << " bytes\n"
+            << "prepare_cc --config " << res.config.string() << "\n";
+    return 0;
+}
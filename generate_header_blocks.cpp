@@ -2,13 +2,14 @@
 #include "analyze_include.h"
 #include "json.hpp"
 #include "log.h"
+#include "vfs.h"
 #include <filesystem>
 #include <fstream>
 #include <string_view>
 
 std::optional<HeaderBlocks> generateHeaderBlocks(fs::path header, fs::path saveTo, CCOptions const& opts)
 {
-  if (!fs::exists(header) || !fs::exists(saveTo))
+  if (!getFileSystem().exists(header) || !getFileSystem().exists(saveTo))
   {
     lDbg() << "generateHeaderBlocks either source or destination (or both) "
               "don't exist. Aborting.\n"
@@ -45,7 +46,7 @@ std::optional<HeaderBlocks> generateHeaderBlocks(fs::path header, fs::path saveT
 
 std::optional<HeaderBlocks> generateHeaderBlocksForBlockFile(fs::path block_cpp, std::string target_subdir, CCOptions const& opts)
 {
-  if (!fs::exists(block_cpp))
+  if (!getFileSystem().exists(block_cpp))
   {
     lWarn() << "Target file for header blocks generation doesn't exist: " << block_cpp
            << "\n";
@@ -70,9 +71,9 @@ std::optional<HeaderBlocks> generateHeaderBlocksForBlockFile(fs::path block_cpp,
 	  }
   }
 
-  auto inc = getNthRelativeInclude(block_cpp);
-  if (inc.has_value())
-      return generateHeaderBlocks(inc->file, dir, opts);
+  fs::path stdafx = getFirstQuotedInclude(block_cpp);
+  if (!stdafx.empty())
+      return generateHeaderBlocks(stdafx, dir, opts);
   else
       lDbg() << "No first include to generate block files from: " << block_cpp << "\n";
 
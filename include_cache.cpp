@@ -0,0 +1,369 @@
+#include "include_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "log.h"
+#include "stats.h"
+#include "vfs.h"
+
+//File layout (native endianness, records are 8 byte aligned):
+//  header: magic[8], uint32 version, uint32 reserved, uint64 record count
+//  record: uint32 record size, uint32 path len, int64 mtime, uint64 size, uint64 hash,
+//          uint32 flags, uint32 guard len, uint32 leading guard len, uint32 include count,
+//          path, guard, leading guard, includes as (int32 line, uint32 len, spelling)
+//          the high bit of an include's len marks <...> ones
+static const char g_Magic[8] = {'P', 'C', 'C', 'I', 'N', 'C', '\0', '\1'};
+static const uint32_t g_Version = 2;
+static const size_t g_HeaderSize = 24;
+static const size_t g_RecordFixedSize = 48;
+static const uint32_t g_FlagHasGuard = 1;
+static const uint32_t g_IncAngle = 0x80000000;
+
+template<class T>
+static void put_raw(std::string &out, T v)
+{
+  out.append((const char*)&v, sizeof(v));
+}
+
+template<class T>
+static T get_raw(const char *p)
+{
+  T v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static thread_local DependencySink *g_CurrentSink = nullptr;
+
+void DependencySink::add(std::string const& f)
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  m_Files.insert(f);
+}
+
+std::vector<std::string> DependencySink::files() const
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  return std::vector<std::string>(m_Files.begin(), m_Files.end());
+}
+
+DependencyScope::DependencyScope(DependencySink *sink): m_Prev(g_CurrentSink)
+{
+  g_CurrentSink = sink;
+}
+
+DependencyScope::~DependencyScope()
+{
+  g_CurrentSink = m_Prev;
+}
+
+DependencySink* DependencyScope::current()
+{
+  return g_CurrentSink;
+}
+
+IncludeCache& getIncludeCache()
+{
+  static IncludeCache g_Cache;
+  return g_Cache;
+}
+
+ScannedFilePtr IncludeCache::get(fs::path const& p)
+{
+  std::string key = p.string();
+  if (g_CurrentSink)
+    g_CurrentSink->add(key);
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    if (auto i = m_Files.find(key); i != m_Files.end())
+      return i->second.scan;
+  }
+
+  Entry e;
+  e.st = getFileSystem().stat(p);
+  if (e.st.exists)
+  {
+    PhaseTimer timer(Phase::IncludeScan, p);
+    Record r;
+    bool persisted = false;
+    if (!reuse_persisted(key, e, r, persisted))
+    {
+      std::string content;
+      getFileSystem().read(p, content);
+      scan_content(e, content, r, persisted);
+    }
+  }
+  if (!e.scan)
+    e.scan = std::make_shared<ScannedFile>();
+
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  //someone else might have been faster, keep the first one
+  return m_Files.emplace(std::move(key), std::move(e)).first->second.scan;
+}
+
+void IncludeCache::prefetch(std::vector<fs::path> const& paths)
+{
+  std::vector<fs::path> todo;
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    for(fs::path const& p : paths)
+    {
+      if (!m_Files.count(p.string()) && std::find(todo.begin(), todo.end(), p) == todo.end())
+        todo.push_back(p);
+    }
+  }
+  //a single one gains nothing over get()
+  if (todo.size() < 2)
+    return;
+
+  PhaseTimer timer(Phase::IncludeScan);
+  std::vector<Entry> entries(todo.size());
+  std::vector<FileStat> sts;
+  getFileSystem().stat(todo, sts);
+
+  std::vector<Record> records(todo.size());
+  std::vector<char> persisted(todo.size(), 0);
+  std::vector<size_t> to_read;
+  std::vector<fs::path> read_paths;
+  std::vector<FileStat> read_sts;
+  for(size_t i = 0; i < todo.size(); ++i)
+  {
+    Entry &e = entries[i];
+    e.st = sts[i];
+    bool was_persisted = false;
+    if (e.st.exists && !reuse_persisted(todo[i].string(), e, records[i], was_persisted))
+    {
+      to_read.push_back(i);
+      read_paths.push_back(todo[i]);
+      read_sts.push_back(e.st);
+    }
+    persisted[i] = was_persisted;
+  }
+
+  std::vector<std::string> contents;
+  getFileSystem().read(read_paths, read_sts, contents);
+  for(size_t k = 0; k < to_read.size(); ++k)
+  {
+    size_t i = to_read[k];
+    scan_content(entries[i], contents[k], records[i], persisted[i]);
+  }
+
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  for(size_t i = 0; i < todo.size(); ++i)
+  {
+    if (!entries[i].scan)
+      entries[i].scan = std::make_shared<ScannedFile>();
+    m_Files.emplace(todo[i].string(), std::move(entries[i]));
+  }
+}
+
+bool IncludeCache::reuse_persisted(std::string const& key, Entry &e, Record &r, bool &persisted) const
+{
+  auto rec = m_PersistedIndex.find(key);
+  persisted = rec != m_PersistedIndex.end() && read_record(rec->second, r);
+  if (persisted && r.mtime == e.st.mtime && r.size == e.st.size)
+  {
+    e.hash = r.hash;
+    e.scan = decode(r);
+  }
+  return e.scan != nullptr;
+}
+
+void IncludeCache::scan_content(Entry &e, std::string const& content, Record const& r, bool persisted) const
+{
+  if (m_Hashing)
+    e.hash = hashBytes(content);
+  if (persisted && m_Hashing && r.hash == e.hash && r.size == e.st.size)
+    e.scan = decode(r);
+  else
+    e.scan = std::make_shared<ScannedFile>(scanIncludes(content));
+}
+
+bool IncludeCache::contains(fs::path const& p) const
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  return m_Files.count(p.string()) != 0;
+}
+
+FileStat IncludeCache::stat(fs::path const& p) const
+{
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    if (auto i = m_Files.find(p.string()); i != m_Files.end())
+      return i->second.st;
+  }
+  return getFileSystem().stat(p);
+}
+
+std::vector<std::string> IncludeCache::files() const
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  std::vector<std::string> res;
+  res.reserve(m_Files.size());
+  for(auto const& f : m_Files)
+    res.push_back(f.first);
+  return res;
+}
+
+void IncludeCache::invalidate(std::string const& path)
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  m_Files.erase(path);
+}
+
+bool IncludeCache::read_record(size_t offset, Record &r) const
+{
+  const char *pBase = m_Persisted.data();
+  size_t total = m_Persisted.size();
+  if (offset + g_RecordFixedSize > total)
+    return false;
+  const char *p = pBase + offset;
+  uint32_t recSize = get_raw<uint32_t>(p);
+  if (recSize < g_RecordFixedSize || offset + recSize > total)
+    return false;
+  r.mtime = get_raw<int64_t>(p + 8);
+  r.size = get_raw<uint64_t>(p + 16);
+  r.hash = get_raw<uint64_t>(p + 24);
+  r.raw = std::string_view(p, recSize);
+  return true;
+}
+
+ScannedFilePtr IncludeCache::decode(Record const& r)
+{
+  const char *p = r.raw.data();
+  const char *pEnd = p + r.raw.size();
+  uint32_t pathLen = get_raw<uint32_t>(p + 4);
+  uint32_t flags = get_raw<uint32_t>(p + 32);
+  uint32_t guardLen = get_raw<uint32_t>(p + 36);
+  uint32_t leadingLen = get_raw<uint32_t>(p + 40);
+  uint32_t incCount = get_raw<uint32_t>(p + 44);
+
+  auto res = std::make_shared<ScannedFile>();
+  const char *pCur = p + g_RecordFixedSize + pathLen;
+  if (pCur + guardLen + leadingLen > pEnd)
+    return nullptr;
+  if (flags & g_FlagHasGuard)
+    res->guard = std::string(pCur, guardLen);
+  pCur += guardLen;
+  res->leadingGuard.assign(pCur, leadingLen);
+  pCur += leadingLen;
+
+  res->includes.reserve(incCount);
+  for(uint32_t i = 0; i < incCount; ++i)
+  {
+    if (pCur + 8 > pEnd)
+      return nullptr;
+    int32_t line = get_raw<int32_t>(pCur);
+    uint32_t len = get_raw<uint32_t>(pCur + 4);
+    bool angle = len & g_IncAngle;
+    len &= ~g_IncAngle;
+    pCur += 8;
+    if (pCur + len > pEnd)
+      return nullptr;
+    res->includes.push_back(ScannedFile::Inc{line, std::string(pCur, len), angle});
+    pCur += len;
+  }
+  return res;
+}
+
+void IncludeCache::encode(std::string &out, std::string_view path, Entry const& e)
+{
+  size_t start = out.size();
+  ScannedFile const& s = *e.scan;
+  put_raw<uint32_t>(out, 0);//size, patched below
+  put_raw<uint32_t>(out, (uint32_t)path.size());
+  put_raw<int64_t>(out, e.st.mtime);
+  put_raw<uint64_t>(out, e.st.size);
+  put_raw<uint64_t>(out, e.hash);
+  put_raw<uint32_t>(out, s.guard.has_value() ? g_FlagHasGuard : 0);
+  put_raw<uint32_t>(out, s.guard.has_value() ? (uint32_t)s.guard->size() : 0);
+  put_raw<uint32_t>(out, (uint32_t)s.leadingGuard.size());
+  put_raw<uint32_t>(out, (uint32_t)s.includes.size());
+  out.append(path);
+  if (s.guard.has_value())
+    out.append(*s.guard);
+  out.append(s.leadingGuard);
+  for(auto const& i : s.includes)
+  {
+    put_raw<int32_t>(out, i.lineNumber);
+    put_raw<uint32_t>(out, (uint32_t)i.spelling.size() | (i.angle ? g_IncAngle : 0));
+    out.append(i.spelling);
+  }
+  out.resize((out.size() + 7) & ~size_t(7), '\0');
+  uint32_t recSize = (uint32_t)(out.size() - start);
+  std::memcpy(&out[start], &recSize, sizeof(recSize));
+}
+
+bool IncludeCache::load(fs::path const& cache_file)
+{
+  m_PersistedIndex.clear();
+  if (!m_Persisted.open(cache_file))
+  {
+    lInfo() << "No include cache at " << cache_file << "\n";
+    return false;
+  }
+
+  const char *p = m_Persisted.data();
+  size_t total = m_Persisted.size();
+  if (total < g_HeaderSize || std::memcmp(p, g_Magic, sizeof(g_Magic)) || get_raw<uint32_t>(p + 8) != g_Version)
+  {
+    lWarn() << "Include cache " << cache_file << " has unknown format. Ignoring.\n";
+    m_Persisted.close();
+    return false;
+  }
+
+  uint64_t count = get_raw<uint64_t>(p + 16);
+  size_t offset = g_HeaderSize;
+  Record r;
+  for(uint64_t i = 0; i < count && read_record(offset, r); ++i)
+  {
+    uint32_t pathLen = get_raw<uint32_t>(r.raw.data() + 4);
+    if (g_RecordFixedSize + pathLen > r.raw.size())
+      break;
+    m_PersistedIndex.emplace(std::string_view(r.raw.data() + g_RecordFixedSize, pathLen), offset);
+    offset += r.raw.size();
+  }
+  lInfo() << "Loaded " << m_PersistedIndex.size() << " records from include cache " << cache_file << "\n";
+  return true;
+}
+
+bool IncludeCache::save(fs::path const& cache_file) const
+{
+  std::string out;
+  out.append(g_Magic, sizeof(g_Magic));
+  put_raw<uint32_t>(out, g_Version);
+  put_raw<uint32_t>(out, 0);
+  put_raw<uint64_t>(out, 0);//count, patched below
+
+  uint64_t count = 0;
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    for(auto const& f : m_Files)
+    {
+      if (!f.second.st.exists)
+        continue;
+      encode(out, f.first, f.second);
+      ++count;
+    }
+
+    //not touched this time, keep as is
+    Record r;
+    for(auto const& rec : m_PersistedIndex)
+    {
+      if (m_Files.find(std::string(rec.first)) != m_Files.end() || !read_record(rec.second, r))
+        continue;
+      out.append(r.raw);
+      ++count;
+    }
+  }
+  std::memcpy(&out[16], &count, sizeof(count));
+
+  if (!writeFileAtomically(cache_file, out))
+  {
+    lErr() << "Could not write include cache to " << cache_file << "\n";
+    return false;
+  }
+  lInfo() << "Saved " << count << " records to include cache " << cache_file << "\n";
+  return true;
+}
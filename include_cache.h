@@ -0,0 +1,100 @@
+#ifndef INCLUDE_CACHE_H_
+#define INCLUDE_CACHE_H_
+
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "analyze_include.h"
+#include "file_io.h"
+
+namespace fs = std::filesystem;
+
+//collects files looked at on behalf of a task, installed per thread with DependencyScope
+class DependencySink
+{
+public:
+  void add(std::string const& f);
+  std::vector<std::string> files() const;
+
+private:
+  mutable std::mutex m_Mtx;
+  std::set<std::string> m_Files;
+};
+
+class DependencyScope
+{
+public:
+  explicit DependencyScope(DependencySink *sink);
+  ~DependencyScope();
+
+  static DependencySink* current();
+
+private:
+  DependencySink *m_Prev;
+};
+
+//scan results per file, every file is read at most once per run
+//optionally backed by a cache file from the previous run, so unchanged files are not read at all
+class IncludeCache
+{
+public:
+  ScannedFilePtr get(fs::path const& p);
+  //scans those not known yet with one batch of stats and one of reads, so get() finds them
+  void prefetch(std::vector<fs::path> const& paths);
+  //scanned already, doesn't count as a dependency
+  bool contains(fs::path const& p) const;
+  //metadata as seen by get(), stats the file if it wasn't scanned
+  FileStat stat(fs::path const& p) const;
+
+  //every path asked for so far, including those that don't exist
+  std::vector<std::string> files() const;
+  //file changed on disk, next get() scans it again
+  void invalidate(std::string const& path);
+
+  //must be done before any get()
+  bool load(fs::path const& cache_file);
+  bool save(fs::path const& cache_file) const;
+
+  //content hash lets a file with only a changed mtime be reused without rescanning
+  void set_hashing(bool on) { m_Hashing = on; }
+
+private:
+  struct Entry
+  {
+    FileStat st;
+    uint64_t hash = 0;
+    ScannedFilePtr scan;
+  };
+
+  struct Record
+  {
+    int64_t mtime;
+    uint64_t size;
+    uint64_t hash;
+    std::string_view raw;
+  };
+
+  //reuses the record of the previous run if the file is unchanged, r and persisted are for scan_content()
+  bool reuse_persisted(std::string const& key, Entry &e, Record &r, bool &persisted) const;
+  void scan_content(Entry &e, std::string const& content, Record const& r, bool persisted) const;
+  bool read_record(size_t offset, Record &r) const;
+  static ScannedFilePtr decode(Record const& r);
+  static void encode(std::string &out, std::string_view path, Entry const& e);
+
+  std::unordered_map<std::string, Entry> m_Files;
+  mutable std::mutex m_Mtx;
+  bool m_Hashing = false;
+
+  //previous run, records are decoded on demand straight from the mapping
+  MappedFile m_Persisted;
+  std::unordered_map<std::string_view, size_t> m_PersistedIndex;
+};
+
+IncludeCache& getIncludeCache();
+
+#endif
@@ -0,0 +1,239 @@
+#include "include_resolver.h"
+
+#include <cctype>
+
+#include "include_cache.h"
+#include "vfs.h"
+
+/*************************************************************************/
+/*SearchPaths                                                            */
+/*************************************************************************/
+SearchPaths::SearchPaths(std::vector<fs::path> quote, std::vector<fs::path> angle):
+  m_Quote(std::move(quote)),
+  m_Angle(std::move(angle))
+{
+}
+
+fs::path SearchPaths::find(std::string const& spelling, bool angle) const
+{
+  auto record = [](Found const& f){
+    if (DependencySink *deps = DependencyScope::current())
+      for(auto const& m : f.missed)
+        deps->add(m);
+  };
+  auto &found = m_Found[angle ? 1 : 0];
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    if (auto i = found.find(spelling); i != found.end())
+    {
+      record(i->second);
+      return i->second.file;
+    }
+  }
+
+  Found f;
+  fs::path inc(spelling);
+  IncludeResolver &resolver = getIncludeResolver();
+  if (inc.is_absolute())
+  {
+    if (resolver.exists(inc))
+      f.file = inc.lexically_normal();
+  }
+  else
+  {
+    for(auto const& d : angle ? m_Angle : m_Quote)
+    {
+      fs::path candidate = (d / inc).lexically_normal();
+      if (resolver.exists(candidate))
+      {
+        f.file = std::move(candidate);
+        break;
+      }
+      f.missed.push_back(candidate.string());
+    }
+  }
+  record(f);
+
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  return found.emplace(spelling, std::move(f)).first->second.file;
+}
+
+void SearchPaths::forget() const
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  m_Found[0].clear();
+  m_Found[1].clear();
+}
+
+/*************************************************************************/
+/*IncludeResolver                                                        */
+/*************************************************************************/
+IncludeResolver& getIncludeResolver()
+{
+  static IncludeResolver g_Resolver;
+  return g_Resolver;
+}
+
+std::vector<std::string> splitCommand(std::string const& cmd, bool cl)
+{
+  std::vector<std::string> res;
+  std::string cur;
+  bool in_token = false;
+  char quote = 0;
+  for(size_t i = 0; i < cmd.size(); ++i)
+  {
+    char c = cmd[i];
+    bool escaped_next = c == '\\' && i + 1 < cmd.size()
+        && (cl ? cmd[i + 1] == '"' : (!quote || cmd[i + 1] == '"' || cmd[i + 1] == '\\'));
+    if (quote == '\'')
+    {
+      if (c == quote)
+        quote = 0;
+      else
+        cur += c;
+    }
+    else if (escaped_next)
+    {
+      cur += cmd[++i];
+      in_token = true;
+    }
+    else if (quote)
+    {
+      if (c == quote)
+        quote = 0;
+      else
+        cur += c;
+    }
+    else if (c == '"' || (c == '\'' && !cl))
+    {
+      quote = c;
+      in_token = true;
+    }
+    else if (isspace((unsigned char)c))
+    {
+      if (in_token)
+        res.push_back(std::move(cur));
+      cur.clear();
+      in_token = false;
+    }
+    else
+    {
+      cur += c;
+      in_token = true;
+    }
+  }
+  if (in_token)
+    res.push_back(std::move(cur));
+  return res;
+}
+
+const SearchPaths* IncludeResolver::paths(nlohmann::json const& entry, bool cl)
+{
+  std::vector<std::string> args;
+  if (auto c = entry.find("command"); c != entry.end() && c->is_string())
+    args = splitCommand(c->get<std::string>(), cl);
+  else if (auto a = entry.find("arguments"); a != entry.end() && a->is_array())
+  {
+    for(auto const& v : *a)
+      if (v.is_string())
+        args.push_back(v.get<std::string>());
+  }
+  fs::path dir;
+  if (auto d = entry.find("directory"); d != entry.end() && d->is_string())
+    dir = d->get<std::string>();
+
+  std::vector<fs::path> quote, angle;
+  for(size_t i = 0; i < args.size(); ++i)
+  {
+    std::string const& a = args[i];
+    auto take = [&](std::string const& flag, std::vector<fs::path> &to){
+      if (a.compare(0, flag.size(), flag) != 0)
+        return false;
+      fs::path p = a.substr(flag.size());
+      if (p.empty() && i + 1 < args.size())
+        p = args[++i];
+      if (!p.empty())
+        to.push_back((p.is_relative() ? dir / p : p).lexically_normal());
+      return true;
+    };
+    if (take("-iquote", quote) || take("-I", angle) || (cl && take("/I", angle)))
+      continue;
+  }
+  quote.insert(quote.end(), angle.begin(), angle.end());
+
+  auto key = std::make_pair(quote, angle);
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  auto &p = m_Paths[std::move(key)];
+  if (!p)
+    p = std::make_unique<SearchPaths>(std::move(quote), std::move(angle));
+  return p.get();
+}
+
+IncludeResolver::Listing IncludeResolver::listing(fs::path const& dir)
+{
+  std::string key = dir.string();
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    if (auto i = m_Listings.find(key); i != m_Listings.end())
+      return i->second;
+  }
+
+  auto names = std::make_shared<std::unordered_set<std::string>>();
+  std::vector<FileSystem::DirEntry> entries;
+  getFileSystem().list(dir, entries);
+  for(auto &e : entries)
+    names->insert(std::move(e.name));
+
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  return m_Listings.emplace(std::move(key), std::move(names)).first->second;
+}
+
+bool IncludeResolver::exists(fs::path const& file)
+{
+  return listing(file.parent_path())->count(file.filename().string()) != 0;
+}
+
+bool IncludeResolver::invalidate(fs::path const& file)
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  auto i = m_Listings.find(file.parent_path().string());
+  if (i == m_Listings.end())
+    return false;
+  if ((i->second->count(file.filename().string()) != 0) == getFileSystem().exists(file))
+    return false;
+  m_Listings.erase(i);
+  //lookups done with the old listing
+  for(auto const& p : m_Paths)
+    p.second->forget();
+  return true;
+}
+
+std::vector<std::string> IncludeResolver::directories() const
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  std::vector<std::string> res;
+  res.reserve(m_Listings.size());
+  for(auto const& l : m_Listings)
+    res.push_back(l.first);
+  return res;
+}
+
+/*************************************************************************/
+/*SearchPathScope                                                        */
+/*************************************************************************/
+static thread_local const SearchPaths *g_CurrentPaths = nullptr;
+
+SearchPathScope::SearchPathScope(const SearchPaths *p): m_Prev(g_CurrentPaths)
+{
+  g_CurrentPaths = p;
+}
+
+SearchPathScope::~SearchPathScope()
+{
+  g_CurrentPaths = m_Prev;
+}
+
+const SearchPaths* SearchPathScope::current()
+{
+  return g_CurrentPaths;
+}
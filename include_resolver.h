@@ -0,0 +1,86 @@
+#ifndef INCLUDE_RESOLVER_H_
+#define INCLUDE_RESOLVER_H_
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "json.hpp"
+
+namespace fs = std::filesystem;
+
+//-iquote and -I directories of a compile command, shared by every command having the same ones
+class SearchPaths
+{
+public:
+  SearchPaths(std::vector<fs::path> quote, std::vector<fs::path> angle);
+
+  //first search directory having the include, empty if none does
+  //quoted includes are looked for next to the includer by the caller
+  fs::path find(std::string const& spelling, bool angle) const;
+
+  std::vector<fs::path> const& quote() const { return m_Quote; }
+  std::vector<fs::path> const& angle() const { return m_Angle; }
+
+  void forget() const;
+
+private:
+  struct Found
+  {
+    fs::path file;
+    std::vector<std::string> missed;//candidates before it, they are dependencies of the lookup too
+  };
+
+  std::vector<fs::path> m_Quote;//-iquote then -I
+  std::vector<fs::path> m_Angle;//-I
+  mutable std::mutex m_Mtx;
+  mutable std::unordered_map<std::string, Found> m_Found[2];
+};
+
+//answers "does this file exist" from directory listings read once per directory
+class IncludeResolver
+{
+public:
+  //search paths of the entry's command
+  const SearchPaths* paths(nlohmann::json const& entry, bool cl);
+
+  bool exists(fs::path const& file);
+
+  //a file was created or removed, true if a listing had to change
+  bool invalidate(fs::path const& file);
+  //every listed directory
+  std::vector<std::string> directories() const;
+
+private:
+  using Listing = std::shared_ptr<const std::unordered_set<std::string>>;
+  Listing listing(fs::path const& dir);
+
+  mutable std::mutex m_Mtx;
+  std::unordered_map<std::string, Listing> m_Listings;
+  std::map<std::pair<std::vector<fs::path>, std::vector<fs::path>>, std::unique_ptr<SearchPaths>> m_Paths;
+};
+
+IncludeResolver& getIncludeResolver();
+
+//split like a shell would, backslashes are kept as they are for cl
+std::vector<std::string> splitCommand(std::string const& cmd, bool cl);
+
+//search paths of the entry being processed, installed per thread like DependencyScope
+class SearchPathScope
+{
+public:
+  explicit SearchPathScope(const SearchPaths *p);
+  ~SearchPathScope();
+
+  static const SearchPaths* current();
+
+private:
+  const SearchPaths *m_Prev;
+};
+
+#endif
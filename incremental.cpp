@@ -0,0 +1,361 @@
+#include "incremental.h"
+
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+#include "include_cache.h"
+#include "log.h"
+#include "vfs.h"
+
+//File layout (native endianness):
+//  header: magic[8], uint32 version, uint32 reserved, uint64 fingerprint, uint64 file count, uint64 entry count
+//  file:   int64 mtime, uint64 size, uint8 exists, uint32 path len, path
+//  entry:  uint64 key, uint8 kind, uint8 flags, int32 pch, uint32 dep count, uint32 element count,
+//          uint32 file len, file, uint32 stdafx len, stdafx,
+//          deps as uint32 file indices, elements as (uint64 len, serialized json)
+static const char g_Magic[8] = {'P', 'C', 'C', 'S', 'T', 'A', 'T', '\1'};
+static const uint32_t g_Version = 2;
+static const uint8_t g_FlagHasStdafx = 1;
+static const uint8_t g_FlagHasPch = 2;
+
+template<class T>
+static void put_raw(std::string &out, T v)
+{
+  out.append((const char*)&v, sizeof(v));
+}
+
+namespace
+{
+struct Reader
+{
+  const char *p;
+  const char *pEnd;
+
+  template<class T>
+  bool get(T &v)
+  {
+    if (size_t(pEnd - p) < sizeof(v))
+      return false;
+    std::memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return true;
+  }
+
+  bool get(std::string_view &v, size_t len)
+  {
+    if (size_t(pEnd - p) < len)
+      return false;
+    v = std::string_view(p, len);
+    p += len;
+    return true;
+  }
+};
+}
+
+/*************************************************************************/
+/*IncrementalState                                                       */
+/*************************************************************************/
+bool IncrementalState::load(fs::path const& state_file, uint64_t fingerprint)
+{
+  m_Owned.clear();
+  if (!m_Data.open(state_file))
+  {
+    clear();
+    lInfo() << "No incremental state at " << state_file << ". Processing everything.\n";
+    return false;
+  }
+  if (!parse(m_Data.view(), fingerprint, state_file.string()))
+  {
+    m_Data.close();
+    return false;
+  }
+  return true;
+}
+
+bool IncrementalState::load(std::string data, uint64_t fingerprint)
+{
+  m_Data.close();
+  m_Owned = std::move(data);
+  return parse(m_Owned, fingerprint, "in memory");
+}
+
+void IncrementalState::clear()
+{
+  m_Files.clear();
+  m_FileChecked.clear();
+  m_Entries.clear();
+  m_ChangedListed = false;
+  m_Invalidated.clear();
+  m_UsersIndexed = false;
+  m_ByPath.clear();
+  m_Users.clear();
+}
+
+bool IncrementalState::parse(std::string_view data, uint64_t fingerprint, std::string const& name)
+{
+  clear();
+  Reader r{data.data(), data.data() + data.size()};
+  std::string_view magic;
+  uint32_t version = 0, reserved;
+  uint64_t fp = 0, fileCount = 0, entryCount = 0;
+  bool ok = r.get(magic, sizeof(g_Magic)) && r.get(version) && r.get(reserved) && r.get(fp)
+      && r.get(fileCount) && r.get(entryCount);
+  if (!ok || magic != std::string_view(g_Magic, sizeof(g_Magic)) || version != g_Version)
+  {
+    lWarn() << "Incremental state " << name << " has unknown format. Processing everything.\n";
+    return false;
+  }
+  if (fp != fingerprint)
+  {
+    lInfo() << "Options changed since the previous run. Processing everything.\n";
+    return false;
+  }
+
+  for(uint64_t i = 0; ok && i < fileCount; ++i)
+  {
+    File f;
+    uint8_t exists = 0;
+    uint32_t len = 0;
+    ok = r.get(f.st.mtime) && r.get(f.st.size) && r.get(exists) && r.get(len) && r.get(f.path, len);
+    f.st.exists = exists != 0;
+    if (ok)
+      m_Files.push_back(f);
+  }
+  for(uint64_t i = 0; ok && i < entryCount; ++i)
+  {
+    Entry e;
+    uint64_t key = 0;
+    uint8_t kind = 0, flags = 0;
+    int32_t pch = 0;
+    uint32_t depCount = 0, elemCount = 0, fileLen = 0, stdafxLen = 0;
+    ok = r.get(key) && r.get(kind) && r.get(flags) && r.get(pch) && r.get(depCount) && r.get(elemCount)
+        && r.get(fileLen) && r.get(e.file, fileLen) && r.get(stdafxLen) && r.get(e.stdafx_file, stdafxLen);
+    e.kind = (Kind)kind;
+    if (flags & g_FlagHasStdafx)
+      e.stdafx = IndexerPreparator::StdafxInfo{(flags & g_FlagHasPch) ? std::optional<int>(pch) : std::nullopt};
+    for(uint32_t d = 0; ok && d < depCount; ++d)
+    {
+      uint32_t idx = 0;
+      ok = r.get(idx) && idx < m_Files.size();
+      e.deps.push_back(idx);
+    }
+    for(uint32_t el = 0; ok && el < elemCount; ++el)
+    {
+      uint64_t len = 0;
+      std::string_view text;
+      ok = r.get(len) && r.get(text, len);
+      e.elements.push_back(text);
+    }
+    if (ok)
+      m_Entries.emplace(key, std::move(e));
+  }
+  if (!ok)
+  {
+    lWarn() << "Incremental state " << name << " is truncated. Processing everything.\n";
+    clear();
+    return false;
+  }
+
+  m_FileChecked.assign(m_Files.size(), 0);
+  lInfo() << "Loaded " << m_Entries.size() << " entries from incremental state " << name << "\n";
+  return true;
+}
+
+bool IncrementalState::unchanged(uint32_t file)
+{
+  if (!m_FileChecked[file])
+  {
+    File const& f = m_Files[file];
+    FileStat st = getFileSystem().stat(fs::path(f.path));
+    bool same = st.exists == f.st.exists && (!st.exists || (st.mtime == f.st.mtime && st.size == f.st.size));
+    if (!same)
+      lDbg() << "Changed since the previous run: " << f.path << "\n";
+    m_FileChecked[file] = same ? 1 : -1;
+  }
+  return m_FileChecked[file] > 0;
+}
+
+const IncrementalState::Entry* IncrementalState::find(uint64_t key)
+{
+  auto i = m_Entries.find(key);
+  if (i == m_Entries.end())
+    return nullptr;
+  if (m_ChangedListed)
+    return m_Invalidated.count(key) ? nullptr : &i->second;
+  for(uint32_t d : i->second.deps)
+    if (!unchanged(d))
+      return nullptr;
+  return &i->second;
+}
+
+bool IncrementalState::set_changed_files(fs::path const& list_file)
+{
+  std::string content;
+  if (list_file == "-")
+  {
+    content.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+  }
+  else if (!readFile(list_file, content))
+  {
+    lErr() << "Could not read list of changed files " << list_file << "\n";
+    return false;
+  }
+
+  std::vector<std::string> changed;
+  std::istringstream lines(content);
+  for(std::string line; std::getline(lines, line);)
+  {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (!line.empty())
+      changed.push_back(fs::absolute(line).lexically_normal().string());
+  }
+  set_changed_files(changed);
+  return true;
+}
+
+void IncrementalState::index_users()
+{
+  if (m_UsersIndexed)
+    return;
+  m_UsersIndexed = true;
+  for(uint32_t i = 0; i < m_Files.size(); ++i)
+    m_ByPath.emplace(fs::path(m_Files[i].path).lexically_normal().string(), i);
+
+  m_Users.assign(m_Files.size(), {});
+  for(auto const& [key, e] : m_Entries)
+    for(uint32_t d : e.deps)
+      m_Users[d].push_back(key);
+}
+
+std::vector<const IncrementalState::Entry*> IncrementalState::users(fs::path const& p)
+{
+  index_users();
+  std::vector<const Entry*> res;
+  if (auto f = m_ByPath.find(p.lexically_normal().string()); f != m_ByPath.end())
+  {
+    for(uint64_t key : m_Users[f->second])
+      res.push_back(&m_Entries.find(key)->second);
+  }
+  return res;
+}
+
+void IncrementalState::set_changed_files(std::vector<std::string> const& changed)
+{
+  index_users();
+  m_ChangedListed = true;
+  m_Invalidated.clear();
+  for(auto const& p : changed)
+  {
+    auto f = m_ByPath.find(p);
+    if (f == m_ByPath.end())
+      continue;
+    for(uint64_t key : m_Users[f->second])
+    {
+      if (m_Invalidated.insert(key).second)
+        lDbg() << "Invalidated by change of " << p << "\n";
+    }
+  }
+  lInfo() << changed.size() << " changed files invalidate " << m_Invalidated.size() << " of " << m_Entries.size()
+          << " entries\n";
+}
+
+/*************************************************************************/
+/*IncrementalStateWriter                                                 */
+/*************************************************************************/
+uint32_t IncrementalStateWriter::file_index(std::string_view path, FileStat const& st)
+{
+  if (auto i = m_FileIndex.find(path); i != m_FileIndex.end())
+    return i->second;
+  uint32_t idx = (uint32_t)m_Files.size();
+  m_Files.emplace_back(std::string(path), st);
+  m_FileIndex.emplace(std::string(path), idx);
+  return idx;
+}
+
+void IncrementalStateWriter::add(uint64_t key, IncrementalState::Kind kind, fs::path const& file, fs::path const& stdafx_file,
+                                 std::optional<IndexerPreparator::StdafxInfo> stdafx,
+                                 std::vector<std::string> const& deps, std::vector<std::string> elements)
+{
+  Entry e{key, kind, file.string(), stdafx_file.string(), stdafx, {}, std::move(elements)};
+  e.deps.reserve(deps.size());
+  for(auto const& d : deps)
+    e.deps.push_back(file_index(d, getIncludeCache().stat(d)));
+  m_Entries.push_back(std::move(e));
+}
+
+void IncrementalStateWriter::add_reused(uint64_t key, IncrementalState::Entry const& prev, IncrementalState const& from)
+{
+  Entry e{key, prev.kind, std::string(prev.file), std::string(prev.stdafx_file), prev.stdafx, {}, {}};
+  e.deps.reserve(prev.deps.size());
+  for(uint32_t d : prev.deps)
+    e.deps.push_back(file_index(from.file_path(d), from.file_stat(d)));
+  e.elements.assign(prev.elements.begin(), prev.elements.end());
+  m_Entries.push_back(std::move(e));
+}
+
+bool IncrementalStateWriter::save(fs::path const& state_file, uint64_t fingerprint) const
+{
+  if (!writeFileAtomically(state_file, encode(fingerprint)))
+  {
+    lErr() << "Could not write incremental state to " << state_file << "\n";
+    return false;
+  }
+  lInfo() << "Saved " << m_Entries.size() << " entries to incremental state " << state_file << "\n";
+  return true;
+}
+
+std::string IncrementalStateWriter::encode(uint64_t fingerprint) const
+{
+  std::string out;
+  out.append(g_Magic, sizeof(g_Magic));
+  put_raw<uint32_t>(out, g_Version);
+  put_raw<uint32_t>(out, 0);
+  put_raw<uint64_t>(out, fingerprint);
+  put_raw<uint64_t>(out, m_Files.size());
+  put_raw<uint64_t>(out, m_Entries.size());
+
+  for(auto const& [path, st] : m_Files)
+  {
+    put_raw<int64_t>(out, st.mtime);
+    put_raw<uint64_t>(out, st.size);
+    put_raw<uint8_t>(out, st.exists ? 1 : 0);
+    put_raw<uint32_t>(out, (uint32_t)path.size());
+    out.append(path);
+  }
+  for(auto const& e : m_Entries)
+  {
+    uint8_t flags = 0;
+    int32_t pch = 0;
+    if (e.stdafx)
+    {
+      flags |= g_FlagHasStdafx;
+      if (e.stdafx->pch)
+      {
+        flags |= g_FlagHasPch;
+        pch = *e.stdafx->pch;
+      }
+    }
+    put_raw<uint64_t>(out, e.key);
+    put_raw<uint8_t>(out, (uint8_t)e.kind);
+    put_raw<uint8_t>(out, flags);
+    put_raw<int32_t>(out, pch);
+    put_raw<uint32_t>(out, (uint32_t)e.deps.size());
+    put_raw<uint32_t>(out, (uint32_t)e.elements.size());
+    put_raw<uint32_t>(out, (uint32_t)e.file.size());
+    out.append(e.file);
+    put_raw<uint32_t>(out, (uint32_t)e.stdafx_file.size());
+    out.append(e.stdafx_file);
+    for(uint32_t d : e.deps)
+      put_raw<uint32_t>(out, d);
+    for(auto const& el : e.elements)
+    {
+      put_raw<uint64_t>(out, el.size());
+      out.append(el);
+    }
+  }
+
+  return out;
+}
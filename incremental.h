@@ -0,0 +1,120 @@
+#ifndef INCREMENTAL_H_
+#define INCREMENTAL_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "file_io.h"
+#include "indexer_preparator.h"
+
+namespace fs = std::filesystem;
+
+//what a previous run produced for every input entry, so unchanged entries can be re-emitted verbatim
+//entries are keyed by a hash of the input entry and how it was going to be handled
+class IncrementalState
+{
+public:
+  enum class Kind : uint8_t
+  {
+    AsIs,
+    Quick,
+    Prepare
+  };
+
+  struct Entry
+  {
+    Kind kind;
+    std::string_view file;//of the input entry
+    std::string_view stdafx_file;//its first include, empty for AsIs
+    std::optional<IndexerPreparator::StdafxInfo> stdafx;
+    std::vector<uint32_t> deps;//indices into the file table
+    std::vector<std::string_view> elements;//serialized output entries
+  };
+
+  //fails if there is no state or it was made with different options
+  bool load(fs::path const& state_file, uint64_t fingerprint);
+  bool load(std::string data, uint64_t fingerprint);
+
+  //entry with the same key whose dependencies didn't change since
+  const Entry* find(uint64_t key);
+
+  //only the listed files are considered changed and nothing is stat-ed,
+  //entries using them are found via the reverse dependency index
+  bool set_changed_files(fs::path const& list_file);
+  void set_changed_files(std::vector<std::string> const& changed);
+
+  std::string_view file_path(uint32_t idx) const { return m_Files[idx].path; }
+  FileStat const& file_stat(uint32_t idx) const { return m_Files[idx].st; }
+
+  std::unordered_map<uint64_t, Entry> const& entries() const { return m_Entries; }
+  //entries that looked at the file when they were prepared
+  std::vector<const Entry*> users(fs::path const& p);
+
+private:
+  struct File
+  {
+    std::string_view path;
+    FileStat st;
+  };
+
+  bool parse(std::string_view data, uint64_t fingerprint, std::string const& name);
+  void clear();
+  bool unchanged(uint32_t file);
+  void index_users();
+
+  MappedFile m_Data;
+  std::string m_Owned;
+  std::vector<File> m_Files;
+  std::vector<int8_t> m_FileChecked;//0 - not yet, 1 - unchanged, -1 - changed
+  std::unordered_map<uint64_t, Entry> m_Entries;
+
+  bool m_ChangedListed = false;
+  std::unordered_set<uint64_t> m_Invalidated;
+
+  //reverse dependency index, built on first use
+  bool m_UsersIndexed = false;
+  std::unordered_map<std::string, uint32_t> m_ByPath;
+  std::vector<std::vector<uint64_t>> m_Users;//file -> entries that used it
+};
+
+class IncrementalStateWriter
+{
+public:
+  void add(uint64_t key, IncrementalState::Kind kind, fs::path const& file, fs::path const& stdafx_file,
+           std::optional<IndexerPreparator::StdafxInfo> stdafx,
+           std::vector<std::string> const& deps, std::vector<std::string> elements);
+  void add_reused(uint64_t key, IncrementalState::Entry const& e, IncrementalState const& from);
+
+  bool save(fs::path const& state_file, uint64_t fingerprint) const;
+  std::string encode(uint64_t fingerprint) const;
+
+  //dependencies of all entries, including the reused ones
+  std::vector<std::pair<std::string, FileStat>> const& files() const { return m_Files; }
+
+private:
+  struct Entry
+  {
+    uint64_t key;
+    IncrementalState::Kind kind;
+    std::string file;
+    std::string stdafx_file;
+    std::optional<IndexerPreparator::StdafxInfo> stdafx;
+    std::vector<uint32_t> deps;
+    std::vector<std::string> elements;
+  };
+
+  uint32_t file_index(std::string_view path, FileStat const& st);
+
+  std::map<std::string, uint32_t, std::less<>> m_FileIndex;
+  std::vector<std::pair<std::string, FileStat>> m_Files;
+  std::vector<Entry> m_Entries;
+};
+
+#endif
@@ -1,13 +1,13 @@
 #include "indexer_preparator.h"
 #include "compile_commands_processor.h"
 #include "log.h"
+#include "stats.h"
+#include "vfs.h"
 #include <algorithm>
 #include <cctype>
 #include <filesystem>
 #include <iterator>
 
-void remove_search_and_next(std::string &where, std::string_view const & what);
-
 std::string escape_spaces(std::string s)
 {
   size_t start_pos = 0;
@@ -60,13 +60,15 @@ void IndexerPreparator::add_target(std::string &cmd, std::string const& tgt) con
     cmd = cmd + " " + std::string(compile_target) + " " + tgt;
 } 
 
-bool IndexerPreparator::try_apply_pch(nlohmann::json &obj, fs::path target) const
+bool IndexerPreparator::try_apply_pch(nlohmann::json &obj, fs::path target, fs::path const& stdafx) const
 {
-  fs::path dir = target;
-  dir.remove_filename();
-  if (auto i = pchForPath.find(dir); i != pchForPath.end())
+  auto info = GetStdafxInfo(stdafx);
+  if (!info.has_value())
+    return false;//no header blocks, Prepare wouldn't apply anything either
+
+  if (info->pch.has_value())
   {
-    obj["command"] = add_pch_include(obj["command"], PCHs[i->second].file);
+    obj["command"] = add_pch_include(obj["command"], PCHs[*info->pch].file);
     return true;
   }else
   {
@@ -83,42 +85,59 @@ bool IndexerPreparator::try_apply_pch(nlohmann::json &obj, fs::path target) cons
   return false;
 }
 
-void IndexerPreparator::QuickPrepare(nlohmann::json &obj, fs::path target, json_list &to_add)
+std::optional<IndexerPreparator::StdafxInfo> IndexerPreparator::GetStdafxInfo(fs::path const& stdafx) const
+{
+  std::unique_lock<std::mutex> lck(preparedStdafxMtx);
+  auto i = preparedStdafx.find(stdafx);
+  if (i == preparedStdafx.end())
+    return {};
+  return i->second;
+}
+
+void IndexerPreparator::SetStdafxInfo(fs::path const& stdafx, StdafxInfo info)
 {
-  fs::path dir = target;
-  dir.remove_filename();
-  if (auto i = pchForPath.find(dir); i != pchForPath.end())
-    obj["command"] = add_pch_include(obj["command"], PCHs[i->second].file);
+  std::unique_lock<std::mutex> lck(preparedStdafxMtx);
+  preparedStdafx[stdafx] = info;
+}
+
+void IndexerPreparator::QuickPrepare(nlohmann::json &obj, fs::path target, fs::path const& stdafx, json_list &to_add) const
+{
+  countStat(Counter::QuickPrepares);
+  try_apply_pch(obj, std::move(target), stdafx);
   to_add.emplace_back(std::move(obj));
 }
 
 void IndexerPreparator::Prepare(nlohmann::json &obj, fs::path target,
                                 json_list &to_add) {
-  this->target = std::move(target);//to_real_path(std::move(target), true);
-  this->pObj = &obj;
-  this->pToAdd = &to_add;
+  countStat(Counter::Prepares);
+  std::unique_ptr<Context> pCtx = make_context();
+  Context &ctx = *pCtx;
+  ctx.target = std::move(target);//to_real_path(std::move(target), true);
+  ctx.pObj = &obj;
+  ctx.pToAdd = &to_add;
 
-  do_start();
+  do_start(ctx);
 
   auto headerBlocks = generateHeaderBlocksForBlockFile(
-      this->target, opts.include_dir, opts);
+      ctx.target, opts.include_dir, opts);
   if (headerBlocks.has_value() && !headerBlocks->headers.empty()) {
-    pHeaderBlocks = &*headerBlocks;
+    ctx.pHeaderBlocks = &*headerBlocks;
 
-    do_check_pch();
+    do_check_pch(ctx);
+    SetStdafxInfo(headerBlocks->target, StdafxInfo{ctx.stdafx_pch});
 
-    if (!inc_pch.empty())
-      (*pObj)["command"] = add_pch_include((*pObj)["command"], inc_pch);
+    if (!ctx.inc_pch.empty())
+      (*ctx.pObj)["command"] = add_pch_include((*ctx.pObj)["command"], ctx.inc_pch);
 
-    inc_stdafx = inc_base;
-    inc_stdafx += headerBlocks->target.string();
-    inc_stdafx = escape_spaces(std::move(inc_stdafx));
+    ctx.inc_stdafx = inc_base;
+    ctx.inc_stdafx += headerBlocks->target.string();
+    ctx.inc_stdafx = escape_spaces(std::move(ctx.inc_stdafx));
 
-    dir_stdafx = headerBlocks->target;
-    dir_stdafx.remove_filename();
+    ctx.dir_stdafx = headerBlocks->target;
+    ctx.dir_stdafx.remove_filename();
 
     std::vector<fs::path> allowed_dirs;
-    allowed_dirs.push_back(dir_stdafx);
+    allowed_dirs.push_back(ctx.dir_stdafx);
     for (auto const& pch : opts.PCHs)
     {
         if (pch.file == headerBlocks->target)
@@ -132,14 +151,14 @@ void IndexerPreparator::Prepare(nlohmann::json &obj, fs::path target,
     for (auto const& dir_stdafx : allowed_dirs)
     {
 		//attempt finding closest relative includes for all allowed includes
-		auto inc = findClosestRelativeInclude(this->target, dir_stdafx, 1);
+		auto inc = findClosestRelativeInclude(ctx.target, dir_stdafx, 1);
 		if (inc.has_value() &&
 			(inc->file.extension() == ".cpp" || inc->file.extension() == ".CPP")) {
-		  do_closest_cpp_include(*inc);
+		  do_closest_cpp_include(ctx, *inc);
 		} else {
 		  lInfo() << "Didn't find any included cpp file (so no cpp dependency in "
 					 "json) for file: "
-				  << target << "\n";
+				  << ctx.target << "\n";
 		}
     }
 
@@ -147,7 +166,7 @@ void IndexerPreparator::Prepare(nlohmann::json &obj, fs::path target,
     for (auto &h : headerBlocks->headers) {
       if (!is_in_any_dir(allowed_dirs, h.header)) {
         lInfo() << "Ignoring header " << h.header << "\n"
-                << "as it's not in the dir: " << dir_stdafx << "\n";
+                << "as it's not in the dir: " << ctx.dir_stdafx << "\n";
         continue;
       }
       if (opts.is_skipped(h.header)) {
@@ -155,26 +174,26 @@ void IndexerPreparator::Prepare(nlohmann::json &obj, fs::path target,
         continue;
       }
 
-      process_header(h);
+      process_header(ctx, h);
     }
 
-    do_header_blocks_end();
+    do_header_blocks_end(ctx);
   } else {
-    lInfo() << "Wasn't able to generate header block files for " << this->target
+    lInfo() << "Wasn't able to generate header block files for " << ctx.target
             << "\n";
   }
 
-  do_finalize();
+  do_finalize(ctx);
 }
 
-void IndexerPreparator::add_single_pch(pch_it i)
+void IndexerPreparator::add_single_pch(Context &ctx, pch_it i) const
 {
   std::string cmd;
   if (!i->cmd.empty())
     cmd = i->cmd;
   else
   {
-    cmd = (*pObj)["command"];
+    cmd = (*ctx.pObj)["command"];
     remove_search_and_next(cmd, compile_target);
     if (!cl) remove_search_and_next(cmd, "-o");
 
@@ -186,45 +205,40 @@ void IndexerPreparator::add_single_pch(pch_it i)
   }
 
   nlohmann::json pch_cmd;
-  pch_cmd["directory"] = (*pObj)["directory"];
+  pch_cmd["directory"] = (*ctx.pObj)["directory"];
   pch_cmd["file"] = i->file.string();
   pch_cmd["command"] = cmd;
 
-  pToAdd->emplace_back(std::move(pch_cmd));
+  ctx.pToAdd->emplace_back(std::move(pch_cmd));
 }
 
-void IndexerPreparator::do_check_pch()
+void IndexerPreparator::do_check_pch(Context &ctx)
 {
-  inc_pch.clear();
-  inc_pch_base.clear();
-  fs::path stdafx = pHeaderBlocks->target;
-  auto i = std::find_if(PCHs.begin(), PCHs.end(), [&](CCOptions::PCH &p){return fs::equivalent(p.file, stdafx);}); 
+  ctx.inc_pch.clear();
+  ctx.inc_pch_base.clear();
+  ctx.stdafx_pch.reset();
+  fs::path stdafx = ctx.pHeaderBlocks->target;
+  auto i = std::find_if(PCHs.begin(), PCHs.end(), [&](CCOptions::PCH &p){return getFileSystem().equivalent(p.file, stdafx);}); 
   if (i == PCHs.end())
   {
     auto i = std::find_if(PCHs.begin(), PCHs.end(), [&](const CCOptions::PCH &p){
-      return p.can_be_applied_for(target);
+      return p.can_be_applied_for(ctx.target);
     });
 
     if (i != PCHs.end())
     {
-      inc_pch = i->file;
-      inc_pch_base = i->dep;
-
-      fs::path dir = inc_pch;
-      dir.remove_filename();
-      pchForPath[dir] = (int)std::distance(PCHs.begin(), i);
+      ctx.inc_pch = i->file;
+      ctx.inc_pch_base = i->dep;
     }
     return;
   }
 
-  fs::path dir = target;
-  dir.remove_filename();
-  pchForPath[dir] = (int)std::distance(PCHs.begin(), i);
+  ctx.stdafx_pch = (int)std::distance(PCHs.begin(), i);
 
-  inc_pch = stdafx;
-  inc_pch_base = i->dep;
+  ctx.inc_pch = stdafx;
+  ctx.inc_pch_base = i->dep;
 
-  add_single_pch(i);
+  add_single_pch(ctx, i);
 
   //find and add dedicated for the same path
   i = PCHs.begin();
@@ -233,51 +247,51 @@ void IndexerPreparator::do_check_pch()
     i = std::find_if(i, PCHs.end(), [&](CCOptions::PCH const& p){return p.cmd_from == stdafx;});
     if (i == PCHs.end())
       break;
-    add_single_pch(i);
+    add_single_pch(ctx, i);
     ++i;
   }
 }
 
-void IndexerPreparator::add_define(std::string def)
+void IndexerPreparator::add_define(Context &ctx, std::string def) const
 {
-    do_process_header_add_args(to_define(def));
+    do_process_header_add_args(ctx, to_define(def));
 }
 
-void IndexerPreparator::add_include(std::string inc)
+void IndexerPreparator::add_include(Context &ctx, std::string inc) const
 {
-  do_process_header_add_args(to_include(inc));//--include=<path-to-pch>
+  do_process_header_add_args(ctx, to_include(inc));//--include=<path-to-pch>
 }
 
-std::string IndexerPreparator::to_define(std::string def)
+std::string IndexerPreparator::to_define(std::string def) const
 {
     return std::move(def.insert(0, define_opt));
 }
 
-std::string IndexerPreparator::to_include(std::string inc)
+std::string IndexerPreparator::to_include(std::string inc) const
 {
     return std::move(inc.insert(0, inc_base));
 }
 
-void IndexerPreparator::process_header(HeaderBlocks::Header &h) {
-  pHeader = &h;
-  do_process_header_begin();
-  do_process_header_set_file(h.header.string());
-  do_process_header_remove_args(compile_target);
+void IndexerPreparator::process_header(Context &ctx, HeaderBlocks::Header &h) const {
+  ctx.pHeader = &h;
+  do_process_header_begin(ctx);
+  do_process_header_set_file(ctx, h.header.string());
+  do_process_header_remove_args(ctx, compile_target);
 
   if (!cl)
-	  do_process_header_add_args(std::string(xheader_opt));
+	  do_process_header_add_args(ctx, std::string(xheader_opt));
 
-  if (!inc_pch.empty())
+  if (!ctx.inc_pch.empty())
   {
       //for header need to remove PCH from base command
 	  std::string main_inc_pch(inc_base);
-	  main_inc_pch += inc_pch.string();
+	  main_inc_pch += ctx.inc_pch.string();
           main_inc_pch = escape_spaces(std::move(main_inc_pch));
-      do_process_header_remove_args(main_inc_pch, 0);
+      do_process_header_remove_args(ctx, main_inc_pch, 0);
   }
 
   if (!h.define.empty())
-      add_define(h.define);
+      add_define(ctx, h.define);
 
 
   if (opts.dynamic_pch)
@@ -289,23 +303,23 @@ void IndexerPreparator::process_header(HeaderBlocks::Header &h) {
 	  inc_a += inc_a_file;
           inc_a = escape_spaces(std::move(inc_a));
 
-	  do_process_header_add_dynamic_pch(inc_a_file, inc_stdafx);
+	  do_process_header_add_dynamic_pch(ctx, inc_a_file, ctx.inc_stdafx);
 
 	  //do_process_header_add_args(inc_stdafx);
-	  add_define("__CLANGD_DYNAMIC_PCH__");
-	  do_process_header_add_args(inc_a);
+	  add_define(ctx, "__CLANGD_DYNAMIC_PCH__");
+	  do_process_header_add_args(ctx, inc_a);
   }
   else
   {
-	  if (!inc_pch_base.empty())
-		  add_include(inc_pch_base.string());
-	  add_define("__CLANGD_SKIP_SELF_INCLUDE__");
-	  if (inc_pch_base.empty())
-		  add_define("__CLANGD_NO_PCH_DEP_NEXT__");
-	  do_process_header_add_args(inc_stdafx);
+	  if (!ctx.inc_pch_base.empty())
+		  add_include(ctx, ctx.inc_pch_base.string());
+	  add_define(ctx, "__CLANGD_SKIP_SELF_INCLUDE__");
+	  if (ctx.inc_pch_base.empty())
+		  add_define(ctx, "__CLANGD_NO_PCH_DEP_NEXT__");
+	  do_process_header_add_args(ctx, ctx.inc_stdafx);
   }
 
-  do_process_header_end();
+  do_process_header_end(ctx);
 }
 
 /*************************************************************************/
@@ -316,31 +330,36 @@ IndexerPreparatorWithDependencies::IndexerPreparatorWithDependencies(
     : IndexerPreparator(opts) {
 }
 
-void IndexerPreparatorWithDependencies::do_start() { deps.clear(); }
+std::unique_ptr<IndexerPreparator::Context> IndexerPreparatorWithDependencies::make_context() const {
+  return std::make_unique<DepContext>();
+}
+
+void IndexerPreparatorWithDependencies::do_start(Context &ctx) const { dep_ctx(ctx).deps.clear(); }
 
-void IndexerPreparatorWithDependencies::do_finalize() {
-  pToAdd->emplace_back(std::move(*pObj));
+void IndexerPreparatorWithDependencies::do_finalize(Context &ctx) const {
+  ctx.pToAdd->emplace_back(std::move(*ctx.pObj));
 }
 
 void IndexerPreparatorWithDependencies::do_closest_cpp_include(
-    Include &inc) {
+    Context &ctx, Include &inc) const {
   nlohmann::json cpp_dep;
   cpp_dep["file"] = inc.file.string();
   lDbg() << "Cpp dependency: " << cpp_dep["file"] << "\n";
-  deps.push_back(cpp_dep);
+  dep_ctx(ctx).deps.push_back(cpp_dep);
 }
 
-void IndexerPreparatorWithDependencies::do_process_header_begin() {
-  h_dep.clear();
-  add_args.clear();
-  rem_c.clear();
+void IndexerPreparatorWithDependencies::do_process_header_begin(Context &ctx) const {
+  DepContext &c = dep_ctx(ctx);
+  c.h_dep.clear();
+  c.add_args.clear();
+  c.rem_c.clear();
 }
 void IndexerPreparatorWithDependencies::do_process_header_set_file(
-    std::string f) {
-  h_dep["file"] = f;
+    Context &ctx, std::string f) const {
+  dep_ctx(ctx).h_dep["file"] = f;
 }
 void IndexerPreparatorWithDependencies::do_process_header_remove_args(
-    std::string_view what, int count) {
+    Context &ctx, std::string_view what, int count) const {
   // dummy
     std::string t;
     if (count)
@@ -349,44 +368,46 @@ void IndexerPreparatorWithDependencies::do_process_header_remove_args(
         t += ':';
     }
   t += what;
-  rem_c.push_back(t);
+  dep_ctx(ctx).rem_c.push_back(t);
 }
 void IndexerPreparatorWithDependencies::do_process_header_add_args(
-    std::string what) {
-  add_args.push_back(what);
+    Context &ctx, std::string what) const {
+  dep_ctx(ctx).add_args.push_back(what);
 }
 
-void IndexerPreparatorWithDependencies::do_process_header_add_dynamic_pch(std::string dynpch, const std::string &inc_stdafx)
+void IndexerPreparatorWithDependencies::do_process_header_add_dynamic_pch(Context &ctx, std::string dynpch, const std::string &inc_stdafx) const
 {
+  DepContext &c = dep_ctx(ctx);
   nlohmann::json dyn_pch;
-  dyn_pch = h_dep;
+  dyn_pch = c.h_dep;
   dyn_pch["file"] = dynpch;
-  dyn_pch["add"] = add_args;
-  if (inc_pch_base.empty())
+  dyn_pch["add"] = c.add_args;
+  if (c.inc_pch_base.empty())
   {
 	  std::string def(define_opt);
 	  def += "__CLANGD_NO_PCH_DEP_NEXT__";
 	  dyn_pch["add"].push_back(def);
   }
   else
-	  dyn_pch["add"].push_back(to_include(inc_pch_base.string()));
+	  dyn_pch["add"].push_back(to_include(c.inc_pch_base.string()));
   dyn_pch["add"].push_back(inc_stdafx);
   std::string def(define_opt);
   def += "__CLANGD_PCH_SKIP__=";
-  def += pHeader->header.string();
+  def += c.pHeader->header.string();
   dyn_pch["add"].push_back(def);
-  dyn_pch["remove"] = rem_c;
-  deps.push_back(dyn_pch);
+  dyn_pch["remove"] = c.rem_c;
+  c.deps.push_back(dyn_pch);
 }
 
-void IndexerPreparatorWithDependencies::do_process_header_end() {
-  h_dep["add"] = add_args;
-  h_dep["remove"] = rem_c;
-  deps.push_back(h_dep);
+void IndexerPreparatorWithDependencies::do_process_header_end(Context &ctx) const {
+  DepContext &c = dep_ctx(ctx);
+  c.h_dep["add"] = c.add_args;
+  c.h_dep["remove"] = c.rem_c;
+  c.deps.push_back(c.h_dep);
 }
 
-void IndexerPreparatorWithDependencies::do_header_blocks_end() {
-  (*pObj)["dependencies"] = deps;
+void IndexerPreparatorWithDependencies::do_header_blocks_end(Context &ctx) const {
+  (*ctx.pObj)["dependencies"] = dep_ctx(ctx).deps;
 }
 
 void remove_search_and_next(std::string &where, std::string_view const & what)
@@ -403,9 +424,11 @@ void remove_search_and_next(std::string &where, std::string_view const & what)
                 //found it
                 break;
             }
-        }else
-          from = res + 1;
+        }
+        from = res + 1;
     }
+    if (res == std::string::npos)
+      return;
 
     size_t to = where.size();
     auto nextArgBeg =
@@ -429,61 +452,82 @@ IndexerPreparatorCanonical::IndexerPreparatorCanonical(CCOptions const &opts)
     : IndexerPreparator(opts) 
     {
     }
-void IndexerPreparatorCanonical::do_start()
+std::unique_ptr<IndexerPreparator::Context> IndexerPreparatorCanonical::make_context() const
+{
+    return std::make_unique<CanonicalContext>();
+}
+void IndexerPreparatorCanonical::do_start(Context &ctx) const
 {
-    cleaned_cmd = (*pObj)["command"];
-    remove_search_and_next(cleaned_cmd, compile_target);
+    CanonicalContext &c = can_ctx(ctx);
+    c.cleaned_cmd = (*c.pObj)["command"];
+    remove_search_and_next(c.cleaned_cmd, compile_target);
     if (!cl)
-        remove_search_and_next(cleaned_cmd, "-o");
+        remove_search_and_next(c.cleaned_cmd, "-o");
 }
-void IndexerPreparatorCanonical::do_finalize()
+void IndexerPreparatorCanonical::do_finalize(Context &ctx) const
 {
 }
-void IndexerPreparatorCanonical::do_closest_cpp_include(Include &inc)
+void IndexerPreparatorCanonical::do_closest_cpp_include(Context &ctx, Include &inc) const
 {
-  nlohmann::json cpp_dep = *pObj;
+  CanonicalContext &c = can_ctx(ctx);
+  nlohmann::json cpp_dep = *c.pObj;
   std::string f = inc.file.string();
   cpp_dep["file"] = f;
-  std::string cmd = cleaned_cmd;
-  cmd = cmd + " " + std::string(compile_target) + " " + f + " " + inc_stdafx;
+  std::string cmd = c.cleaned_cmd;
+  cmd = cmd + " " + std::string(compile_target) + " " + f + " " + c.inc_stdafx;
   cpp_dep["command"] = cmd;
   lDbg() << "Cpp dependency: " << cpp_dep["file"] << "\n";
-  pToAdd->emplace_back(std::move(cpp_dep));
+  c.pToAdd->emplace_back(std::move(cpp_dep));
 }
 
-void IndexerPreparatorCanonical::do_process_header_begin()
+void IndexerPreparatorCanonical::do_process_header_begin(Context &ctx) const
 {
-    entry = *pObj;
-    entry_cmd = cleaned_cmd;
+    CanonicalContext &c = can_ctx(ctx);
+    c.entry = *c.pObj;
+    c.entry_cmd = c.cleaned_cmd;
 }
 
-void IndexerPreparatorCanonical::do_process_header_set_file(std::string f)
+void IndexerPreparatorCanonical::do_process_header_set_file(Context &ctx, std::string f) const
 {
-    file = f;
-    entry["file"] = f;
+    CanonicalContext &c = can_ctx(ctx);
+    c.file = f;
+    c.entry["file"] = f;
 }
 
-void IndexerPreparatorCanonical::do_process_header_remove_args(std::string_view what, int count)
+void IndexerPreparatorCanonical::do_process_header_remove_args(Context &ctx, std::string_view what, int count) const
 {
     if (what != compile_target)
-        remove_search_and_next(entry_cmd, what);
+        remove_search_and_next(can_ctx(ctx).entry_cmd, what);
 }
 
-void IndexerPreparatorCanonical::do_process_header_add_args(std::string what)
+void IndexerPreparatorCanonical::do_process_header_add_args(Context &ctx, std::string what) const
 {
-    entry_cmd += " ";
-    entry_cmd += what;
+    CanonicalContext &c = can_ctx(ctx);
+    c.entry_cmd += " ";
+    c.entry_cmd += what;
 }
-void IndexerPreparatorCanonical::do_process_header_end()
+void IndexerPreparatorCanonical::do_process_header_end(Context &ctx) const
 {
+    CanonicalContext &c = can_ctx(ctx);
     if (!cl)
-		add_header_type(entry_cmd);
-    add_target(entry_cmd, file);
+		add_header_type(c.entry_cmd);
+    add_target(c.entry_cmd, c.file);
 
-    entry["command"] = entry_cmd;
-    pToAdd->emplace_back(std::move(entry));
+    c.entry["command"] = c.entry_cmd;
+    c.pToAdd->emplace_back(std::move(c.entry));
 }
-void IndexerPreparatorCanonical::do_header_blocks_end()
+void IndexerPreparatorCanonical::do_header_blocks_end(Context &ctx) const
 {
     //dummy
 }
+
+std::unique_ptr<IndexerPreparator> createIndexerPreparator(CCOptions const& opts)
+{
+  if (!opts.no_dependencies)
+  {
+    lInfo() << "Preparing compile_commands with dependencies\n";
+    return std::make_unique<IndexerPreparatorWithDependencies>(opts);
+  }
+  lInfo() << "Preparing compile_commands without dependencies\n";
+  return std::make_unique<IndexerPreparatorCanonical>(opts);
+}
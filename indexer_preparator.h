@@ -5,6 +5,10 @@
 #include "json.hpp"
 #include "analyze_include.h"
 #include "generate_header_blocks.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 
 using json_list = std::vector<nlohmann::json>;
 
@@ -14,58 +18,82 @@ class IndexerPreparator
     IndexerPreparator(CCOptions const& opts);
     virtual ~IndexerPreparator() = default;
 
-    void QuickPrepare(nlohmann::json &obj, fs::path target, json_list &to_add);
+    //Prepare is safe to call concurrently for different entries
+    //QuickPrepare relies on the result of the Prepare done for the same first include (stdafx)
+    void QuickPrepare(nlohmann::json &obj, fs::path target, fs::path const& stdafx, json_list &to_add) const;
     void Prepare(nlohmann::json &obj, fs::path target, json_list &to_add);
-  protected:
+
+    //outcome of Prepare for a first include that QuickPrepare depends on
+    //only known for the first includes that had header blocks
+    struct StdafxInfo
+    {
+      std::optional<int> pch;//stdafx itself is a pch
+
+      bool operator==(StdafxInfo const& r) const { return pch == r.pch; }
+    };
+    std::optional<StdafxInfo> GetStdafxInfo(fs::path const& stdafx) const;
+    //for results of a Prepare done by a previous run
+    void SetStdafxInfo(fs::path const& stdafx, StdafxInfo info);
+
     std::string add_pch_include(std::string cmd, fs::path pch) const; 
+  protected:
+    //per-call state
+    struct Context
+    {
+      virtual ~Context() = default;
+
+      //call args
+      nlohmann::json *pObj;
+      json_list *pToAdd;
+      fs::path target;
+      //temp stuff
+      std::string inc_stdafx;
+      std::string inc_before;
+      std::string inc_after;
+      std::string inc_after_file;
+      fs::path dir_stdafx;
+      HeaderBlocks::Header *pHeader;//current header
+      fs::path inc_pch;
+      fs::path inc_pch_base;
+      std::optional<int> stdafx_pch;//stdafx itself is a pch
+
+      HeaderBlocks *pHeaderBlocks;
+    };
+
     void add_header_type(std::string &cmd) const; 
     void add_target(std::string &cmd, std::string const& tgt) const; 
-    bool try_apply_pch(nlohmann::json &obj, fs::path target) const;
+    bool try_apply_pch(nlohmann::json &obj, fs::path target, fs::path const& stdafx) const;
 
+    virtual std::unique_ptr<Context> make_context() const = 0;
 
-    virtual void do_start() = 0;
-    virtual void do_finalize() = 0;
-    virtual void do_closest_cpp_include(Include &inc) = 0;
+    virtual void do_start(Context &ctx) const = 0;
+    virtual void do_finalize(Context &ctx) const = 0;
+    virtual void do_closest_cpp_include(Context &ctx, Include &inc) const = 0;
 
-    void do_check_pch();
+    void do_check_pch(Context &ctx);
     using pch_it = decltype(CCOptions::PCHs)::const_iterator;
-    void add_single_pch(pch_it i);
-
-    virtual void do_process_header_begin() = 0;
-    virtual void do_process_header_set_file(std::string f) = 0;
-    virtual void do_process_header_remove_args(std::string_view what, int count = 1) = 0;
-    virtual void do_process_header_add_args(std::string what) = 0;
-    virtual void do_process_header_end() = 0;
-    virtual void do_process_header_add_dynamic_pch(std::string dynpch, const std::string &inc_stdafx) {};
-
-    virtual void do_header_blocks_end() = 0;
+    void add_single_pch(Context &ctx, pch_it i) const;
 
-    void add_define(std::string def);
-    void add_include(std::string inc);
+    virtual void do_process_header_begin(Context &ctx) const = 0;
+    virtual void do_process_header_set_file(Context &ctx, std::string f) const = 0;
+    virtual void do_process_header_remove_args(Context &ctx, std::string_view what, int count = 1) const = 0;
+    virtual void do_process_header_add_args(Context &ctx, std::string what) const = 0;
+    virtual void do_process_header_end(Context &ctx) const = 0;
+    virtual void do_process_header_add_dynamic_pch(Context &ctx, std::string dynpch, const std::string &inc_stdafx) const {};
 
-    std::string to_define(std::string def);
-    std::string to_include(std::string inc);
+    virtual void do_header_blocks_end(Context &ctx) const = 0;
 
-    void process_header(HeaderBlocks::Header &h);
+    void add_define(Context &ctx, std::string def) const;
+    void add_include(Context &ctx, std::string inc) const;
 
-    //call args
-    nlohmann::json *pObj;
-    json_list *pToAdd;
-    fs::path target;
-    //temp stuff
-    std::string inc_stdafx;
-    std::string inc_before;
-    std::string inc_after;
-    std::string inc_after_file;
-    fs::path dir_stdafx;
-    HeaderBlocks::Header *pHeader;//current header
-    fs::path inc_pch;
-    fs::path inc_pch_base;
+    std::string to_define(std::string def) const;
+    std::string to_include(std::string inc) const;
 
-    HeaderBlocks *pHeaderBlocks;
+    void process_header(Context &ctx, HeaderBlocks::Header &h) const;
 
     using pch_index_t = int;
-    std::map<fs::path, pch_index_t> pchForPath;
+    std::map<fs::path, StdafxInfo> preparedStdafx;
+    mutable std::mutex preparedStdafxMtx;
 
     //config stuff
     CCOptions const& opts;
@@ -82,21 +110,26 @@ class IndexerPreparatorWithDependencies: public IndexerPreparator
   public:
     IndexerPreparatorWithDependencies(CCOptions const &opts);
   private:
-    virtual void do_start() override;
-    virtual void do_finalize() override;
-    virtual void do_closest_cpp_include(Include &inc) override;
-    virtual void do_process_header_begin() override;
-    virtual void do_process_header_set_file(std::string f) override;
-    virtual void do_process_header_remove_args(std::string_view what, int count = 1) override;
-    virtual void do_process_header_add_args(std::string what) override;
-    virtual void do_process_header_add_dynamic_pch(std::string dynpch, const std::string &inc_stdafx) override;
-    virtual void do_process_header_end() override;
-    virtual void do_header_blocks_end() override;
-
-    nlohmann::json deps;
-    nlohmann::json rem_c;
-    nlohmann::json h_dep;
-    nlohmann::json add_args;
+    struct DepContext: Context
+    {
+      nlohmann::json deps;
+      nlohmann::json rem_c;
+      nlohmann::json h_dep;
+      nlohmann::json add_args;
+    };
+    static DepContext& dep_ctx(Context &ctx) { return static_cast<DepContext&>(ctx); }
+
+    virtual std::unique_ptr<Context> make_context() const override;
+    virtual void do_start(Context &ctx) const override;
+    virtual void do_finalize(Context &ctx) const override;
+    virtual void do_closest_cpp_include(Context &ctx, Include &inc) const override;
+    virtual void do_process_header_begin(Context &ctx) const override;
+    virtual void do_process_header_set_file(Context &ctx, std::string f) const override;
+    virtual void do_process_header_remove_args(Context &ctx, std::string_view what, int count = 1) const override;
+    virtual void do_process_header_add_args(Context &ctx, std::string what) const override;
+    virtual void do_process_header_add_dynamic_pch(Context &ctx, std::string dynpch, const std::string &inc_stdafx) const override;
+    virtual void do_process_header_end(Context &ctx) const override;
+    virtual void do_header_blocks_end(Context &ctx) const override;
 };
 
 //no dependencies, will multiply compile_commands.json entries
@@ -105,21 +138,33 @@ class IndexerPreparatorCanonical: public IndexerPreparator
   public:
     IndexerPreparatorCanonical(CCOptions const &opts);
   private:
-    virtual void do_start() override;
-    virtual void do_finalize() override;
-    virtual void do_closest_cpp_include(Include &inc) override;
-    virtual void do_process_header_begin() override;
-    virtual void do_process_header_set_file(std::string f) override;
-    virtual void do_process_header_remove_args(std::string_view what, int count = 1) override;
-    virtual void do_process_header_add_args(std::string what) override;
-    virtual void do_process_header_end() override;
-    virtual void do_header_blocks_end() override;
-
-    std::string cleaned_cmd;//no compile target, no output
-
-    nlohmann::json entry;
-    std::string entry_cmd;
-    std::string file;
+    struct CanonicalContext: Context
+    {
+      std::string cleaned_cmd;//no compile target, no output
+
+      nlohmann::json entry;
+      std::string entry_cmd;
+      std::string file;
+    };
+    static CanonicalContext& can_ctx(Context &ctx) { return static_cast<CanonicalContext&>(ctx); }
+
+    virtual std::unique_ptr<Context> make_context() const override;
+    virtual void do_start(Context &ctx) const override;
+    virtual void do_finalize(Context &ctx) const override;
+    virtual void do_closest_cpp_include(Context &ctx, Include &inc) const override;
+    virtual void do_process_header_begin(Context &ctx) const override;
+    virtual void do_process_header_set_file(Context &ctx, std::string f) const override;
+    virtual void do_process_header_remove_args(Context &ctx, std::string_view what, int count = 1) const override;
+    virtual void do_process_header_add_args(Context &ctx, std::string what) const override;
+    virtual void do_process_header_end(Context &ctx) const override;
+    virtual void do_header_blocks_end(Context &ctx) const override;
 };
 
+//removes what and the argument after it
+void remove_search_and_next(std::string &where, std::string_view const & what);
+std::string escape_spaces(std::string s);
+
+//with or without dependencies depending on the options
+std::unique_ptr<IndexerPreparator> createIndexerPreparator(CCOptions const& opts);
+
 #endif
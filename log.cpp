@@ -1,17 +1,172 @@
 #include "log.h"
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <iostream>
-#include <ostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
-static Log g_GlobalLogLevel = Log::Error;
-static std::ostream g_Null(0);
+std::atomic<int> g_LogLevel{(int)Log::Error};
 
-void setGlobalLogLevel(Log l) { g_GlobalLogLevel = l;}
-Log getGlobalLogLevel() {return g_GlobalLogLevel;}
+void setGlobalLogLevel(Log l) { g_LogLevel = (int)l;}
+Log getGlobalLogLevel() {return (Log)g_LogLevel.load();}
 
-std::ostream& log(Log l)
+//the writer is gone only at exit, whatever is logged from later static destructors is written directly
+enum WriterState { NotStarted, Running, Stopped };
+static std::atomic<int> g_WriterState{NotStarted};
+static std::atomic<std::ostream*> g_LogStream{&std::cout};
+
+//lines a thread logged that the writer hasn't taken yet
+struct LogBuffer
+{
+  std::mutex mtx;
+  std::string pending;
+};
+
+/*************************************************************************/
+/*LogWriter                                                              */
+/*************************************************************************/
+//started with the first line that passes the level check, so quiet runs have no extra thread
+class LogWriter
+{
+public:
+  LogWriter(): m_Thread([this]{ run(); }) { g_WriterState = Running; }
+  ~LogWriter()
+  {
+    {
+      std::unique_lock<std::mutex> lck(m_Mtx);
+      m_Stop = true;
+    }
+    m_Wake.notify_one();
+    m_Thread.join();
+    g_WriterState = Stopped;
+  }
+
+  void add(std::string const& line)
+  {
+    thread_local std::shared_ptr<LogBuffer> buf;
+    if (!buf)
+    {
+      buf = std::make_shared<LogBuffer>();
+      std::unique_lock<std::mutex> lck(m_Mtx);
+      m_Buffers.push_back(buf);
+    }
+    {
+      std::unique_lock<std::mutex> lck(buf->mtx);
+      buf->pending += line;
+    }
+    //only the first line after a drain wakes the writer
+    if (!m_Pending.exchange(true))
+    {
+      std::unique_lock<std::mutex> lck(m_Mtx);
+      m_Wake.notify_one();
+    }
+  }
+
+  //per thread order is kept, lines of different threads are in drain order
+  void drain()
+  {
+    std::unique_lock<std::mutex> drain_lck(m_DrainMtx);
+    m_Pending = false;
+    std::vector<std::shared_ptr<LogBuffer>> buffers;
+    {
+      std::unique_lock<std::mutex> lck(m_Mtx);
+      //buffers of finished threads go once they are empty
+      for(size_t i = 0; i < m_Buffers.size();)
+      {
+        if (m_Buffers[i].use_count() == 1 && m_Buffers[i]->pending.empty())
+        {
+          m_Buffers[i] = std::move(m_Buffers.back());
+          m_Buffers.pop_back();
+        }
+        else
+          buffers.push_back(m_Buffers[i++]);
+      }
+    }
+    m_Out.clear();
+    for(auto &b : buffers)
+    {
+      std::unique_lock<std::mutex> lck(b->mtx);
+      m_Out += b->pending;
+      b->pending.clear();
+    }
+    if (m_Out.empty())
+      return;
+    std::ostream &out = m_File.is_open() ? (std::ostream&)m_File : *g_LogStream.load();
+    out.write(m_Out.data(), m_Out.size());
+    out.flush();
+  }
+
+  bool set_file(fs::path const& p)
+  {
+    std::unique_lock<std::mutex> drain_lck(m_DrainMtx);
+    if (m_File.is_open() && p == m_FilePath)
+      return true;
+    m_File.close();
+    m_File.open(p, std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+    m_FilePath = p;
+    return m_File.is_open();
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    while(true)
+    {
+      m_Wake.wait_for(lck, std::chrono::milliseconds(100), [&]{ return m_Pending.load() || m_Stop; });
+      bool stop = m_Stop;
+      lck.unlock();
+      drain();
+      lck.lock();
+      if (stop)
+        break;
+    }
+  }
+
+  std::mutex m_Mtx;
+  std::condition_variable m_Wake;
+  std::atomic<bool> m_Pending{false};
+  bool m_Stop = false;
+  std::vector<std::shared_ptr<LogBuffer>> m_Buffers;
+
+  std::mutex m_DrainMtx;
+  std::string m_Out;
+  std::ofstream m_File;
+  fs::path m_FilePath;
+
+  std::thread m_Thread;
+};
+
+static LogWriter& getLogWriter()
+{
+  static LogWriter g_Writer;
+  return g_Writer;
+}
+
+LogLine::~LogLine()
+{
+  if (g_WriterState == Stopped)
+    *g_LogStream.load() << m_Out.str() << std::flush;
+  else
+    getLogWriter().add(m_Out.str());
+}
+
+bool setLogFile(fs::path const& p)
+{
+  return getLogWriter().set_file(p);
+}
+
+void setLogStream(std::ostream &out)
+{
+  g_LogStream = &out;
+}
+
+void flushLog()
 {
-    if (l <= getGlobalLogLevel())
-      return std::cout;
-    else
-      return g_Null;
-}
\ No newline at end of file
+  if (g_WriterState == Running)
+    getLogWriter().drain();
+}
@@ -1,7 +1,11 @@
 #ifndef LOG_H_
 #define LOG_H_
 
-#include <ostream>
+#include <atomic>
+#include <filesystem>
+#include <sstream>
+
+namespace fs = std::filesystem;
 
 enum class Log
 {
@@ -11,13 +15,49 @@ enum class Log
     Debug
 };
 
-std::ostream& log(Log l);
-inline std::ostream& lErr() {return log(Log::Error);}
-inline std::ostream& lWarn() {return log(Log::Warning);}
-inline std::ostream& lInfo() {return log(Log::Info);}
-inline std::ostream& lDbg() {return log(Log::Debug);}
-
 void setGlobalLogLevel(Log l);
 Log getGlobalLogLevel();
 
-#endif
\ No newline at end of file
+extern std::atomic<int> g_LogLevel;
+inline bool logEnabled(Log l) {return (int)l <= g_LogLevel.load(std::memory_order_relaxed);}
+
+//one message, handed over as a whole to the writer when the statement ends,
+//so lines of different threads never interleave
+class LogLine
+{
+public:
+  explicit LogLine(Log l): m_Level(l) {}
+  ~LogLine();
+  LogLine(LogLine const&) = delete;
+  LogLine& operator=(LogLine const&) = delete;
+
+  template<class T>
+  std::ostream& operator<<(T const& v) {return m_Out << v;}
+  std::ostream& operator<<(std::ostream& (*manip)(std::ostream&)) {return m_Out << manip;}
+
+private:
+  Log m_Level;
+  std::ostringstream m_Out;
+};
+
+//swallows the stream, so both branches of the level check are void
+struct LogVoidify
+{
+  void operator&(std::ostream&) {}
+};
+
+//nothing after << is evaluated when the level is disabled
+#define LOG_AT(l) !logEnabled(l) ? (void)0 : LogVoidify() & LogLine(l)
+#define lErr() LOG_AT(Log::Error)
+#define lWarn() LOG_AT(Log::Warning)
+#define lInfo() LOG_AT(Log::Info)
+#define lDbg() LOG_AT(Log::Debug)
+
+//stdout unless set, lines are appended to the file
+bool setLogFile(fs::path const& p);
+//where the lines go when there is no log file
+void setLogStream(std::ostream &out);
+//everything logged so far is written when this returns
+void flushLog();
+
+#endif
@@ -6,10 +6,32 @@
 #include "generate_header_blocks.h"
 #include "compile_commands_processor.h"
 #include "log.h"
+#include "query.h"
+#include "readahead.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "uring_io.h"
+#include "vfs.h"
+#include "watch.h"
 
-int main(int argc, char *argv[])
+struct RunMode
+{
+    bool watch = false;
+    bool check = false;
+    std::string query;
+    bool stats = false;
+    fs::path stats_json;
+    fs::path trace;
+    fs::path overlay;
+    bool io_uring = false;
+    bool readahead = false;
+};
+
+//returns true if help has to be printed
+//called again by the watch mode when the config changes
+static bool parseArguments(int argc, char *argv[], CCOptions &opts, RunMode &mode)
 {
-    CCOptions opts;
     bool print_help = false;
     fs::path base = fs::current_path();
 
@@ -68,8 +90,122 @@ int main(int argc, char *argv[])
             else
                 setGlobalLogLevel(Log::Info);
         }
+        else if (arg == "--log-file") {
+            ++i;
+            if (i < argc)
+            {
+                if (!setLogFile(argv[i]))
+                    throw std::runtime_error("Could not open the log file");
+            }
+            else
+                print_help = true;
+        }
+        else if (arg == "--jobs") {
+            ++i;
+            if (i < argc)
+                setGlobalThreadPoolSize(std::stoul(argv[i]));
+            else
+                print_help = true;
+        }
         else if (arg == "--help")
             print_help = true;
+        else if (arg == "--timings") {
+            ++i;
+            if (i < argc)
+                opts.timings = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--depfile") {
+            ++i;
+            if (i < argc)
+                opts.depfile = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--ninja-deps") {
+            ++i;
+            if (i < argc)
+                opts.ninja_deps = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--depfiles") {
+            ++i;
+            if (i < argc)
+                opts.depfiles = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--include-cache") {
+            ++i;
+            if (i < argc)
+                opts.include_cache = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--include-cache-hash")
+            opts.include_cache_hash = true;
+        else if (arg == "--incremental")
+            opts.incremental = true;
+        else if (arg == "--incremental-state") {
+            ++i;
+            if (i < argc)
+                opts.incremental_state = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--changed-files") {
+            ++i;
+            opts.incremental = true;
+            if (i < argc)
+                opts.changed_files = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--watch")
+            mode.watch = true;
+        else if (arg == "--check")
+            mode.check = true;
+        else if (arg == "--query") {
+            ++i;
+            if (i < argc)
+                mode.query = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--pipeline")
+            opts.pipeline = true;
+        else if (arg == "--stats")
+            mode.stats = true;
+        else if (arg == "--trace") {
+            ++i;
+            if (i < argc)
+                mode.trace = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--io-uring")
+            mode.io_uring = true;
+        else if (arg == "--readahead")
+            mode.readahead = true;
+        else if (arg == "--overlay") {
+            ++i;
+            if (i < argc)
+                mode.overlay = argv[i];
+            else
+                print_help = true;
+        }
+        else if (arg == "--stats-json") {
+            ++i;
+            if (i < argc)
+            {
+                mode.stats = true;
+                mode.stats_json = argv[i];
+            }
+            else
+                print_help = true;
+        }
         else if (arg == "--clang-cl")
             opts.clang_cl = true;
         else if (arg == "--base")
@@ -86,14 +222,17 @@ int main(int argc, char *argv[])
     }
     catch(const std::exception &e)
     {
+        flushLog();
         std::cout << "Encountered an error:\n" << e.what() << "\n";
         print_help = true;
     }catch(const char* pMsg)
     {
+        flushLog();
         std::cout << "Encountered an error:\n" << pMsg << "\n";
         print_help = true;
     }catch(...)
     {
+        flushLog();
         std::cout << "Encountered some error\n";
         print_help = true;
     }
@@ -104,25 +243,95 @@ int main(int argc, char *argv[])
         print_help = true;
     }
 
+    if (opts.save_to.empty())
+    {
+      lInfo() << "destination to store was not provided so using source:\n"
+              << opts.compile_commands_json << "\n";
+      opts.save_to = opts.compile_commands_json;
+    }
+    return print_help;
+}
+
+int main(int argc, char *argv[])
+{
+    CCOptions opts;
+    RunMode mode;
+    bool print_help = parseArguments(argc, argv, opts, mode);
+
     if (print_help)
     {
+      flushLog();
       std::cout << "Usage: prepare_cc [--base <dir>] --config "
                    "<path-to-json-config-file> --from "
                    "<path-to-compile_commands.json> [--to "
                    "<path-to-output-file>] [--clang-cl] [--filter-in "
                    "<path-to-process-commands>] [--filter-out "
                    "<path-to-process-commands>] [--type <ccls|clangd>] "
-                   "[--verbose [error|warning|info|dbg]] [--help]\n";
+                   "[--verbose [error|warning|info|dbg]] [--log-file <path>] [--jobs <n>] [--pipeline] [--timings "
+                   "<path-to-timings-json>] [--include-cache <path-to-cache-file>] "
+                   "[--include-cache-hash] [--incremental] [--incremental-state "
+                   "<path-to-state-file>] [--changed-files <path-to-list|->] [--watch] [--query <file|->] [--check] [--depfile <path-to-depfile>] [--depfiles <dir-with-.d-files>] [--ninja-deps <path-to-.ninja_deps>] [--stats] [--stats-json <path-to-json>] [--trace <path-to-trace-json>] [--overlay <path-to-buffers-json>] [--io-uring] [--readahead] [--help]\n";
       return 0;
     }
 
-    if (opts.save_to.empty())
+    if (mode.io_uring)
+      enableIoUring(true);
+    if (mode.readahead)
+      enableReadahead(true);
+    if (!mode.overlay.empty() && !overlayFromJson(mode.overlay))
+      return 1;
+
+    //phases aren't timed otherwise
+    enablePhaseTimers(mode.stats || !mode.trace.empty());
+    if (!mode.trace.empty())
+      startTrace();
+
+    int res = 0;
+    //0 if up to date, 1 if regeneration is needed
+    if (mode.check)
+      res = checkCompileCommands(opts) ? 0 : 1;
+    else if (!mode.query.empty())
     {
-      lInfo() << "destination to store was not provided so using source:\n"
-              << opts.compile_commands_json << "\n";
-      opts.save_to = opts.compile_commands_json;
+      //stdout is left to the results, so a log line can't end up inside one
+      setLogStream(std::cerr);
+      res = queryCompileCommands(opts, mode.query) ? 0 : 1;
+    }
+    else if (mode.watch)
+    {
+      if (opts.save_to == opts.compile_commands_json)
+      {
+        lErr() << "--watch needs --to different from --from\n";
+        return 1;
+      }
+      bool ok = watchCompileCommands(opts, [&](CCOptions &fresh){ return !parseArguments(argc, argv, fresh, mode); });
+      enableReadahead(false);
+      return ok ? 0 : 1;
+    }
+    else
+    {
+      //a failed run leaves the previous output in place
+      try
+      {
+        processCompileCommandsTo(opts);
+      }catch(const std::exception &e)
+      {
+        lErr() << "Processing failed: " << e.what() << "\n";
+        res = 1;
+      }
     }
 
-    processCompileCommandsTo(opts);
-    return 0;
+    //pending hints are given before the counters are reported
+    enableReadahead(false);
+    flushLog();
+
+    //stderr, so it doesn't mix with query results
+    if (mode.stats || !mode.stats_json.empty())
+      getFileSystem().report();
+    if (mode.stats)
+      getStats().report(std::cerr);
+    if (!mode.stats_json.empty() && !getStats().save_json(mode.stats_json))
+      lErr() << "Could not write stats to " << mode.stats_json << "\n";
+    if (!mode.trace.empty() && !writeTrace(mode.trace))
+      lErr() << "Could not write trace to " << mode.trace << "\n";
+    return res;
 }
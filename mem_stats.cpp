@@ -0,0 +1,137 @@
+#include "mem_stats.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+
+#ifdef PREPARE_CC_MEM_STATS
+#if defined(__linux__)
+#include <malloc.h>
+static size_t allocationSize(void *p) { return malloc_usable_size(p); }
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+static size_t allocationSize(void *p) { return malloc_size(p); }
+#else
+#error "PREPARE_CC_MEM_STATS is only supported on Linux and macOS"
+#endif
+#endif
+
+//plain data, so it is usable from operator new while a thread starts or exits
+static thread_local MemCounters t_Counters;
+static std::atomic<int64_t> g_Live{0};
+
+bool memStatsEnabled()
+{
+#ifdef PREPARE_CC_MEM_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+MemCounters& threadMemCounters()
+{
+  return t_Counters;
+}
+
+int64_t memLiveBytes()
+{
+  return g_Live.load(std::memory_order_relaxed);
+}
+
+uint64_t peakRss()
+{
+#ifdef __linux__
+  std::ifstream f("/proc/self/status");
+  for(std::string line; std::getline(f, line);)
+  {
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+  }
+#endif
+  return 0;
+}
+
+#ifdef PREPARE_CC_MEM_STATS
+static void* counted(void *p)
+{
+  if (!p)
+    return p;
+  int64_t size = (int64_t)allocationSize(p);
+  MemCounters &c = t_Counters;
+  ++c.allocs;
+  c.bytes += (uint64_t)size;
+  int64_t live = g_Live.fetch_add(size, std::memory_order_relaxed) + size;
+  if (live > c.peak_live)
+    c.peak_live = live;
+  return p;
+}
+
+static void uncounted(void *p)
+{
+  if (p)
+    g_Live.fetch_sub((int64_t)allocationSize(p), std::memory_order_relaxed);
+}
+
+static void* allocate(std::size_t size)
+{
+  for(;;)
+  {
+    if (void *p = std::malloc(size ? size : 1))
+      return counted(p);
+    std::new_handler h = std::get_new_handler();
+    if (!h)
+      throw std::bad_alloc();
+    h();
+  }
+}
+
+static void* allocateAligned(std::size_t size, std::align_val_t al)
+{
+  std::size_t align = (std::size_t)al;
+  for(;;)
+  {
+    void *p = nullptr;
+    if (posix_memalign(&p, align < sizeof(void*) ? sizeof(void*) : align, size ? size : 1) != 0)
+      p = nullptr;
+    if (p)
+      return counted(p);
+    std::new_handler h = std::get_new_handler();
+    if (!h)
+      throw std::bad_alloc();
+    h();
+  }
+}
+
+static void release(void *p)
+{
+  uncounted(p);
+  std::free(p);
+}
+
+void* operator new(std::size_t size) { return allocate(size); }
+void* operator new[](std::size_t size) { return allocate(size); }
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+  try { return allocate(size); } catch(...) { return nullptr; }
+}
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept
+{
+  try { return allocate(size); } catch(...) { return nullptr; }
+}
+void* operator new(std::size_t size, std::align_val_t al) { return allocateAligned(size, al); }
+void* operator new[](std::size_t size, std::align_val_t al) { return allocateAligned(size, al); }
+
+void operator delete(void *p) noexcept { release(p); }
+void operator delete[](void *p) noexcept { release(p); }
+void operator delete(void *p, std::size_t) noexcept { release(p); }
+void operator delete[](void *p, std::size_t) noexcept { release(p); }
+void operator delete(void *p, std::nothrow_t const&) noexcept { release(p); }
+void operator delete[](void *p, std::nothrow_t const&) noexcept { release(p); }
+void operator delete(void *p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { release(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept { release(p); }
+#endif
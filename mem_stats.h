@@ -0,0 +1,22 @@
+#ifndef MEM_STATS_H_
+#define MEM_STATS_H_
+
+#include <cstdint>
+
+//allocation counting, only when built with PREPARE_CC_MEM_STATS which replaces global operator new/delete
+//counts are kept per thread, live bytes are process wide
+struct MemCounters
+{
+  uint64_t allocs;
+  uint64_t bytes;
+  int64_t peak_live;//highest live bytes seen by the thread since it was last reset
+};
+
+bool memStatsEnabled();
+MemCounters& threadMemCounters();
+int64_t memLiveBytes();
+
+//VmHWM of the process, 0 if unknown
+uint64_t peakRss();
+
+#endif
@@ -0,0 +1,437 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "compile_commands_processor.h"
+#include "corpus_gen.h"
+#include "file_io.h"
+#include "json.hpp"
+#include "log.h"
+#include "mem_stats.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "vfs.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+//end-to-end regression check: every run is a child process of its own, so caches and peak memory start clean
+//the parent generates the corpora, compares the child results to the baseline and checks the output hashes
+
+static const char* g_Metrics[] = {
+  "wall_ms",
+  "cpu_ms",
+  "peak_rss_kb",
+  "read_syscalls",
+  "write_syscalls",
+  "files_opened",
+  "stat_calls",
+};
+
+struct Corpus
+{
+  const char *name;
+  size_t dirs;
+  size_t tus;
+};
+
+static const Corpus g_Corpora[] = {
+  {"small", 8, 8},
+  {"medium", 32, 32},
+  {"large", 128, 64},
+};
+
+struct PerfOptions
+{
+  fs::path baseline = "perf_baseline.json";
+  fs::path work;
+  std::vector<std::string> corpora{"small", "medium", "large"};
+  size_t repeat = 3;
+  size_t jobs = 4;
+  bool update = false;
+  bool memory = false;//the corpus read through a MemoryFileSystem
+};
+
+//syscr/syscw of /proc/self/io, read(2)-like and write(2)-like calls
+static void ioSyscalls(uint64_t &reads, uint64_t &writes)
+{
+  reads = writes = 0;
+  std::ifstream f("/proc/self/io");
+  for(std::string line; std::getline(f, line);)
+  {
+    if (line.compare(0, 6, "syscr:") == 0)
+      reads = std::strtoull(line.c_str() + 6, nullptr, 10);
+    else if (line.compare(0, 6, "syscw:") == 0)
+      writes = std::strtoull(line.c_str() + 6, nullptr, 10);
+  }
+}
+
+static double cpuMs()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return 0;
+  auto ms = [](timeval t){ return (double)t.tv_sec * 1e3 + (double)t.tv_usec / 1e3; };
+  return ms(ru.ru_utime) + ms(ru.ru_stime);
+#else
+  return 0;
+#endif
+}
+
+//a single measured run, results go to a json file since prepare_cc logs to stdout
+static int runChild(fs::path const& config, bool canonical, fs::path const& include_cache, fs::path const& memory_root, fs::path const& result)
+{
+  //loading the corpus into memory isn't part of the run, peak memory still holds it
+  uint64_t load_reads = 0, load_writes = 0, load_opened = 0, load_stats = 0;
+  double load_cpu = 0;
+  if (!memory_root.empty())
+  {
+    if (!memoryFromTree(memory_root))
+      return 1;
+    ioSyscalls(load_reads, load_writes);
+    load_cpu = cpuMs();
+    load_opened = getStats().get(Counter::FilesOpened);
+    load_stats = getStats().get(Counter::Stats);
+  }
+
+  CCOptions opts;
+  fs::path abs_config = fs::absolute(config);
+  opts.from_json_file(abs_config, abs_config.parent_path());
+  opts.no_dependencies = canonical;
+  opts.include_cache = include_cache;
+
+  auto start = std::chrono::steady_clock::now();
+  bool ok = processCompileCommandsTo(opts);
+  double wall = (double)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1e3;
+
+  uint64_t reads, writes;
+  ioSyscalls(reads, writes);
+  nlohmann::json res = {
+    {"ok", ok},
+    {"wall_ms", wall},
+    {"cpu_ms", cpuMs() - load_cpu},
+    {"peak_rss_kb", peakRss() / 1024},
+    {"read_syscalls", reads - load_reads},
+    {"write_syscalls", writes - load_writes},
+    {"files_opened", getStats().get(Counter::FilesOpened) - load_opened},
+    {"stat_calls", getStats().get(Counter::Stats) - load_stats},
+    {"output", opts.save_to.string()}
+  };
+  std::ofstream(result, std::ios_base::out | std::ios_base::trunc) << res.dump() << "\n";
+  return ok ? 0 : 1;
+}
+
+static std::string quoteArg(std::string const& s)
+{
+  std::string res = "'";
+  for(char c : s)
+    res += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  return res + "'";
+}
+
+static fs::path selfPath(const char *argv0)
+{
+  std::error_code ec;
+  fs::path p = fs::read_symlink("/proc/self/exe", ec);
+  return ec ? fs::absolute(argv0) : p;
+}
+
+//output with the corpus location taken out, so it doesn't depend on the work directory
+static std::string outputHash(fs::path const& output, std::string const& root)
+{
+  std::string content;
+  if (!readFile(output, content))
+    return {};
+  std::string res;
+  res.reserve(content.size());
+  size_t from = 0;
+  for(size_t pos; (pos = content.find(root, from)) != std::string::npos; from = pos + root.size())
+  {
+    res.append(content, from, pos - from);
+    res += "<root>";
+  }
+  res.append(content, from, std::string::npos);
+  std::ostringstream hex;
+  hex << std::hex << std::setw(16) << std::setfill('0') << hashBytes(res);
+  return hex.str();
+}
+
+/*************************************************************************/
+/*PerfRunner                                                             */
+/*************************************************************************/
+class PerfRunner
+{
+public:
+  PerfRunner(PerfOptions const& opts, fs::path self): m_Opts(opts), m_Self(std::move(self)) {}
+
+  bool measure(Corpus const& c, nlohmann::json &runs);
+
+private:
+  bool runOnce(fs::path const& config, bool canonical, fs::path const& cache, fs::path const& root, nlohmann::json &res);
+  void clean(fs::path const& output, fs::path const& cache, bool cold);
+
+  PerfOptions const& m_Opts;
+  fs::path m_Self;
+};
+
+bool PerfRunner::runOnce(fs::path const& config, bool canonical, fs::path const& cache, fs::path const& root, nlohmann::json &res)
+{
+  fs::path result = m_Opts.work / "result.json";
+  std::error_code ec;
+  fs::remove(result, ec);
+  std::string cmd = quoteArg(m_Self.string()) + " --child " + quoteArg(config.string())
+                  + " --mode " + (canonical ? "canonical" : "deps")
+                  + " --include-cache " + quoteArg(cache.string())
+                  + " --result " + quoteArg(result.string())
+                  + (m_Opts.memory ? " --memory-root " + quoteArg(root.string()) : std::string())
+                  + " --jobs " + std::to_string(m_Opts.jobs) + " > /dev/null";
+  int rc = std::system(cmd.c_str());
+  std::ifstream f(result);
+  if (rc != 0 || !f)
+  {
+    lErr() << "Run failed: " << cmd << "\n";
+    return false;
+  }
+  res = nlohmann::json::parse(f);
+  return res.value("ok", false);
+}
+
+void PerfRunner::clean(fs::path const& output, fs::path const& cache, bool cold)
+{
+  std::error_code ec;
+  fs::remove(output, ec);
+  fs::remove(fs::path(output) += ".stamp", ec);
+  if (cold)
+    fs::remove(cache, ec);
+}
+
+bool PerfRunner::measure(Corpus const& c, nlohmann::json &runs)
+{
+  GenOptions gen;
+  gen.dirs = c.dirs;
+  gen.tus_per_dir = c.tus;
+  gen.path_depth = 2;
+  gen.long_line = 200;
+  GenResult corpus;
+  fs::path root = m_Opts.work / c.name;
+  if (!generateCorpus(gen, root, corpus))
+    return false;
+  fs::path output = corpus.compile_commands.parent_path() / "compile_commands.prepared.json";
+  fs::path cache = root / "include_cache";
+  std::string root_str = fs::absolute(root).lexically_normal().string();
+
+  for(bool canonical : {false, true})
+  {
+    for(bool cold : {true, false})
+    {
+      std::string key = std::string(c.name) + (canonical ? "/canonical" : "/deps") + (cold ? "/cold" : "/warm")
+                      + (m_Opts.memory ? "/memory" : "");
+      nlohmann::json best;
+      if (!cold)
+      {
+        //fills the cache
+        clean(output, cache, true);
+        nlohmann::json ignored;
+        if (!runOnce(corpus.config, canonical, cache, root, ignored))
+          return false;
+      }
+      for(size_t i = 0; i < m_Opts.repeat; ++i)
+      {
+        clean(output, cache, cold);
+        nlohmann::json res;
+        if (!runOnce(corpus.config, canonical, cache, root, res))
+          return false;
+        //the least disturbed value of each metric
+        for(const char *m : g_Metrics)
+          best[m] = best.contains(m) ? std::min(best[m].get<double>(), res[m].get<double>()) : res[m].get<double>();
+        std::string hash = outputHash(output, root_str);
+        if (best.contains("output_hash") && best["output_hash"] != hash)
+        {
+          lErr() << key << ": output differs between repetitions\n";
+          return false;
+        }
+        best["output_hash"] = hash;
+      }
+      std::cout << "measured " << key << "\n";
+      runs[key] = std::move(best);
+    }
+  }
+  return true;
+}
+
+//regression if current > baseline * (1 + ratio) + abs
+static nlohmann::json defaultTolerances()
+{
+  return {
+    {"wall_ms", {{"ratio", 0.5}, {"abs", 50}}},
+    {"cpu_ms", {{"ratio", 0.5}, {"abs", 50}}},
+    {"peak_rss_kb", {{"ratio", 0.2}, {"abs", 4096}}},
+    {"read_syscalls", {{"ratio", 0.05}, {"abs", 64}}},
+    {"write_syscalls", {{"ratio", 0.05}, {"abs", 64}}},
+    {"files_opened", {{"ratio", 0.02}, {"abs", 0}}},
+    {"stat_calls", {{"ratio", 0.02}, {"abs", 0}}},
+  };
+}
+
+static bool compare(nlohmann::json const& baseline, nlohmann::json const& runs)
+{
+  nlohmann::json tolerances = baseline.value("tolerance", defaultTolerances());
+  nlohmann::json const& base_runs = baseline.contains("runs") ? baseline["runs"] : nlohmann::json::object();
+  bool ok = true;
+  std::cout << std::fixed << std::setprecision(1)
+            << std::left << std::setw(32) << "Run" << std::setw(16) << "metric" << std::right
+            << std::setw(14) << "baseline" << std::setw(14) << "current" << std::setw(10) << "change" << "  status\n";
+  for(auto const& [key, cur] : runs.items())
+  {
+    if (!base_runs.contains(key))
+    {
+      std::cout << std::left << std::setw(32) << key << "not in the baseline, run with --update\n";
+      continue;
+    }
+    nlohmann::json const& base = base_runs[key];
+    for(const char *m : g_Metrics)
+    {
+      if (!base.contains(m))
+        continue;
+      double b = base[m].get<double>(), c = cur[m].get<double>();
+      nlohmann::json t = tolerances.value(m, nlohmann::json::object());
+      bool regressed = c > b * (1 + t.value("ratio", 0.0)) + t.value("abs", 0.0);
+      ok = ok && !regressed;
+      std::cout << std::left << std::setw(32) << key << std::setw(16) << m << std::right
+                << std::setw(14) << b << std::setw(14) << c
+                << std::setw(9) << (b > 0 ? (c - b) * 100 / b : 0.0) << "%"
+                << (regressed ? "  REGRESSION\n" : "  ok\n");
+    }
+    bool same = base.value("output_hash", "") == cur["output_hash"].get<std::string>();
+    ok = ok && same;
+    std::cout << std::left << std::setw(32) << key << std::setw(16) << "output" << std::right
+              << std::setw(14) << base.value("output_hash", "") << "  " << cur["output_hash"].get<std::string>()
+              << (same ? "  ok\n" : "  OUTPUT CHANGED\n");
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    PerfOptions opts;
+    bool print_help = false;
+    fs::path child_config, child_cache, child_memory, child_result;
+    bool child_canonical = false;
+
+    try
+    {
+      for (int i = 1; i < argc; ++i) {
+        std::string_view arg(argv[i]);
+        bool has_value = i + 1 < argc;
+        if (arg == "--help")
+            print_help = true;
+        else if (arg == "--baseline" && has_value)
+            opts.baseline = argv[++i];
+        else if (arg == "--work" && has_value)
+            opts.work = argv[++i];
+        else if (arg == "--repeat" && has_value)
+            opts.repeat = std::max<size_t>(1, std::stoul(argv[++i]));
+        else if (arg == "--jobs" && has_value)
+            opts.jobs = std::stoul(argv[++i]);
+        else if (arg == "--update")
+            opts.update = true;
+        else if (arg == "--memory")
+            opts.memory = true;
+        else if (arg == "--corpora" && has_value)
+        {
+            opts.corpora.clear();
+            std::stringstream list(argv[++i]);
+            for(std::string c; std::getline(list, c, ',');)
+              opts.corpora.push_back(c);
+        }
+        //a single run, started by the harness itself
+        else if (arg == "--child" && has_value)
+            child_config = argv[++i];
+        else if (arg == "--mode" && has_value)
+            child_canonical = std::string_view(argv[++i]) == "canonical";
+        else if (arg == "--include-cache" && has_value)
+            child_cache = argv[++i];
+        else if (arg == "--result" && has_value)
+            child_result = argv[++i];
+        else if (arg == "--memory-root" && has_value)
+            child_memory = argv[++i];
+        else {
+            std::cout << "Unknown argument " << arg << "\n";
+            print_help = true;
+        }
+      }
+    }
+    catch(const std::exception &e)
+    {
+        std::cout << "Encountered an error:\n" << e.what() << "\n";
+        print_help = true;
+    }
+
+    if (print_help)
+    {
+      std::cout << "Usage: prepare_cc_perf [--baseline <path-to-baseline-json>] [--work <dir>] "
+                   "[--corpora <small,medium,large>] [--repeat <n>] [--jobs <n>] [--memory] [--update] [--help]\n"
+                   "Exits with 1 if a metric regressed beyond its tolerance or an output changed\n";
+      return 0;
+    }
+
+    setGlobalThreadPoolSize(opts.jobs);
+    if (!child_config.empty())
+      return runChild(child_config, child_canonical, child_cache, child_memory, child_result);
+
+    if (opts.work.empty())
+      opts.work = fs::temp_directory_path() / "prepare_cc_perf";
+    std::error_code ec;
+    fs::create_directories(opts.work, ec);
+    opts.work = fs::absolute(opts.work).lexically_normal();
+
+    PerfRunner runner(opts, selfPath(argv[0]));
+    nlohmann::json runs = nlohmann::json::object();
+    for(auto const& name : opts.corpora)
+    {
+      auto c = std::find_if(std::begin(g_Corpora), std::end(g_Corpora), [&](Corpus const& c){ return name == c.name; });
+      if (c == std::end(g_Corpora))
+      {
+        lErr() << "Unknown corpus " << name << "\n";
+        return 2;
+      }
+      if (!runner.measure(*c, runs))
+        return 2;
+    }
+
+    nlohmann::json baseline = nlohmann::json::object();
+    if (std::ifstream f(opts.baseline); f)
+      baseline = nlohmann::json::parse(f, nullptr, false);
+    if (baseline.is_discarded())
+    {
+      lErr() << "Could not parse " << opts.baseline << "\n";
+      return 2;
+    }
+
+    if (opts.update)
+    {
+      if (!baseline.contains("tolerance"))
+        baseline["tolerance"] = defaultTolerances();
+      for(auto const& [key, cur] : runs.items())
+        baseline["runs"][key] = cur;
+      std::ofstream out(opts.baseline, std::ios_base::out | std::ios_base::trunc);
+      out << baseline.dump(2) << "\n";
+      if (!out.flush())
+      {
+        lErr() << "Could not write " << opts.baseline << "\n";
+        return 2;
+      }
+      std::cout << "Baseline " << opts.baseline << " updated\n";
+      return 0;
+    }
+    return compare(baseline, runs) ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+#include "query.h"
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <iterator>
+#include <numeric>
+#include <optional>
+#include <set>
+
+#include "analyze_include.h"
+#include "depfile.h"
+#include "include_cache.h"
+#include "include_resolver.h"
+#include "log.h"
+#include "stats.h"
+#include "vfs.h"
+
+CompileCommandsQuery::CompileCommandsQuery(CCOptions const& options):
+  m_Options(options),
+  m_Indexer(createIndexerPreparator(options))
+{
+}
+
+void CompileCommandsQuery::load()
+{
+  if (m_Loaded)
+    return;
+  m_Loaded = true;
+  internProcessCompileCommands(m_Options.compile_commands_json, [&](nlohmann::json &entry, fs::path file){
+    file = file.lexically_normal();
+    if (m_Options.is_filtered_out(file))
+      return;
+    m_ByFile.emplace(file, m_Entries.size());
+    m_ByDir[file.parent_path()].push_back(m_Entries.size());
+    Candidate c;
+    c.obj = std::move(entry);
+    c.file = std::move(file);
+    m_Entries.push_back(std::move(c));
+  });
+
+  fs::path state_file = m_Options.incremental_state;
+  if (state_file.empty())
+    state_file = fs::path(m_Options.save_to) += ".incremental";
+  if (!getFileSystem().exists(state_file) || !m_State.load(state_file, m_Options.fingerprint()))
+  {
+    lInfo() << "No incremental state at " << state_file << ", only the directory of a file is looked at\n";
+    return;
+  }
+  m_Indexed = true;
+  std::map<fs::path, fs::path> stdafx_of;
+  for(auto const& [key, e] : m_State.entries())
+    stdafx_of.emplace(fs::path(e.file).lexically_normal(), fs::path(e.stdafx_file));
+  for(size_t idx = 0; idx < m_Entries.size(); ++idx)
+  {
+    auto i = stdafx_of.find(m_Entries[idx].file);
+    if (i == stdafx_of.end())
+      m_Unindexed.push_back(idx);
+    else if (!i->second.empty())
+      m_ByStdafx[i->second].push_back(idx);
+  }
+}
+
+CompileCommandsQuery::Candidate& CompileCommandsQuery::classify(size_t idx)
+{
+  Candidate &c = m_Entries[idx];
+  if (c.classified)
+    return c;
+  c.classified = true;
+  c.filtered_in = m_Options.is_filtered_in(c.file);
+  if (c.filtered_in)
+  {
+    c.search = getIncludeResolver().paths(c.obj, m_Options.clang_cl);
+    SearchPathScope search(c.search);
+    ClosureScope closure(c.file, entryOutput(c.obj));
+    c.stdafx = getFirstQuotedInclude(c.file);
+  }
+  if (!m_Options.command_modifiers.empty() && c.obj["command"].is_string())
+    c.obj["command"] = m_Options.modify_command(c.obj["command"].get<std::string>());
+  return c;
+}
+
+std::vector<size_t> CompileCommandsQuery::sharing(fs::path const& stdafx) const
+{
+  std::vector<size_t> res;
+  if (!m_Indexed)
+  {
+    //the first one having it can be anywhere before
+    res.resize(m_Entries.size());
+    std::iota(res.begin(), res.end(), 0);
+    return res;
+  }
+  res = m_Unindexed;
+  if (auto i = m_ByStdafx.find(stdafx); i != m_ByStdafx.end())
+    res.insert(res.end(), i->second.begin(), i->second.end());
+  //changed since the last run, the first include is usually next to the entries using it
+  if (auto i = m_ByDir.find(stdafx.parent_path()); i != m_ByDir.end())
+    res.insert(res.end(), i->second.begin(), i->second.end());
+  std::sort(res.begin(), res.end());
+  res.erase(std::unique(res.begin(), res.end()), res.end());
+  return res;
+}
+
+json_list const& CompileCommandsQuery::prepared(fs::path const& stdafx)
+{
+  if (auto i = m_Prepared.find(stdafx); i != m_Prepared.end())
+    return i->second;
+
+  json_list &out = m_Prepared[stdafx];
+  for(size_t idx : sharing(stdafx))
+  {
+    Candidate &c = classify(idx);
+    if (c.filtered_in && c.stdafx == stdafx)
+    {
+      lInfo() << "Preparation: " << c.file << "\n";
+      m_Preparer[stdafx] = c.file;
+      PhaseTimer timer(Phase::Prepare, stdafx.parent_path());
+      SearchPathScope search(c.search);
+      ClosureScope closure(c.file, entryOutput(c.obj));
+      m_Indexer->Prepare(c.obj, c.file, out);
+      break;
+    }
+  }
+  return out;
+}
+
+nlohmann::json CompileCommandsQuery::query(fs::path file)
+{
+  load();
+  file = fs::absolute(file).lexically_normal();
+  auto is_for_file = [&](nlohmann::json const& e){
+    return e.is_object() && e.contains("file") && e["file"].is_string()
+        && fs::path(e["file"].get<std::string>()).lexically_normal() == file;
+  };
+
+  //the file has an entry of its own
+  if (auto own = m_ByFile.find(file); own != m_ByFile.end())
+  {
+    Candidate &c = classify(own->second);
+    if (!c.filtered_in)
+      return c.obj;
+    if (!c.stdafx.empty())
+    {
+      json_list const& out = prepared(c.stdafx);
+      if (m_Preparer[c.stdafx] == file)
+      {
+        auto i = std::find_if(out.begin(), out.end(), is_for_file);
+        return i != out.end() ? *i : nlohmann::json();
+      }
+    }
+    json_list res;
+    m_Indexer->QuickPrepare(c.obj, c.file, c.stdafx, res);
+    return res.empty() ? nlohmann::json() : std::move(res.front());
+  }
+
+  //generated while preparing a first include: those that reached the file last time,
+  //and those of the closest directory having entries
+  std::vector<std::pair<size_t, fs::path>> stdafxs;//first entry having it, first include
+  if (m_Indexed)
+  {
+    for(auto const* e : m_State.users(file))
+    {
+      auto i = m_ByStdafx.find(fs::path(e->stdafx_file));
+      if (e->kind == IncrementalState::Kind::Prepare && i != m_ByStdafx.end())
+        stdafxs.emplace_back(i->second.front(), i->first);
+    }
+  }
+  for(fs::path d = file.parent_path(); ; d = d.parent_path())
+  {
+    if (auto i = m_ByDir.find(d); i != m_ByDir.end())
+    {
+      for(size_t idx : i->second)
+      {
+        Candidate &c = classify(idx);
+        if (c.filtered_in && !c.stdafx.empty())
+          stdafxs.emplace_back(idx, c.stdafx);
+      }
+      break;
+    }
+    if (d == d.parent_path())
+      break;
+  }
+  //a full run has the file first in the output of the first include prepared first
+  std::sort(stdafxs.begin(), stdafxs.end());
+  std::set<fs::path> tried;
+  for(auto const& [idx, stdafx] : stdafxs)
+  {
+    if (!tried.insert(stdafx).second)
+      continue;
+    json_list const& out = prepared(stdafx);
+    if (auto i = std::find_if(out.begin(), out.end(), is_for_file); i != out.end())
+      return *i;
+  }
+  return nlohmann::json();
+}
+
+bool queryCompileCommands(CCOptions const& options, std::string const& what)
+{
+  if (!getFileSystem().exists(options.compile_commands_json))
+  {
+    lWarn() << "Compile commands json file doesn't exit:\n"
+            << options.compile_commands_json << "\n";
+    return false;
+  }
+  if (!options.include_cache.empty())
+  {
+    getIncludeCache().set_hashing(options.include_cache_hash);
+    getIncludeCache().load(options.include_cache);
+  }
+  if (!options.depfiles.empty() || !options.ninja_deps.empty())
+    loadIncludeClosures(options);
+
+  bool res = true;
+  if (what == "-")
+  {
+    //one path per line in, one json per line out
+    CompileCommandsQuery q(options);
+    for(std::string line; std::getline(std::cin, line);)
+    {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (line.empty())
+        continue;
+      std::cout << q.query(line).dump() << std::endl;
+    }
+  }
+  else
+  {
+    CompileCommandsQuery q(options);
+    nlohmann::json e = q.query(what);
+    if (e.is_null())
+    {
+      lErr() << "No compile entry for " << what << "\n";
+      res = false;
+    }
+    else
+      std::cout << std::setw(4) << e << std::endl;
+  }
+
+  if (!options.include_cache.empty())
+    getIncludeCache().save(options.include_cache);
+  return res;
+}
@@ -0,0 +1,70 @@
+#ifndef QUERY_H_
+#define QUERY_H_
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "compile_commands_processor.h"
+#include "include_resolver.h"
+#include "incremental.h"
+#include "indexer_preparator.h"
+#include "json.hpp"
+
+namespace fs = std::filesystem;
+
+//works out the compile entry of a single file without processing the whole project
+//compile_commands is parsed once, entries are classified only when a query needs them
+//and only the first includes on the way to the file are prepared
+//which entries share a first include and which headers it reaches comes from the incremental state
+//of the last full run, without one only the file's own directory is looked at
+class CompileCommandsQuery
+{
+public:
+  explicit CompileCommandsQuery(CCOptions const& options);
+
+  //entry generated for the file, null if there is none
+  nlohmann::json query(fs::path file);
+
+private:
+  struct Candidate
+  {
+    nlohmann::json obj;
+    fs::path file;
+    fs::path stdafx;//first include
+    const SearchPaths *search = nullptr;
+    bool filtered_in = false;
+    bool classified = false;
+  };
+
+  void load();
+  //first include and the modified command, done once per entry
+  Candidate& classify(size_t idx);
+  //entries that may have the first include, in input order
+  std::vector<size_t> sharing(fs::path const& stdafx) const;
+  //output of Prepare for the first include, done by the first entry in input order having it like in a full run
+  json_list const& prepared(fs::path const& stdafx);
+
+  CCOptions const& m_Options;
+  std::unique_ptr<IndexerPreparator> m_Indexer;
+  std::map<fs::path, json_list> m_Prepared;
+  std::map<fs::path, fs::path> m_Preparer;//first include -> entry which prepared it
+
+  bool m_Loaded = false;
+  std::vector<Candidate> m_Entries;//filtered out ones are left out
+  std::map<fs::path, size_t> m_ByFile;
+  std::map<fs::path, std::vector<size_t>> m_ByDir;
+
+  //as of the last full run, entries it didn't know are always looked at
+  IncrementalState m_State;
+  bool m_Indexed = false;
+  std::map<fs::path, std::vector<size_t>> m_ByStdafx;
+  std::vector<size_t> m_Unindexed;
+};
+
+//prints the entry of the file, '-' answers one query per line read from stdin
+bool queryCompileCommands(CCOptions const& options, std::string const& what);
+
+#endif
@@ -0,0 +1,119 @@
+#include "readahead.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include "bounded_queue.h"
+#include "include_cache.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+
+#if defined(__unix__)
+#define PREPARE_CC_FADVISE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//enough for the frontiers of all workers, the hints are cheap to drain
+static const size_t kQueueSize = 4096;
+
+/*************************************************************************/
+/*Readahead                                                              */
+/*************************************************************************/
+class Readahead
+{
+public:
+  Readahead(): m_Queue(kQueueSize), m_Thread([this]{ run(); }) {}
+  ~Readahead()
+  {
+    m_Queue.close();
+    m_Thread.join();
+  }
+
+  void push(fs::path p)
+  {
+    if (!m_Queue.try_push(std::move(p)))
+      countStat(Counter::ReadaheadDropped);
+  }
+
+private:
+  void run()
+  {
+    setTraceThreadName("readahead");
+    std::unordered_set<std::string> hinted;
+    fs::path p;
+    while(m_Queue.pop(p))
+    {
+      //the worker got there first
+      if (getIncludeCache().contains(p))
+      {
+        countStat(Counter::ReadaheadLate);
+        continue;
+      }
+      if (!hinted.insert(p.string()).second)
+        continue;
+#ifdef PREPARE_CC_FADVISE
+      int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      ::close(fd);
+      countStat(Counter::ReadaheadHints);
+#endif
+    }
+  }
+
+  BoundedQueue<fs::path> m_Queue;
+  std::thread m_Thread;
+};
+
+static std::mutex g_Mtx;
+static std::unique_ptr<Readahead> g_Readahead;
+static std::atomic<bool> g_Enabled{false};
+
+bool enableReadahead(bool on)
+{
+#ifndef PREPARE_CC_FADVISE
+  if (on)
+  {
+    lWarn() << "readahead hints are not supported on this platform\n";
+    on = false;
+  }
+#endif
+  std::unique_ptr<Readahead> old;
+  {
+    std::unique_lock<std::mutex> lck(g_Mtx);
+    g_Enabled = on;
+    if (on && !g_Readahead)
+      g_Readahead = std::make_unique<Readahead>();
+    else if (!on)
+      old = std::move(g_Readahead);
+  }
+  //joined outside of the lock, pending hints are still given
+  old.reset();
+  return on;
+}
+
+bool readaheadEnabled()
+{
+  return g_Enabled;
+}
+
+void readaheadFiles(std::vector<fs::path> const& paths)
+{
+  std::vector<fs::path> todo;
+  for(fs::path const& p : paths)
+  {
+    if (!getIncludeCache().contains(p))
+      todo.push_back(p);
+  }
+  std::unique_lock<std::mutex> lck(g_Mtx);
+  if (!g_Readahead)
+    return;
+  for(fs::path &p : todo)
+    g_Readahead->push(std::move(p));
+}
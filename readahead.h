@@ -0,0 +1,17 @@
+#ifndef READAHEAD_H_
+#define READAHEAD_H_
+
+#include <filesystem>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+//asks the kernel to start loading files a worker is about to scan, so cold page cache misses
+//overlap with parsing of the current file, the hints are given from a thread of its own
+bool enableReadahead(bool on);
+bool readaheadEnabled();
+
+//never waits, what doesn't fit in the queue is dropped
+void readaheadFiles(std::vector<fs::path> const& paths);
+
+#endif
@@ -0,0 +1,100 @@
+#include "stamp.h"
+
+#include <cstring>
+
+#include "log.h"
+
+//File layout (native endianness):
+//  header: magic[8], uint32 version, uint32 reserved, uint64 fingerprint, uint64 file count
+//  file:   int64 mtime, uint64 size, uint8 exists, uint32 path len, path
+static const char g_Magic[8] = {'P', 'C', 'C', 'S', 'T', 'M', 'P', '\1'};
+static const uint32_t g_Version = 1;
+static const size_t g_HeaderSize = 32;
+static const size_t g_FileFixedSize = 21;
+
+template<class T>
+static void put_raw(std::string &out, T v)
+{
+  out.append((const char*)&v, sizeof(v));
+}
+
+template<class T>
+static T get_raw(const char *p)
+{
+  T v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+bool saveStamp(fs::path const& stamp_file, uint64_t fingerprint, stamp_files const& files)
+{
+  std::string out;
+  out.append(g_Magic, sizeof(g_Magic));
+  put_raw<uint32_t>(out, g_Version);
+  put_raw<uint32_t>(out, 0);
+  put_raw<uint64_t>(out, fingerprint);
+  put_raw<uint64_t>(out, files.size());
+  for(auto const& [path, st] : files)
+  {
+    put_raw<int64_t>(out, st.mtime);
+    put_raw<uint64_t>(out, st.size);
+    put_raw<uint8_t>(out, st.exists ? 1 : 0);
+    put_raw<uint32_t>(out, (uint32_t)path.size());
+    out.append(path);
+  }
+  if (!writeFileAtomically(stamp_file, out))
+  {
+    lErr() << "Could not write stamp " << stamp_file << "\n";
+    return false;
+  }
+  lInfo() << "Saved stamp of " << files.size() << " inputs to " << stamp_file << "\n";
+  return true;
+}
+
+bool checkStamp(fs::path const& stamp_file, uint64_t fingerprint)
+{
+  MappedFile data;
+  if (!data.open(stamp_file))
+  {
+    lInfo() << "No stamp at " << stamp_file << "\n";
+    return false;
+  }
+  const char *p = data.data();
+  const char *pEnd = p + data.size();
+  if (data.size() < g_HeaderSize || std::memcmp(p, g_Magic, sizeof(g_Magic)) || get_raw<uint32_t>(p + 8) != g_Version)
+  {
+    lInfo() << "Stamp " << stamp_file << " has unknown format\n";
+    return false;
+  }
+  if (get_raw<uint64_t>(p + 16) != fingerprint)
+  {
+    lInfo() << "Options changed\n";
+    return false;
+  }
+
+  uint64_t count = get_raw<uint64_t>(p + 24);
+  p += g_HeaderSize;
+  for(uint64_t i = 0; i < count; ++i)
+  {
+    if (size_t(pEnd - p) < g_FileFixedSize)
+      return false;
+    FileStat was;
+    was.mtime = get_raw<int64_t>(p);
+    was.size = get_raw<uint64_t>(p + 8);
+    was.exists = p[16] != 0;
+    uint32_t len = get_raw<uint32_t>(p + 17);
+    p += g_FileFixedSize;
+    if (size_t(pEnd - p) < len)
+      return false;
+    std::string path(p, len);
+    p += len;
+
+    FileStat st = statFile(path);
+    if (st.exists != was.exists || (st.exists && (st.mtime != was.mtime || st.size != was.size)))
+    {
+      lInfo() << "Changed: " << path << "\n";
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,22 @@
+#ifndef STAMP_H_
+#define STAMP_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "file_io.h"
+
+namespace fs = std::filesystem;
+
+using stamp_files = std::vector<std::pair<std::string, FileStat>>;
+
+//metadata of every input of a run stored next to the output,
+//so --check can tell whether regeneration is needed by only stat-ing files
+bool saveStamp(fs::path const& stamp_file, uint64_t fingerprint, stamp_files const& files);
+//true if nothing changed since the stamp was saved
+bool checkStamp(fs::path const& stamp_file, uint64_t fingerprint);
+
+#endif
@@ -0,0 +1,258 @@
+#include "stats.h"
+
+#include <ctime>
+#include <iomanip>
+#include <iterator>
+
+#include "file_io.h"
+#include "mem_stats.h"
+#include "json.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PREPARE_CC_POSIX_CLOCKS
+#endif
+
+static const char* g_CounterNames[] = {
+  "files opened",
+  "bytes read",
+  "lines scanned",
+  "stat calls",
+  "regex evaluations",
+  "Prepare calls",
+  "QuickPrepare calls",
+  "entries in",
+  "entries out",
+  "io_uring submits",
+  "io_uring ops",
+  "readahead hints",
+  "readahead late",
+  "readahead dropped",
+};
+static_assert(std::size(g_CounterNames) == (size_t)Counter::Count);
+
+static const char* g_PhaseNames[] = {
+  "json load",
+  "classify",
+  "modify command",
+  "include scan",
+  "cost estimate",
+  "prepare",
+  "finish",
+  "serialize",
+  "output commit",
+  "include cache load",
+  "include cache save",
+  "include closures load",
+  "incremental state",
+  "stamp",
+};
+static_assert(std::size(g_PhaseNames) == (size_t)Phase::Count);
+
+static uint64_t cpuNs(bool thread)
+{
+#ifdef PREPARE_CC_POSIX_CLOCKS
+  timespec ts;
+  if (clock_gettime(thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+    return 0;
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#else
+  //whole process only
+  (void)thread;
+  return (uint64_t)std::clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif
+}
+
+static uint64_t nsSince(std::chrono::steady_clock::time_point start)
+{
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*************************************************************************/
+/*RunStats                                                               */
+/*************************************************************************/
+RunStats& getStats()
+{
+  static RunStats g_Stats;
+  return g_Stats;
+}
+
+RunStats::RunStats():
+  m_Start(std::chrono::steady_clock::now()),
+  m_StartCpu(cpuNs(false))
+{
+}
+
+void RunStats::add_phase(Phase p, PhaseSample const& sample)
+{
+  PhaseSlot &s = m_Phases[(size_t)p];
+  s.wall_ns.v.fetch_add(sample.wall_ns, std::memory_order_relaxed);
+  s.cpu_ns.v.fetch_add(sample.cpu_ns, std::memory_order_relaxed);
+  s.calls.v.fetch_add(1, std::memory_order_relaxed);
+  if (!memStatsEnabled())
+    return;
+  s.allocs.v.fetch_add(sample.allocs, std::memory_order_relaxed);
+  s.alloc_bytes.v.fetch_add(sample.alloc_bytes, std::memory_order_relaxed);
+  uint64_t peak = sample.peak_live > 0 ? (uint64_t)sample.peak_live : 0;
+  uint64_t prev = s.peak_live.v.load(std::memory_order_relaxed);
+  while(prev < peak && !s.peak_live.v.compare_exchange_weak(prev, peak, std::memory_order_relaxed))
+    ;
+}
+
+void RunStats::set_value(std::string const& name, double v)
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  m_Values[name] = v;
+}
+
+void RunStats::report(std::ostream &out) const
+{
+  auto ms = [](uint64_t ns){ return (double)ns / 1e6; };
+  auto mb = [](uint64_t b){ return (double)b / (1024 * 1024); };
+  bool mem = memStatsEnabled();
+  out << std::fixed << std::setprecision(1)
+      << std::left << std::setw(34) << "Phase" << std::right
+      << std::setw(12) << "wall ms" << std::setw(12) << "cpu ms" << std::setw(10) << "calls";
+  if (mem)
+    out << std::setw(12) << "allocs" << std::setw(12) << "alloc MB" << std::setw(12) << "peak MB";
+  out << "\n";
+  for(size_t i = 0; i < m_Phases.size(); ++i)
+  {
+    PhaseSlot const& s = m_Phases[i];
+    uint64_t calls = s.calls.v.load(std::memory_order_relaxed);
+    if (!calls)
+      continue;
+    out << std::left << std::setw(34) << g_PhaseNames[i] << std::right
+        << std::setw(12) << ms(s.wall_ns.v.load(std::memory_order_relaxed))
+        << std::setw(12) << ms(s.cpu_ns.v.load(std::memory_order_relaxed))
+        << std::setw(10) << calls;
+    if (mem)
+      out << std::setw(12) << s.allocs.v.load(std::memory_order_relaxed)
+          << std::setw(12) << mb(s.alloc_bytes.v.load(std::memory_order_relaxed))
+          << std::setw(12) << mb(s.peak_live.v.load(std::memory_order_relaxed));
+    out << "\n";
+  }
+  out << std::left << std::setw(34) << "total" << std::right
+      << std::setw(12) << ms(nsSince(m_Start))
+      << std::setw(12) << ms(cpuNs(false) - m_StartCpu) << "\n";
+  if (uint64_t rss = peakRss())
+    out << std::left << std::setw(34) << "peak RSS MB" << std::right << std::setw(12) << mb(rss) << "\n";
+
+  for(size_t i = 0; i < m_Counters.size(); ++i)
+    out << std::left << std::setw(34) << g_CounterNames[i] << std::right
+        << std::setw(12) << m_Counters[i].v.load(std::memory_order_relaxed) << "\n";
+
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  for(auto const& [name, v] : m_Values)
+    out << std::left << std::setw(34) << name << std::right << std::setw(12) << v << "\n";
+  out << std::defaultfloat << std::flush;
+}
+
+bool RunStats::save_json(fs::path const& p) const
+{
+  nlohmann::json res;
+  nlohmann::json &phases = res["phases"] = nlohmann::json::object();
+  for(size_t i = 0; i < m_Phases.size(); ++i)
+  {
+    PhaseSlot const& s = m_Phases[i];
+    uint64_t calls = s.calls.v.load(std::memory_order_relaxed);
+    if (!calls)
+      continue;
+    nlohmann::json &phase = phases[g_PhaseNames[i]] = {
+      {"wall_ns", s.wall_ns.v.load(std::memory_order_relaxed)},
+      {"cpu_ns", s.cpu_ns.v.load(std::memory_order_relaxed)},
+      {"calls", calls}
+    };
+    if (memStatsEnabled())
+    {
+      phase["allocs"] = s.allocs.v.load(std::memory_order_relaxed);
+      phase["alloc_bytes"] = s.alloc_bytes.v.load(std::memory_order_relaxed);
+      phase["peak_live_bytes"] = s.peak_live.v.load(std::memory_order_relaxed);
+    }
+  }
+  res["total"] = {{"wall_ns", nsSince(m_Start)}, {"cpu_ns", cpuNs(false) - m_StartCpu}};
+  if (uint64_t rss = peakRss())
+    res["total"]["peak_rss_bytes"] = rss;
+  nlohmann::json &counters = res["counters"] = nlohmann::json::object();
+  for(size_t i = 0; i < m_Counters.size(); ++i)
+    counters[g_CounterNames[i]] = m_Counters[i].v.load(std::memory_order_relaxed);
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    res["values"] = m_Values;
+  }
+  return writeFileAtomically(p, res.dump(4));
+}
+
+/*************************************************************************/
+/*PhaseTimer                                                             */
+/*************************************************************************/
+std::atomic<bool> g_PhaseTimersOn{false};
+
+void enablePhaseTimers(bool on)
+{
+  g_PhaseTimersOn = on;
+}
+
+static thread_local PhaseTimer *g_CurrentTimer = nullptr;
+
+PhaseTimer::PhaseTimer(Phase p): m_Phase(p), m_On(phaseTimersEnabled())
+{
+  if (!m_On)
+    return;
+  m_Span.emplace(g_PhaseNames[(size_t)p]);
+  start();
+}
+
+PhaseTimer::PhaseTimer(Phase p, fs::path const& detail): m_Phase(p), m_On(phaseTimersEnabled())
+{
+  if (!m_On)
+    return;
+  m_Span.emplace(g_PhaseNames[(size_t)p], detail);
+  start();
+}
+
+void PhaseTimer::start()
+{
+  m_Parent = g_CurrentTimer;
+  if (m_Parent)
+    m_Parent->pause();
+  g_CurrentTimer = this;
+  resume();
+}
+
+PhaseTimer::~PhaseTimer()
+{
+  if (!m_On)
+    return;
+  pause();
+  getStats().add_phase(m_Phase, m_Sample);
+  g_CurrentTimer = m_Parent;
+  if (m_Parent)
+    m_Parent->resume();
+}
+
+void PhaseTimer::pause()
+{
+  m_Sample.wall_ns += nsSince(m_WallStart);
+  m_Sample.cpu_ns += cpuNs(true) - m_CpuStart;
+  if (memStatsEnabled())
+  {
+    MemCounters const& c = threadMemCounters();
+    m_Sample.allocs += c.allocs - m_AllocsStart;
+    m_Sample.alloc_bytes += c.bytes - m_BytesStart;
+    if (c.peak_live > m_Sample.peak_live)
+      m_Sample.peak_live = c.peak_live;
+  }
+}
+
+void PhaseTimer::resume()
+{
+  if (memStatsEnabled())
+  {
+    MemCounters &c = threadMemCounters();
+    m_AllocsStart = c.allocs;
+    m_BytesStart = c.bytes;
+    c.peak_live = memLiveBytes();
+  }
+  m_WallStart = std::chrono::steady_clock::now();
+  m_CpuStart = cpuNs(true);
+}
@@ -0,0 +1,155 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+
+#include "trace.h"
+
+namespace fs = std::filesystem;
+
+//what a run spends its time on, reported with --stats
+//counters are relaxed atomics on their own cache lines, so hot paths can count unconditionally
+enum class Counter
+{
+  FilesOpened,
+  BytesRead,
+  LinesScanned,
+  Stats,//stat() and fs::equivalent calls
+  RegexEvals,
+  Prepares,
+  QuickPrepares,
+  EntriesIn,
+  EntriesOut,
+  UringSubmits,
+  UringOps,
+  ReadaheadHints,
+  ReadaheadLate,
+  ReadaheadDropped,
+  Count
+};
+
+//time spent in nested phases isn't counted for the enclosing one
+enum class Phase
+{
+  JsonLoad,
+  Classify,
+  ModifyCommand,
+  IncludeScan,
+  CostEstimate,
+  Prepare,
+  Finish,
+  Serialize,
+  OutputCommit,
+  IncludeCacheLoad,
+  IncludeCacheSave,
+  ClosuresLoad,
+  IncrementalState,
+  Stamp,
+  Count
+};
+
+//what a phase took, allocations are known only when built with PREPARE_CC_MEM_STATS
+struct PhaseSample
+{
+  uint64_t wall_ns = 0;
+  uint64_t cpu_ns = 0;
+  uint64_t allocs = 0;
+  uint64_t alloc_bytes = 0;
+  int64_t peak_live = 0;//live bytes of the process while the phase ran
+};
+
+class RunStats
+{
+public:
+  RunStats();
+
+  void add(Counter c, uint64_t n = 1)
+  {
+    m_Counters[(size_t)c].v.fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t get(Counter c) const
+  {
+    return m_Counters[(size_t)c].v.load(std::memory_order_relaxed);
+  }
+  void add_phase(Phase p, PhaseSample const& s);
+  //anything else worth a line, e.g. queue occupancy
+  void set_value(std::string const& name, double v);
+
+  void report(std::ostream &out) const;
+  bool save_json(fs::path const& p) const;
+
+private:
+  struct alignas(64) Slot
+  {
+    std::atomic<uint64_t> v{0};
+  };
+  struct PhaseSlot
+  {
+    Slot wall_ns, cpu_ns, calls, allocs, alloc_bytes, peak_live;
+  };
+
+  std::array<Slot, (size_t)Counter::Count> m_Counters;
+  std::array<PhaseSlot, (size_t)Phase::Count> m_Phases;
+  std::chrono::steady_clock::time_point m_Start;
+  uint64_t m_StartCpu;
+
+  mutable std::mutex m_Mtx;
+  std::map<std::string, double> m_Values;
+};
+
+RunStats& getStats();
+
+inline void countStat(Counter c, uint64_t n = 1)
+{
+  getStats().add(c, n);
+}
+
+//phases are timed only for --stats, --stats-json or --trace, must be set before any work starts
+extern std::atomic<bool> g_PhaseTimersOn;
+
+inline bool phaseTimersEnabled()
+{
+  return g_PhaseTimersOn.load(std::memory_order_relaxed);
+}
+
+void enablePhaseTimers(bool on);
+
+//measures wall and thread CPU time of a phase, pauses the enclosing timer of the same thread
+//it is a trace span as well, detail is the file it works on
+//a disabled timer costs a relaxed load
+class PhaseTimer
+{
+public:
+  explicit PhaseTimer(Phase p);
+  PhaseTimer(Phase p, fs::path const& detail);
+  ~PhaseTimer();
+
+  PhaseTimer(PhaseTimer const&) = delete;
+  PhaseTimer& operator=(PhaseTimer const&) = delete;
+
+private:
+  void pause();
+  void resume();
+
+  void start();
+
+  Phase m_Phase;
+  bool m_On;
+  PhaseTimer *m_Parent = nullptr;
+  PhaseSample m_Sample;
+  std::chrono::steady_clock::time_point m_WallStart;
+  uint64_t m_CpuStart = 0;
+  uint64_t m_AllocsStart = 0, m_BytesStart = 0;
+  std::optional<TraceSpan> m_Span;
+};
+
+#endif
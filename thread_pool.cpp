@@ -0,0 +1,147 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+
+static size_t g_ThreadPoolSize = 0;
+
+void setGlobalThreadPoolSize(size_t threads) { g_ThreadPoolSize = threads; }
+
+ThreadPool& getThreadPool()
+{
+  static ThreadPool g_Pool([]{
+      size_t n = g_ThreadPoolSize ? g_ThreadPoolSize : std::thread::hardware_concurrency();
+      return n ? n : 1;
+  }());
+  return g_Pool;
+}
+
+/*************************************************************************/
+/*ThreadPool                                                             */
+/*************************************************************************/
+ThreadPool::ThreadPool(size_t threads)
+{
+  m_Workers.reserve(threads);
+  for(size_t i = 0; i < threads; ++i)
+    m_Workers.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    m_Stop = true;
+  }
+  m_CV.notify_all();
+  for(auto &t : m_Workers)
+    t.join();
+}
+
+void ThreadPool::submit(Task t, Priority p)
+{
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    m_Tasks.push_back(Item{p, m_Seq++, std::move(t)});
+    std::push_heap(m_Tasks.begin(), m_Tasks.end());
+  }
+  m_CV.notify_one();
+}
+
+ThreadPool::Task ThreadPool::pop_locked()
+{
+  std::pop_heap(m_Tasks.begin(), m_Tasks.end());
+  Task t = std::move(m_Tasks.back().task);
+  m_Tasks.pop_back();
+  return t;
+}
+
+bool ThreadPool::pop(Task &t, Priority min_priority)
+{
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  if (m_Tasks.empty() || m_Tasks.front().priority < min_priority)
+    return false;
+  t = pop_locked();
+  return true;
+}
+
+bool ThreadPool::run_one(Priority min_priority)
+{
+  Task t;
+  if (!pop(t, min_priority))
+    return false;
+  t();
+  return true;
+}
+
+void ThreadPool::worker()
+{
+  while(true)
+  {
+    Task t;
+    {
+      std::unique_lock<std::mutex> lck(m_Mtx);
+      m_CV.wait(lck, [&]{ return m_Stop || !m_Tasks.empty(); });
+      if (m_Tasks.empty())
+        return;
+      t = pop_locked();
+    }
+    t();
+  }
+}
+
+/*************************************************************************/
+/*TaskGroup                                                              */
+/*************************************************************************/
+TaskGroup::TaskGroup(ThreadPool &pool, ThreadPool::Priority p): m_Pool(pool), m_Priority(p) {}
+
+TaskGroup::~TaskGroup()
+{
+  //tasks reference the group, so it must not go away before they are done
+  std::unique_lock<std::mutex> lck(m_Mtx);
+  m_CV.wait(lck, [&]{ return m_Pending == 0; });
+}
+
+void TaskGroup::run(ThreadPool::Task t)
+{
+  run(std::move(t), m_Priority);
+}
+
+void TaskGroup::run(ThreadPool::Task t, ThreadPool::Priority p)
+{
+  ++m_Pending;
+  m_Pool.submit([this, t = std::move(t)]{
+      try
+      {
+        t();
+      }catch(...)
+      {
+        std::unique_lock<std::mutex> lck(m_Mtx);
+        if (!m_Error)
+          m_Error = std::current_exception();
+      }
+      std::unique_lock<std::mutex> lck(m_Mtx);
+      if (--m_Pending == 0)
+        m_CV.notify_all();
+  }, p);
+}
+
+void TaskGroup::wait()
+{
+  while(m_Pending)
+  {
+    if (!m_Pool.run_one(m_Priority))
+    {
+      std::unique_lock<std::mutex> lck(m_Mtx);
+      m_CV.wait(lck, [&]{ return m_Pending == 0; });
+    }
+  }
+
+  std::exception_ptr err;
+  {
+    std::unique_lock<std::mutex> lck(m_Mtx);
+    std::swap(err, m_Error);
+  }
+  if (err)
+    std::rethrow_exception(err);
+}
@@ -0,0 +1,84 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+  using Task = std::function<void()>;
+  //tasks with higher priority are picked first, equal ones in submission order
+  using Priority = int64_t;
+  static constexpr Priority kDefaultPriority = 0;
+  //work spawned by an already running task, finishing started work first keeps helping waits shallow
+  static constexpr Priority kNestedPriority = std::numeric_limits<Priority>::max();
+
+  explicit ThreadPool(size_t threads);
+  ~ThreadPool();
+
+  ThreadPool(ThreadPool const&) = delete;
+  ThreadPool& operator=(ThreadPool const&) = delete;
+
+  void submit(Task t, Priority p = kDefaultPriority);
+  //runs one pending task with at least min_priority on the calling thread, false if there was none
+  bool run_one(Priority min_priority = std::numeric_limits<Priority>::min());
+  size_t size() const { return m_Workers.size(); }
+
+private:
+  struct Item
+  {
+    Priority priority;
+    uint64_t seq;
+    Task task;
+
+    bool operator<(Item const& r) const { return priority < r.priority || (priority == r.priority && seq > r.seq); }
+  };
+
+  Task pop_locked();
+  bool pop(Task &t, Priority min_priority);
+  void worker();
+
+  std::vector<std::thread> m_Workers;
+  std::vector<Item> m_Tasks;//heap
+  uint64_t m_Seq = 0;
+  std::mutex m_Mtx;
+  std::condition_variable m_CV;
+  bool m_Stop = false;
+};
+
+//set of tasks that can be waited for together
+//waiting thread helps executing pending tasks so nested groups can't deadlock the pool
+class TaskGroup
+{
+public:
+  //wait() helps only with tasks of at least the group priority
+  explicit TaskGroup(ThreadPool &pool, ThreadPool::Priority p = ThreadPool::kDefaultPriority);
+  ~TaskGroup();
+
+  void run(ThreadPool::Task t);
+  void run(ThreadPool::Task t, ThreadPool::Priority p);
+  void wait();
+
+private:
+  ThreadPool &m_Pool;
+  ThreadPool::Priority m_Priority;
+  std::atomic<size_t> m_Pending{0};
+  std::mutex m_Mtx;
+  std::condition_variable m_CV;
+  std::exception_ptr m_Error;
+};
+
+//0 means hardware concurrency, must be called before the first getThreadPool()
+void setGlobalThreadPoolSize(size_t threads);
+ThreadPool& getThreadPool();
+
+#endif
@@ -0,0 +1,123 @@
+#include "trace.h"
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "json.hpp"
+
+std::atomic<bool> g_TraceOn{false};
+
+struct TraceEvent
+{
+  const char *name;
+  std::string detail;
+  int64_t start;//ns since startTrace()
+  int64_t duration;
+};
+
+//appended to only by its own thread
+struct TraceBuffer
+{
+  size_t tid;
+  std::string thread_name;
+  std::vector<TraceEvent> events;
+};
+
+static std::mutex g_BuffersMtx;
+static std::vector<std::unique_ptr<TraceBuffer>> g_Buffers;
+static std::chrono::steady_clock::time_point g_TraceStart;
+static thread_local TraceBuffer *g_ThreadBuffer = nullptr;
+
+static TraceBuffer& threadBuffer()
+{
+  if (!g_ThreadBuffer)
+  {
+    std::unique_lock<std::mutex> lck(g_BuffersMtx);
+    auto b = std::make_unique<TraceBuffer>();
+    b->tid = g_Buffers.size() + 1;
+    b->thread_name = "thread " + std::to_string(b->tid);
+    g_ThreadBuffer = g_Buffers.emplace_back(std::move(b)).get();
+  }
+  return *g_ThreadBuffer;
+}
+
+static std::string quoted(std::string const& s)
+{
+  return nlohmann::json(s).dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+static int64_t traceNow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_TraceStart).count();
+}
+
+void startTrace()
+{
+  g_TraceStart = std::chrono::steady_clock::now();
+  g_TraceOn.store(true, std::memory_order_relaxed);
+  setTraceThreadName("main");
+}
+
+void setTraceThreadName(std::string name)
+{
+  if (traceEnabled())
+    threadBuffer().thread_name = std::move(name);
+}
+
+bool writeTrace(fs::path const& p)
+{
+  g_TraceOn.store(false, std::memory_order_relaxed);
+  std::ofstream out(p, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!out)
+    return false;
+
+  auto us = [](int64_t ns){ return std::to_string(ns / 1000) + "." + std::to_string(ns % 1000 / 100); };
+  std::unique_lock<std::mutex> lck(g_BuffersMtx);
+  size_t count = 0;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  for(auto const& b : g_Buffers)
+  {
+    out << (count++ ? ",\n" : "\n")
+        << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid
+        << ",\"args\":{\"name\":" << quoted(b->thread_name) << "}}";
+    for(auto const& e : b->events)
+    {
+      out << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"prepare_cc\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+          << ",\"ts\":" << us(e.start) << ",\"dur\":" << us(e.duration);
+      if (!e.detail.empty())
+        out << ",\"args\":{\"file\":" << quoted(e.detail) << "}";
+      out << "}";
+    }
+  }
+  out << "\n]}\n";
+  return (bool)out.flush();
+}
+
+/*************************************************************************/
+/*TraceSpan                                                              */
+/*************************************************************************/
+TraceSpan::TraceSpan(const char *name): m_Name(name)
+{
+  if (traceEnabled())
+    m_Start = traceNow();
+}
+
+TraceSpan::TraceSpan(const char *name, fs::path const& detail): m_Name(name)
+{
+  if (traceEnabled())
+  {
+    m_Detail = detail.string();
+    m_Start = traceNow();
+  }
+}
+
+TraceSpan::~TraceSpan()
+{
+  if (m_Start < 0 || !traceEnabled())
+    return;
+  int64_t end = traceNow();
+  threadBuffer().events.push_back(TraceEvent{m_Name, std::move(m_Detail), m_Start, end - m_Start});
+}
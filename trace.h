@@ -0,0 +1,44 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+//spans for --trace, kept in per-thread buffers and written as Chrome trace-event JSON
+//nothing is recorded until startTrace(), a disabled span costs a relaxed load
+
+extern std::atomic<bool> g_TraceOn;
+
+inline bool traceEnabled()
+{
+  return g_TraceOn.load(std::memory_order_relaxed);
+}
+
+//called by the main thread, which becomes "main" in the trace
+void startTrace();
+//threads not named are called "thread <n>"
+void setTraceThreadName(std::string name);
+//must be called when no other thread records anymore
+bool writeTrace(fs::path const& p);
+
+class TraceSpan
+{
+public:
+  explicit TraceSpan(const char *name);
+  TraceSpan(const char *name, fs::path const& detail);
+  ~TraceSpan();
+
+  TraceSpan(TraceSpan const&) = delete;
+  TraceSpan& operator=(TraceSpan const&) = delete;
+
+private:
+  const char *m_Name;
+  std::string m_Detail;
+  int64_t m_Start = -1;//not recorded
+};
+
+#endif
@@ -0,0 +1,384 @@
+#include "uring_io.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "log.h"
+#include "stats.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define PREPARE_CC_IO_URING
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<bool> g_Enabled{false};
+
+#ifdef PREPARE_CC_IO_URING
+static const unsigned kRingEntries = 64;
+static const uint64_t kDefaultReadSize = 65536;
+//the rest of anything larger is read with plain syscalls
+static const uint64_t kMaxReadSize = 1u << 30;
+
+/*************************************************************************/
+/*UringRing                                                              */
+/*************************************************************************/
+//submission and completion rings of one io_uring, only ever used by the thread that made it
+class UringRing
+{
+public:
+  UringRing() = default;
+  UringRing(UringRing const&) = delete;
+  UringRing& operator=(UringRing const&) = delete;
+  ~UringRing();
+
+  bool init(unsigned entries);
+  bool ready() const { return m_Ready; }
+  unsigned capacity() const { return m_Entries; }
+  bool supports(std::initializer_list<int> ops) const;
+
+  //nullptr when the ring is full
+  io_uring_sqe* next();
+  //submits what was queued and calls done(user_data, res) for each of them once completed
+  //false if the kernel refused, the ring isn't used again then, what it took is still completed first
+  //and only those get done() calls, so no buffer of the caller is written after this returns
+  template<class F>
+  bool run(F &&done);
+
+private:
+  bool m_Ready = false;
+  int m_Fd = -1;
+  unsigned m_Entries = 0;
+  unsigned m_Queued = 0;
+
+  void *m_SqRing = MAP_FAILED;
+  void *m_CqRing = MAP_FAILED;
+  size_t m_SqSize = 0;
+  size_t m_CqSize = 0;
+  io_uring_sqe *m_Sqes = (io_uring_sqe*)MAP_FAILED;
+  size_t m_SqesSize = 0;
+
+  unsigned *m_SqHead = nullptr;
+  unsigned *m_SqTail = nullptr;
+  unsigned *m_SqMask = nullptr;
+  unsigned *m_SqArray = nullptr;
+  unsigned *m_CqHead = nullptr;
+  unsigned *m_CqTail = nullptr;
+  unsigned *m_CqMask = nullptr;
+  io_uring_cqe *m_Cqes = nullptr;
+};
+
+UringRing::~UringRing()
+{
+  if (m_Sqes != MAP_FAILED)
+    munmap(m_Sqes, m_SqesSize);
+  if (m_CqRing != MAP_FAILED && m_CqRing != m_SqRing)
+    munmap(m_CqRing, m_CqSize);
+  if (m_SqRing != MAP_FAILED)
+    munmap(m_SqRing, m_SqSize);
+  if (m_Fd >= 0)
+    ::close(m_Fd);
+}
+
+bool UringRing::init(unsigned entries)
+{
+  io_uring_params p;
+  std::memset(&p, 0, sizeof(p));
+  m_Fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (m_Fd < 0)
+    return false;
+  m_Entries = p.sq_entries;
+
+  m_SqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  m_CqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    m_SqSize = m_CqSize = std::max(m_SqSize, m_CqSize);
+  m_SqRing = mmap(nullptr, m_SqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_SQ_RING);
+  if (m_SqRing == MAP_FAILED)
+    return false;
+  m_CqRing = single ? m_SqRing : mmap(nullptr, m_CqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_CQ_RING);
+  if (m_CqRing == MAP_FAILED)
+    return false;
+  m_SqesSize = p.sq_entries * sizeof(io_uring_sqe);
+  m_Sqes = (io_uring_sqe*)mmap(nullptr, m_SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Fd, IORING_OFF_SQES);
+  if (m_Sqes == MAP_FAILED)
+    return false;
+
+  char *sq = (char*)m_SqRing;
+  m_SqHead = (unsigned*)(sq + p.sq_off.head);
+  m_SqTail = (unsigned*)(sq + p.sq_off.tail);
+  m_SqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+  m_SqArray = (unsigned*)(sq + p.sq_off.array);
+  char *cq = (char*)m_CqRing;
+  m_CqHead = (unsigned*)(cq + p.cq_off.head);
+  m_CqTail = (unsigned*)(cq + p.cq_off.tail);
+  m_CqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+  m_Cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+  m_Ready = true;
+  return true;
+}
+
+bool UringRing::supports(std::initializer_list<int> ops) const
+{
+  std::vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+  io_uring_probe *probe = (io_uring_probe*)buf.data();
+  if (syscall(__NR_io_uring_register, m_Fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    return false;
+  for(int op : ops)
+  {
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+      return false;
+  }
+  return true;
+}
+
+io_uring_sqe* UringRing::next()
+{
+  if (m_Queued == m_Entries)
+    return nullptr;
+  //the tail is written only by this thread
+  unsigned idx = (*m_SqTail + m_Queued) & *m_SqMask;
+  io_uring_sqe *sqe = &m_Sqes[idx];
+  std::memset(sqe, 0, sizeof(*sqe));
+  m_SqArray[idx] = idx;
+  ++m_Queued;
+  return sqe;
+}
+
+template<class F>
+bool UringRing::run(F &&done)
+{
+  unsigned n = m_Queued;
+  if (!n)
+    return true;
+  m_Queued = 0;
+  unsigned start = *m_SqTail;
+  __atomic_store_n(m_SqTail, start + n, __ATOMIC_RELEASE);
+
+  //at most n in flight, the completion ring is twice as large so it can't overflow
+  //after a failure only what the kernel already took is waited for
+  unsigned submitted = 0;
+  unsigned completed = 0;
+  bool failed = false;
+  while(completed < (failed ? submitted : n))
+  {
+    unsigned wait = (failed ? submitted : n) - completed;
+    int r = (int)syscall(__NR_io_uring_enter, m_Fd, failed ? 0 : n - submitted, wait, IORING_ENTER_GETEVENTS, nullptr, 0);
+    submitted = __atomic_load_n(m_SqHead, __ATOMIC_ACQUIRE) - start;
+    if (r < 0 && errno != EINTR)
+    {
+      if (!failed)
+      {
+        lWarn() << "io_uring_enter failed: " << std::strerror(errno) << ", falling back to plain syscalls\n";
+        failed = true;
+        m_Ready = false;
+        //the kernel never saw those, they are taken back
+        __atomic_store_n(m_SqTail, start + submitted, __ATOMIC_RELEASE);
+      }
+      else
+      {
+        //completions are posted without entering too
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+
+    unsigned head = *m_CqHead;
+    unsigned tail = __atomic_load_n(m_CqTail, __ATOMIC_ACQUIRE);
+    for(; head != tail; ++head, ++completed)
+    {
+      io_uring_cqe const& cqe = m_Cqes[head & *m_CqMask];
+      done(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(m_CqHead, head, __ATOMIC_RELEASE);
+  }
+  if (submitted)
+    countStat(Counter::UringSubmits);
+  countStat(Counter::UringOps, completed);
+  return !failed;
+}
+
+static UringRing* threadRing()
+{
+  thread_local UringRing ring;
+  thread_local bool tried = false;
+  if (!tried)
+  {
+    tried = true;
+    ring.init(kRingEntries);
+  }
+  return ring.ready() ? &ring : nullptr;
+}
+
+static FileStat fromStatx(struct statx const& stx)
+{
+  FileStat res;
+  res.exists = true;
+  res.directory = S_ISDIR(stx.stx_mode);
+  res.size = stx.stx_size;
+  res.mtime = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+  return res;
+}
+#endif
+
+bool ioUringAvailable()
+{
+#ifdef PREPARE_CC_IO_URING
+  static const bool available = []
+  {
+    UringRing ring;
+    return ring.init(4) && ring.supports({IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ});
+  }();
+  return available;
+#else
+  return false;
+#endif
+}
+
+bool enableIoUring(bool on)
+{
+  if (on && !ioUringAvailable())
+  {
+    lWarn() << "io_uring is not available, using plain syscalls\n";
+    on = false;
+  }
+  g_Enabled = on;
+  return on;
+}
+
+bool ioUringEnabled()
+{
+  return g_Enabled;
+}
+
+void uringStat(std::vector<fs::path> const& paths, std::vector<FileStat> &out)
+{
+  out.assign(paths.size(), FileStat());
+  size_t i = 0;
+  //completed by the ring before it failed, not done again
+  std::vector<char> got;
+#ifdef PREPARE_CC_IO_URING
+  UringRing *ring = g_Enabled ? threadRing() : nullptr;
+  std::vector<struct statx> stx(ring ? paths.size() : 0);
+  got.assign(stx.size(), 0);
+  while(ring && i < paths.size())
+  {
+    size_t from = i;
+    for(; i < paths.size(); ++i)
+    {
+      io_uring_sqe *sqe = ring->next();
+      if (!sqe)
+        break;
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uint64_t)(uintptr_t)paths[i].c_str();
+      sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+      sqe->off = (uint64_t)(uintptr_t)&stx[i];
+      sqe->user_data = i;
+    }
+    auto done = [&](uint64_t k, int res)
+    {
+      got[k] = 1;
+      countStat(Counter::Stats);
+      if (res == 0)
+        out[k] = fromStatx(stx[k]);
+    };
+    if (!ring->run(done))
+    {
+      ring = nullptr;
+      i = from;
+    }
+  }
+#endif
+  for(; i < paths.size(); ++i)
+  {
+    if (i < got.size() && got[i])
+      continue;
+    out[i] = statFile(paths[i]);
+  }
+}
+
+void uringRead(std::vector<fs::path> const& paths, std::vector<uint64_t> const& size_hints, std::vector<std::string> &contents)
+{
+  contents.assign(paths.size(), std::string());
+  size_t i = 0;
+#ifdef PREPARE_CC_IO_URING
+  UringRing *ring = g_Enabled ? threadRing() : nullptr;
+  std::vector<int> fds;
+  std::vector<int> got;
+  std::vector<size_t> asked;
+  while(ring && i < paths.size())
+  {
+    size_t from = i;
+    size_t n = std::min<size_t>(ring->capacity(), paths.size() - from);
+    fds.assign(n, -1);
+    for(size_t k = 0; k < n; ++k)
+    {
+      io_uring_sqe *sqe = ring->next();
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uint64_t)(uintptr_t)paths[from + k].c_str();
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+      sqe->user_data = k;
+    }
+    bool ok = ring->run([&](uint64_t k, int res){ fds[k] = res; });
+
+    //one byte more than the stat said, so a file that grew since is noticed
+    got.assign(n, -1);
+    asked.assign(n, 0);
+    for(size_t k = 0; ok && k < n; ++k)
+    {
+      if (fds[k] < 0)
+        continue;
+      std::string &c = contents[from + k];
+      asked[k] = (size_t)std::min<uint64_t>(from + k < size_hints.size() ? size_hints[from + k] + 1 : kDefaultReadSize, kMaxReadSize);
+      c.resize(asked[k]);
+      io_uring_sqe *sqe = ring->next();
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fds[k];
+      sqe->addr = (uint64_t)(uintptr_t)c.data();
+      sqe->len = (unsigned)asked[k];
+      sqe->off = 0;
+      sqe->user_data = k;
+    }
+    ok = ok && ring->run([&](uint64_t k, int res){ got[k] = res; });
+
+    for(size_t k = 0; k < n; ++k)
+    {
+      if (fds[k] < 0)
+        continue;
+      std::string &c = contents[from + k];
+      c.resize(ok && got[k] > 0 ? (size_t)got[k] : 0);
+      if (ok && got[k] >= 0 && (size_t)got[k] == asked[k])
+      {
+        char buf[16384];
+        ssize_t r;
+        while((r = ::read(fds[k], buf, sizeof(buf))) > 0)
+          c.append(buf, (size_t)r);
+      }
+      ::close(fds[k]);
+      //the whole batch is read again with plain syscalls, counted there
+      if (!ok)
+        continue;
+      countStat(Counter::FilesOpened);
+      countStat(Counter::BytesRead, c.size());
+    }
+    i = from + n;
+    if (!ok)
+    {
+      ring = nullptr;
+      i = from;
+    }
+  }
+#endif
+  for(; i < paths.size(); ++i)
+    readFile(paths[i], contents[i]);
+}
@@ -0,0 +1,26 @@
+#ifndef URING_IO_H_
+#define URING_IO_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "file_io.h"
+
+namespace fs = std::filesystem;
+
+//stats and reads of many files kept in flight together through io_uring instead of a syscall per file
+//Linux only, elsewhere or when the kernel refuses a ring it reports itself as not available
+bool ioUringAvailable();
+//stays off and returns false if not available
+bool enableIoUring(bool on);
+bool ioUringEnabled();
+
+//one result per path, the rings are per thread so any thread can use these
+void uringStat(std::vector<fs::path> const& paths, std::vector<FileStat> &out);
+//size_hints are sizes from a stat done just before, one per path or none
+//content of a file that couldn't be read is left empty
+void uringRead(std::vector<fs::path> const& paths, std::vector<uint64_t> const& size_hints, std::vector<std::string> &contents);
+
+#endif
@@ -0,0 +1,455 @@
+#include "vfs.h"
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <streambuf>
+#include <system_error>
+
+#include "json.hpp"
+#include "log.h"
+#include "stats.h"
+#include "uring_io.h"
+
+static const char* g_OpNames[] = {"stat", "open", "read", "list", "equivalent"};
+
+static std::shared_ptr<FileSystem> g_FileSystem = std::make_shared<DiskFileSystem>();
+
+FileSystem& getFileSystem()
+{
+  return *g_FileSystem;
+}
+
+void setFileSystem(std::shared_ptr<FileSystem> vfs)
+{
+  g_FileSystem = vfs ? std::move(vfs) : std::make_shared<DiskFileSystem>();
+}
+
+bool overlayFromJson(fs::path const& overlay_json)
+{
+  std::ifstream f(overlay_json);
+  nlohmann::json buffers = nlohmann::json::parse(f, nullptr, false);
+  if (!f || buffers.is_discarded() || !buffers.is_object())
+  {
+    lErr() << "Expected an object of file contents by path in " << overlay_json << "\n";
+    return false;
+  }
+  auto upper = std::make_shared<MemoryFileSystem>();
+  for(auto const& [path, content] : buffers.items())
+  {
+    if (!content.is_string())
+    {
+      lErr() << "Content of " << path << " in " << overlay_json << " isn't a string\n";
+      return false;
+    }
+    upper->add(fs::absolute(path), content.get<std::string>());
+  }
+  setFileSystem(std::make_shared<OverlayFileSystem>(std::move(upper), g_FileSystem));
+  return true;
+}
+
+bool memoryFromTree(fs::path const& root)
+{
+  auto mem = std::make_shared<MemoryFileSystem>();
+  if (!mem->addTree(root))
+  {
+    lErr() << "Could not read " << root << " into memory\n";
+    return false;
+  }
+  setFileSystem(std::move(mem));
+  return true;
+}
+
+/*************************************************************************/
+/*FileSystem                                                             */
+/*************************************************************************/
+FileStat FileSystem::stat(fs::path const& p)
+{
+  m_Ops[Stat].fetch_add(1, std::memory_order_relaxed);
+  return do_stat(p);
+}
+
+std::unique_ptr<std::istream> FileSystem::open(fs::path const& p)
+{
+  m_Ops[Open].fetch_add(1, std::memory_order_relaxed);
+  return do_open(p);
+}
+
+bool FileSystem::read(fs::path const& p, std::string &content)
+{
+  m_Ops[Read].fetch_add(1, std::memory_order_relaxed);
+  return do_read(p, content);
+}
+
+bool FileSystem::list(fs::path const& dir, std::vector<DirEntry> &entries)
+{
+  m_Ops[List].fetch_add(1, std::memory_order_relaxed);
+  entries.clear();
+  return do_list(dir, entries);
+}
+
+bool FileSystem::equivalent(fs::path const& a, fs::path const& b)
+{
+  m_Ops[Equivalent].fetch_add(1, std::memory_order_relaxed);
+  return do_equivalent(a, b);
+}
+
+void FileSystem::stat(std::vector<fs::path> const& paths, std::vector<FileStat> &out)
+{
+  m_Ops[Stat].fetch_add(paths.size(), std::memory_order_relaxed);
+  do_stat_batch(paths, out);
+}
+
+void FileSystem::read(std::vector<fs::path> const& paths, std::vector<FileStat> const& sts, std::vector<std::string> &contents)
+{
+  m_Ops[Read].fetch_add(paths.size(), std::memory_order_relaxed);
+  do_read_batch(paths, sts, contents);
+}
+
+void FileSystem::do_stat_batch(std::vector<fs::path> const& paths, std::vector<FileStat> &out)
+{
+  out.resize(paths.size());
+  for(size_t i = 0; i < paths.size(); ++i)
+    out[i] = do_stat(paths[i]);
+}
+
+void FileSystem::do_read_batch(std::vector<fs::path> const& paths, std::vector<FileStat> const&, std::vector<std::string> &contents)
+{
+  contents.resize(paths.size());
+  for(size_t i = 0; i < paths.size(); ++i)
+  {
+    if (!do_read(paths[i], contents[i]))
+      contents[i].clear();
+  }
+}
+
+void FileSystem::report() const
+{
+  for(int op = 0; op < OpCount; ++op)
+  {
+    if (uint64_t n = m_Ops[op].load(std::memory_order_relaxed))
+      getStats().set_value("vfs " + m_Name + " " + g_OpNames[op], (double)n);
+  }
+}
+
+/*************************************************************************/
+/*DiskFileSystem                                                         */
+/*************************************************************************/
+FileStat DiskFileSystem::do_stat(fs::path const& p)
+{
+  return statFile(p);
+}
+
+std::unique_ptr<std::istream> DiskFileSystem::do_open(fs::path const& p)
+{
+  auto f = std::make_unique<std::ifstream>(p, std::ios_base::in | std::ios_base::binary);
+  if (!*f)
+    return nullptr;
+  countStat(Counter::FilesOpened);
+  return f;
+}
+
+bool DiskFileSystem::do_read(fs::path const& p, std::string &content)
+{
+  return readFile(p, content);
+}
+
+bool DiskFileSystem::do_list(fs::path const& dir, std::vector<DirEntry> &entries)
+{
+  std::error_code ec;
+  auto it = fs::directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+  if (ec)
+    return false;
+  for(; !ec && it != fs::directory_iterator(); it.increment(ec))
+    entries.push_back(DirEntry{it->path().filename().string(), it->is_directory(ec)});
+  return true;
+}
+
+bool DiskFileSystem::do_equivalent(fs::path const& a, fs::path const& b)
+{
+  countStat(Counter::Stats);
+  std::error_code ec;
+  return fs::equivalent(a, b, ec);
+}
+
+bool DiskFileSystem::batching() const
+{
+  return ioUringEnabled();
+}
+
+void DiskFileSystem::do_stat_batch(std::vector<fs::path> const& paths, std::vector<FileStat> &out)
+{
+  uringStat(paths, out);
+}
+
+void DiskFileSystem::do_read_batch(std::vector<fs::path> const& paths, std::vector<FileStat> const& sts, std::vector<std::string> &contents)
+{
+  std::vector<uint64_t> sizes;
+  sizes.reserve(sts.size());
+  for(FileStat const& st : sts)
+    sizes.push_back(st.size);
+  uringRead(paths, sizes, contents);
+}
+
+/*************************************************************************/
+/*MemoryFileSystem                                                       */
+/*************************************************************************/
+static std::string memoryKey(fs::path const& p)
+{
+  fs::path n = p.lexically_normal();
+  if (!n.has_filename() && n.has_relative_path())
+    n = n.parent_path();
+  return n.string();
+}
+
+//reads straight from the shared content
+class MemoryStream: public std::istream
+{
+public:
+  explicit MemoryStream(std::shared_ptr<const std::string> content): std::istream(nullptr), m_Content(std::move(content))
+  {
+    char *p = const_cast<char*>(m_Content->data());
+    m_Buf.set(p, p + m_Content->size());
+    rdbuf(&m_Buf);
+  }
+
+private:
+  struct Buf: std::streambuf
+  {
+    void set(char *b, char *e) { setg(b, b, e); }
+    //tellg only
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override
+    {
+      if (off != 0 || dir != std::ios_base::cur)
+        return pos_type(off_type(-1));
+      return pos_type(gptr() - eback());
+    }
+  };
+  std::shared_ptr<const std::string> m_Content;
+  Buf m_Buf;
+};
+
+void MemoryFileSystem::add(fs::path const& p, std::string content)
+{
+  std::string key = memoryKey(p);
+  std::unique_lock<std::shared_mutex> lck(m_Mtx);
+  //past any time the disk can have, a buffer is newer than whatever was built from the disk
+  int64_t mtime = (int64_t)((hashBytes(content) >> 2) | (1ull << 62));
+  m_Files[key] = File{std::make_shared<const std::string>(std::move(content)), mtime};
+  fs::path child = key;
+  for(fs::path dir = child.parent_path(); dir != child; child = dir, dir = dir.parent_path())
+  {
+    if (!m_Dirs[dir.string()].insert(child.filename().string()).second)
+      break;
+  }
+}
+
+bool MemoryFileSystem::remove(fs::path const& p)
+{
+  std::string key = memoryKey(p);
+  std::unique_lock<std::shared_mutex> lck(m_Mtx);
+  if (!m_Files.erase(key))
+    return false;
+  //directories left empty go as well
+  fs::path child = key;
+  for(fs::path dir = child.parent_path(); dir != child; child = dir, dir = dir.parent_path())
+  {
+    auto d = m_Dirs.find(dir.string());
+    if (d == m_Dirs.end())
+      break;
+    d->second.erase(child.filename().string());
+    if (!d->second.empty())
+      break;
+    m_Dirs.erase(d);
+  }
+  return true;
+}
+
+bool MemoryFileSystem::addTree(fs::path const& root)
+{
+  std::error_code ec;
+  fs::path abs = fs::absolute(root, ec).lexically_normal();
+  auto it = fs::recursive_directory_iterator(abs, fs::directory_options::skip_permission_denied, ec);
+  if (ec)
+    return false;
+  for(; !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+  {
+    std::string content;
+    if (it->is_regular_file(ec) && readFile(it->path(), content))
+      add(it->path(), std::move(content));
+  }
+  return true;
+}
+
+bool MemoryFileSystem::contains(fs::path const& p) const
+{
+  std::shared_lock<std::shared_mutex> lck(m_Mtx);
+  return m_Files.count(memoryKey(p)) != 0;
+}
+
+FileStat MemoryFileSystem::do_stat(fs::path const& p)
+{
+  std::string key = memoryKey(p);
+  FileStat res;
+  std::shared_lock<std::shared_mutex> lck(m_Mtx);
+  if (auto f = m_Files.find(key); f != m_Files.end())
+  {
+    res.exists = true;
+    res.size = f->second.content->size();
+    res.mtime = f->second.mtime;
+  }
+  else if (m_Dirs.count(key))
+  {
+    res.exists = true;
+    res.directory = true;
+  }
+  return res;
+}
+
+std::unique_ptr<std::istream> MemoryFileSystem::do_open(fs::path const& p)
+{
+  std::shared_lock<std::shared_mutex> lck(m_Mtx);
+  auto f = m_Files.find(memoryKey(p));
+  if (f == m_Files.end())
+    return nullptr;
+  return std::make_unique<MemoryStream>(f->second.content);
+}
+
+bool MemoryFileSystem::do_read(fs::path const& p, std::string &content)
+{
+  std::shared_lock<std::shared_mutex> lck(m_Mtx);
+  auto f = m_Files.find(memoryKey(p));
+  if (f == m_Files.end())
+  {
+    content.clear();
+    return false;
+  }
+  content = *f->second.content;
+  return true;
+}
+
+bool MemoryFileSystem::do_list(fs::path const& dir, std::vector<DirEntry> &entries)
+{
+  std::string key = memoryKey(dir);
+  std::shared_lock<std::shared_mutex> lck(m_Mtx);
+  auto d = m_Dirs.find(key);
+  if (d == m_Dirs.end())
+    return false;
+  for(auto const& name : d->second)
+    entries.push_back(DirEntry{name, m_Dirs.count((fs::path(key) / name).string()) != 0});
+  return true;
+}
+
+bool MemoryFileSystem::do_equivalent(fs::path const& a, fs::path const& b)
+{
+  std::string ka = memoryKey(a);
+  if (ka != memoryKey(b))
+    return false;
+  std::shared_lock<std::shared_mutex> lck(m_Mtx);
+  return m_Files.count(ka) || m_Dirs.count(ka);
+}
+
+/*************************************************************************/
+/*OverlayFileSystem                                                      */
+/*************************************************************************/
+OverlayFileSystem::OverlayFileSystem(std::shared_ptr<MemoryFileSystem> upper, std::shared_ptr<FileSystem> lower):
+  FileSystem("overlay"),
+  m_Upper(std::move(upper)),
+  m_Lower(std::move(lower))
+{
+}
+
+void OverlayFileSystem::report() const
+{
+  FileSystem::report();
+  m_Upper->report();
+  m_Lower->report();
+}
+
+FileStat OverlayFileSystem::do_stat(fs::path const& p)
+{
+  FileStat st = m_Upper->stat(p);
+  if (st.exists && !st.directory)
+    return st;
+  FileStat lower = m_Lower->stat(p);
+  return lower.exists ? lower : st;
+}
+
+std::unique_ptr<std::istream> OverlayFileSystem::do_open(fs::path const& p)
+{
+  return m_Upper->contains(p) ? m_Upper->open(p) : m_Lower->open(p);
+}
+
+bool OverlayFileSystem::do_read(fs::path const& p, std::string &content)
+{
+  return m_Upper->contains(p) ? m_Upper->read(p, content) : m_Lower->read(p, content);
+}
+
+bool OverlayFileSystem::do_list(fs::path const& dir, std::vector<DirEntry> &entries)
+{
+  std::vector<DirEntry> upper;
+  bool in_upper = m_Upper->list(dir, upper);
+  bool in_lower = m_Lower->list(dir, entries);
+  for(auto &u : upper)
+  {
+    auto same = [&](DirEntry const& e){ return e.name == u.name; };
+    if (std::find_if(entries.begin(), entries.end(), same) == entries.end())
+      entries.push_back(std::move(u));
+  }
+  return in_upper || in_lower;
+}
+
+void OverlayFileSystem::do_stat_batch(std::vector<fs::path> const& paths, std::vector<FileStat> &out)
+{
+  out.resize(paths.size());
+  std::vector<size_t> lower_idx;
+  std::vector<fs::path> lower_paths;
+  for(size_t i = 0; i < paths.size(); ++i)
+  {
+    if (m_Upper->contains(paths[i]))
+      out[i] = m_Upper->stat(paths[i]);
+    else
+    {
+      lower_idx.push_back(i);
+      lower_paths.push_back(paths[i]);
+    }
+  }
+  std::vector<FileStat> lower;
+  m_Lower->stat(lower_paths, lower);
+  for(size_t k = 0; k < lower_idx.size(); ++k)
+  {
+    //a directory made up only by buffers
+    out[lower_idx[k]] = lower[k].exists ? lower[k] : m_Upper->stat(lower_paths[k]);
+  }
+}
+
+void OverlayFileSystem::do_read_batch(std::vector<fs::path> const& paths, std::vector<FileStat> const& sts, std::vector<std::string> &contents)
+{
+  contents.resize(paths.size());
+  std::vector<size_t> lower_idx;
+  std::vector<fs::path> lower_paths;
+  std::vector<FileStat> lower_sts;
+  for(size_t i = 0; i < paths.size(); ++i)
+  {
+    if (m_Upper->contains(paths[i]))
+      m_Upper->read(paths[i], contents[i]);
+    else
+    {
+      lower_idx.push_back(i);
+      lower_paths.push_back(paths[i]);
+      lower_sts.push_back(i < sts.size() ? sts[i] : FileStat());
+    }
+  }
+  std::vector<std::string> lower;
+  m_Lower->read(lower_paths, lower_sts, lower);
+  for(size_t k = 0; k < lower_idx.size(); ++k)
+    contents[lower_idx[k]] = std::move(lower[k]);
+}
+
+bool OverlayFileSystem::do_equivalent(fs::path const& a, fs::path const& b)
+{
+  //buffers have no identity on the disk, their paths are compared
+  if (m_Upper->contains(a) || m_Upper->contains(b))
+    return memoryKey(a) == memoryKey(b);
+  return m_Lower->equivalent(a, b);
+}
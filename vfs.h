@@ -0,0 +1,153 @@
+#ifndef VFS_H_
+#define VFS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <map>
+#include <memory>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "file_io.h"
+
+namespace fs = std::filesystem;
+
+//where the inputs are read from: sources, headers, compile_commands.json
+//outputs, the caches and the stamp always go to the disk
+class FileSystem
+{
+public:
+  struct DirEntry
+  {
+    std::string name;
+    bool directory = false;
+  };
+
+  explicit FileSystem(std::string name): m_Name(std::move(name)) {}
+  virtual ~FileSystem() = default;
+
+  FileStat stat(fs::path const& p);
+  bool exists(fs::path const& p) { return stat(p).exists; }
+  //for parsing as a stream, nullptr if it can't be opened
+  std::unique_ptr<std::istream> open(fs::path const& p);
+  bool read(fs::path const& p, std::string &content);
+  bool list(fs::path const& dir, std::vector<DirEntry> &entries);
+  //both exist and are the same file or directory
+  bool equivalent(fs::path const& a, fs::path const& b);
+
+  //one result per path, a backend that keeps them in flight together says so with batching()
+  void stat(std::vector<fs::path> const& paths, std::vector<FileStat> &out);
+  //sts from a stat done just before size the reads, failed reads are left empty
+  void read(std::vector<fs::path> const& paths, std::vector<FileStat> const& sts, std::vector<std::string> &contents);
+  virtual bool batching() const { return false; }
+
+  //operation counts as --stats values, layers below report their own
+  virtual void report() const;
+
+protected:
+  virtual FileStat do_stat(fs::path const& p) = 0;
+  virtual std::unique_ptr<std::istream> do_open(fs::path const& p) = 0;
+  virtual bool do_read(fs::path const& p, std::string &content) = 0;
+  virtual bool do_list(fs::path const& dir, std::vector<DirEntry> &entries) = 0;
+  virtual bool do_equivalent(fs::path const& a, fs::path const& b) = 0;
+  //one by one unless overridden
+  virtual void do_stat_batch(std::vector<fs::path> const& paths, std::vector<FileStat> &out);
+  virtual void do_read_batch(std::vector<fs::path> const& paths, std::vector<FileStat> const& sts, std::vector<std::string> &contents);
+
+private:
+  enum Op { Stat, Open, Read, List, Equivalent, OpCount };
+
+  std::string m_Name;
+  std::atomic<uint64_t> m_Ops[OpCount] = {};
+};
+
+class DiskFileSystem: public FileSystem
+{
+public:
+  DiskFileSystem(): FileSystem("disk") {}
+
+  //through io_uring once enabled
+  bool batching() const override;
+
+protected:
+  FileStat do_stat(fs::path const& p) override;
+  std::unique_ptr<std::istream> do_open(fs::path const& p) override;
+  bool do_read(fs::path const& p, std::string &content) override;
+  bool do_list(fs::path const& dir, std::vector<DirEntry> &entries) override;
+  bool do_equivalent(fs::path const& a, fs::path const& b) override;
+  void do_stat_batch(std::vector<fs::path> const& paths, std::vector<FileStat> &out) override;
+  void do_read_batch(std::vector<fs::path> const& paths, std::vector<FileStat> const& sts, std::vector<std::string> &contents) override;
+};
+
+//absolute paths only, directories exist as long as a file is under them
+//mtime is a hash of the content, so the same content always looks unchanged to the caches,
+//and it is later than any mtime on the disk
+class MemoryFileSystem: public FileSystem
+{
+public:
+  MemoryFileSystem(): FileSystem("memory") {}
+
+  void add(fs::path const& p, std::string content);
+  bool remove(fs::path const& p);
+  //copies every regular file under root from the disk, false if root can't be read
+  bool addTree(fs::path const& root);
+  bool contains(fs::path const& p) const;
+
+protected:
+  FileStat do_stat(fs::path const& p) override;
+  std::unique_ptr<std::istream> do_open(fs::path const& p) override;
+  bool do_read(fs::path const& p, std::string &content) override;
+  bool do_list(fs::path const& dir, std::vector<DirEntry> &entries) override;
+  bool do_equivalent(fs::path const& a, fs::path const& b) override;
+
+private:
+  struct File
+  {
+    std::shared_ptr<const std::string> content;
+    int64_t mtime;
+  };
+
+  mutable std::shared_mutex m_Mtx;
+  std::map<std::string, File> m_Files;
+  std::map<std::string, std::set<std::string>> m_Dirs;//files and subdirectories by name
+};
+
+//files of the upper layer hide the ones of the lower layer, e.g. unsaved editor buffers over the disk
+class OverlayFileSystem: public FileSystem
+{
+public:
+  OverlayFileSystem(std::shared_ptr<MemoryFileSystem> upper, std::shared_ptr<FileSystem> lower);
+
+  void report() const override;
+  bool batching() const override { return m_Lower->batching(); }
+
+protected:
+  FileStat do_stat(fs::path const& p) override;
+  std::unique_ptr<std::istream> do_open(fs::path const& p) override;
+  bool do_read(fs::path const& p, std::string &content) override;
+  bool do_list(fs::path const& dir, std::vector<DirEntry> &entries) override;
+  bool do_equivalent(fs::path const& a, fs::path const& b) override;
+  //what the buffers don't have goes to the lower layer as one batch
+  void do_stat_batch(std::vector<fs::path> const& paths, std::vector<FileStat> &out) override;
+  void do_read_batch(std::vector<fs::path> const& paths, std::vector<FileStat> const& sts, std::vector<std::string> &contents) override;
+
+private:
+  std::shared_ptr<MemoryFileSystem> m_Upper;
+  std::shared_ptr<FileSystem> m_Lower;
+};
+
+//the disk unless replaced, replacing is meant for before a run starts
+FileSystem& getFileSystem();
+void setFileSystem(std::shared_ptr<FileSystem> vfs);
+
+//{"<path>": "<content>", ...} over the disk
+bool overlayFromJson(fs::path const& overlay_json);
+//every file under root read into memory once, the disk isn't looked at after that
+bool memoryFromTree(fs::path const& root);
+
+#endif
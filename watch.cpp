@@ -0,0 +1,205 @@
+#include "watch.h"
+
+#include <chrono>
+#include <exception>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "include_cache.h"
+#include "include_resolver.h"
+#include "log.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+namespace
+{
+//changes arriving within this time are handled together, editors and cmake write in bursts
+const int kDebounceMs = 50;
+
+class Watcher
+{
+public:
+  Watcher(): m_Fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {}
+  ~Watcher()
+  {
+    if (m_Fd >= 0)
+      ::close(m_Fd);
+  }
+
+  bool ok() const { return m_Fd >= 0; }
+
+  //directories are watched instead of files, so replacing a file by rename is seen as well
+  void watch_dir_of(fs::path const& f)
+  {
+    watch_dir(f.parent_path());
+  }
+
+  void watch_dir(fs::path const& d)
+  {
+    if (d.empty() || m_Dirs.count(d.string()))
+      return;
+    int wd = inotify_add_watch(m_Fd, d.c_str(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB);
+    m_Dirs.emplace(d.string(), wd);
+    if (wd < 0)
+      return;
+    m_ByWd[wd] = d;
+  }
+
+  size_t watched() const { return m_ByWd.size(); }
+
+  //waits for the first change and then until it's quiet for a while
+  //returns false if events were lost
+  bool wait(std::vector<std::string> &changed)
+  {
+    bool complete = true;
+    int timeout = -1;
+    for(;;)
+    {
+      pollfd p{m_Fd, POLLIN, 0};
+      int n = ::poll(&p, 1, timeout);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return complete;
+      complete = read_events(changed) && complete;
+      timeout = kDebounceMs;
+    }
+  }
+
+private:
+  bool read_events(std::vector<std::string> &changed)
+  {
+    bool complete = true;
+    alignas(inotify_event) char buf[16384];
+    ssize_t len;
+    while((len = ::read(m_Fd, buf, sizeof(buf))) > 0)
+    {
+      for(char *p = buf; p < buf + len;)
+      {
+        auto *ev = (inotify_event*)p;
+        p += sizeof(inotify_event) + ev->len;
+        if (ev->mask & IN_Q_OVERFLOW)
+          complete = false;
+        auto d = m_ByWd.find(ev->wd);
+        if (d != m_ByWd.end() && ev->len)
+          changed.push_back((d->second / ev->name).lexically_normal().string());
+      }
+    }
+    return complete;
+  }
+
+  int m_Fd;
+  std::unordered_map<std::string, int> m_Dirs;
+  std::unordered_map<int, fs::path> m_ByWd;
+};
+}
+#endif
+
+bool watchCompileCommands(CCOptions &options, reload_options_func const& reload)
+{
+#ifndef __linux__
+  lErr() << "Watching for changes is only supported on Linux\n";
+  return false;
+#else
+  Watcher watcher;
+  if (!watcher.ok())
+  {
+    lErr() << "Could not initialize inotify\n";
+    return false;
+  }
+
+  WatchState state;
+  for(;;)
+  {
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+      processCompileCommandsTo(options, &state);
+    }catch(std::exception const& e)
+    {
+      lErr() << "Regeneration failed: " << e.what() << "\n";
+      state.incremental.clear();
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    lWarn() << "Regenerated " << options.save_to << " in " << ms << "ms\n";
+
+    auto normal = [](fs::path const& p){ return fs::absolute(p).lexically_normal().string(); };
+    std::string cc = normal(options.compile_commands_json);
+    std::unordered_set<std::string> configs;
+    for(auto const& c : options.config_files)
+      configs.insert(normal(c));
+
+    std::unordered_map<std::string, std::string> scanned;//normalized -> as known to the cache
+    for(auto const& f : getIncludeCache().files())
+      scanned.emplace(normal(f), f);
+
+    watcher.watch_dir_of(cc);
+    for(auto const& c : configs)
+      watcher.watch_dir_of(c);
+    for(auto const& f : scanned)
+      watcher.watch_dir_of(f.first);
+    for(auto const& d : getIncludeResolver().directories())
+      watcher.watch_dir(d);
+    lInfo() << "Watching " << watcher.watched() << " directories\n";
+
+    //anything else in the watched directories, e.g. our own output, is ignored
+    bool rerun = false, reconfigure = false, complete = true;
+    std::unordered_set<std::string> changed;
+    while(!rerun)
+    {
+      std::vector<std::string> events;
+      complete = watcher.wait(events) && complete;
+      for(auto const& e : events)
+      {
+        if (configs.count(e))
+          reconfigure = true;
+        else if (e == cc)
+          rerun = true;
+        else if (scanned.count(e))
+          changed.insert(e);
+        //created or removed in a directory searched for includes
+        else if (getIncludeResolver().invalidate(e))
+          changed.insert(e);
+      }
+      rerun = rerun || reconfigure || !complete || !changed.empty();
+    }
+
+    if (reconfigure)
+    {
+      lWarn() << "Config changed, reloading options\n";
+      CCOptions fresh;
+      if (reload(fresh))
+        options = std::move(fresh);
+      else
+        lErr() << "Could not reload options, keeping the previous ones\n";
+    }
+
+    if (reconfigure || !complete)
+    {
+      //nothing is known about what changed
+      for(auto const& f : scanned)
+        getIncludeCache().invalidate(f.second);
+      state.changed.reset();
+    }
+    else
+    {
+      state.changed.emplace();
+      for(auto const& f : changed)
+      {
+        lInfo() << "Changed: " << f << "\n";
+        if (auto s = scanned.find(f); s != scanned.end())
+          getIncludeCache().invalidate(s->second);
+        state.changed->push_back(f);
+      }
+    }
+  }
+#endif
+}
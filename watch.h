@@ -0,0 +1,15 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <functional>
+
+#include "compile_commands_processor.h"
+
+//re-reads the options, e.g. from the changed config file
+using reload_options_func = std::function<bool(CCOptions &options)>;
+
+//regenerates the output whenever compile_commands, the config or any scanned file changes
+//never returns unless watching is not possible
+bool watchCompileCommands(CCOptions &options, reload_options_func const& reload);
+
+#endif